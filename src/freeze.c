@@ -0,0 +1,337 @@
+/**
+ * Frozen dictionaries for the ngtemplate engine.  ngt_dictionary_freeze() moves the items of a
+ * dictionary that is done being built out of its item table and into one block of memory: the
+ * items side by side, the markers and string values packed behind them, and a minimal perfect
+ * hash to find them.
+ *
+ * The hash is built with "hash and displace".  A marker's first hash picks a bucket, and every
+ * bucket gets the seed for a second hash that sends each of its markers to a slot of its own.  A
+ * bucket with a single marker stores its slot directly instead.  A lookup is one or two hashes of
+ * the marker and one string compare, with no locks and no allocation.  Nothing in the block is 
+ * written again except the memoized template of an include, which is published atomically like
+ * it always is, so any number of threads can read a frozen dictionary at once.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "ngtemplate.h"
+#include "internal.h"
+
+/* Gives up on a bucket after this many seeds, which only happens with a broken hash */
+#define FROZEN_MAX_SEED     (1 << 24)
+
+/**
+ * Returns the item under the given marker in the frozen dictionary, or 0 if there is none
+ */
+_dictionary_item* _frozen_find(const _frozen_dictionary* frozen, const char* marker)  {
+    _dictionary_item* item;
+    int seed;
+    
+    if (!frozen->count) {
+        return 0;
+    }
+    
+    // Seed 0 picks the bucket
+    seed = frozen->seeds[_marker_hash(marker, 0) % frozen->count];
+    if (!seed)  {
+        // Nothing hashed to this bucket
+        return 0;
+    }
+    
+    item = &frozen->items[seed < 0 ? (unsigned)(-seed - 1) : _marker_hash(marker, seed) % frozen->count];
+    return strcmp(item->marker, marker) ? 0 : item;
+}
+
+/**
+ * Helper function - qsort() comparison putting the biggest buckets first
+ */
+static int _frozen_bucket_compare(const void* a, const void* b)    {
+    return ((const _frozen_bucket*)b)->count - ((const _frozen_bucket*)a)->count;
+}
+
+/**
+ * Helper function - finds a seed that sends every marker of the bucket to its own free slot, and
+ * takes those slots
+ *
+ * Returns the seed, or 0 if none was found
+ */
+static int _frozen_place(_frozen_bucket* bucket, _dictionary_item** sources, int* slots, unsigned count, char* taken) {
+    unsigned seed, slot;
+    int i, j;
+    
+    for (seed = 1; seed < FROZEN_MAX_SEED; seed++)  {
+        for (i = 0; i < bucket->count; i++) {
+            slot = _marker_hash(sources[bucket->first + i]->marker, seed) % count;
+            if (taken[slot])    {
+                break;
+            }
+            
+            // Markers of the same bucket can't share a slot either
+            for (j = 0; j < i; j++) {
+                if (slots[bucket->first + j] == (int)slot)  {
+                    break;
+                }
+            }
+            
+            if (j < i)  {
+                break;
+            }
+            
+            slots[bucket->first + i] = slot;
+        }
+        
+        if (i == bucket->count) {
+            for (i = 0; i < bucket->count; i++) {
+                taken[slots[bucket->first + i]] = 1;
+            }
+            
+            return (int)seed;
+        }
+    }
+    
+    return 0;
+}
+
+/**
+ * Helper function - works out where every item goes.  The items are sorted by bucket, and slots
+ * gets the slot of each one
+ *
+ * Returns 0 if the operation succeeded, -1 otherwise
+ */
+static int _frozen_build_hash(_frozen_dictionary* frozen, _dictionary_item** sources, int* slots)  {
+    _frozen_bucket* buckets;
+    _dictionary_item** sorted;
+    char* taken;
+    unsigned i, b, free_slot, count = frozen->count;
+    int* fill;
+    int res = 0;
+    
+    buckets = (_frozen_bucket*)malloc(count * sizeof(_frozen_bucket));
+    memset(buckets, 0, count * sizeof(_frozen_bucket));
+    sorted = (_dictionary_item**)malloc(count * sizeof(_dictionary_item*));
+    fill = (int*)malloc(count * sizeof(int));
+    taken = (char*)malloc(count);
+    memset(taken, 0, count);
+    
+    // Group the items by bucket, which the hash they already have picks
+    for (i = 0; i < count; i++) {
+        fill[i] = sources[i]->hash % count;
+        buckets[fill[i]].count++;
+    }
+    
+    for (b = 0; b < count; b++) {
+        buckets[b].index = b;
+        buckets[b].first = b ? buckets[b - 1].first + buckets[b - 1].count : 0;
+    }
+    
+    for (i = 0; i < count; i++) {
+        b = fill[i];
+        sorted[buckets[b].first + buckets[b].placed++] = sources[i];
+    }
+    memcpy(sources, sorted, count * sizeof(_dictionary_item*));
+    
+    // The big buckets are the hard ones to place, so they go while most slots are still free
+    qsort(buckets, count, sizeof(_frozen_bucket), _frozen_bucket_compare);
+    
+    free_slot = 0;
+    for (i = 0; i < count && buckets[i].count; i++) {
+        if (buckets[i].count > 1)   {
+            frozen->seeds[buckets[i].index] = _frozen_place(&buckets[i], sources, slots, count, taken);
+            if (!frozen->seeds[buckets[i].index])   {
+                res = -1;
+                break;
+            }
+        } else {
+            while (taken[free_slot])    {
+                free_slot++;
+            }
+            
+            taken[free_slot] = 1;
+            slots[buckets[i].first] = free_slot;
+            frozen->seeds[buckets[i].index] = -(int)free_slot - 1;
+        }
+    }
+    
+    free(buckets);
+    free(sorted);
+    free(fill);
+    free(taken);
+    
+    return res;
+}
+
+/**
+ * Helper function - copies the string into the string block
+ *
+ * Returns the copy
+ */
+static char* _frozen_pack(char** strings, const char* str, size_t length)   {
+    char* copy = *strings;
+    
+    memcpy(copy, str, length);
+    copy[length] = '\0';
+    *strings += length + 1;
+    
+    return copy;
+}
+
+/**
+ * Helper function - moves the items of the dictionary into a frozen layout
+ *
+ * Returns the frozen layout, or 0 if it could not be built
+ */
+static _frozen_dictionary* _frozen_new(ngt_dictionary* dict)   {
+    _frozen_dictionary* frozen;
+    _dictionary_item** sources, *item;
+    _item_block* block;
+    size_t strings_size;
+    unsigned i, j, count;
+    char* strings;
+    int* slots;
+    
+    count = 0;
+    strings_size = 0;
+    for (block = dict->blocks; block; block = block->next)  {
+        for (j = 0; j < block->count; j++)  {
+            item = &block->items[j];
+            if (!item->marker)  {
+                // Removed
+                continue;
+            }
+            
+            strings_size += strlen(item->marker) + 1;
+            if (item->type == ITEM_STRING && !(item->flags & ITEM_POOLED_VALUE))    {
+                strings_size += strlen(item->val.string_value) + 1;
+            } else if (item->type == ITEM_BUFFER && item->val.buffer_value.owned)  {
+                strings_size += item->val.buffer_value.length + 1;
+            }
+            count++;
+        }
+    }
+    
+    // One block: the header, the items, the seeds and then the strings
+    frozen = (_frozen_dictionary*)malloc(sizeof(_frozen_dictionary) + count * sizeof(_dictionary_item) +
+                                         count * sizeof(int) + strings_size);
+    frozen->count = count;
+    frozen->items = (_dictionary_item*)(frozen + 1);
+    frozen->seeds = (int*)(frozen->items + count);
+    memset(frozen->seeds, 0, count * sizeof(int));
+    strings = (char*)(frozen->seeds + count);
+    
+    sources = (_dictionary_item**)malloc((count ? count : 1) * sizeof(_dictionary_item*));
+    slots = (int*)malloc((count ? count : 1) * sizeof(int));
+    
+    i = 0;
+    for (block = dict->blocks; block; block = block->next)  {
+        for (j = 0; j < block->count; j++)  {
+            if (block->items[j].marker) {
+                sources[i++] = &block->items[j];
+            }
+        }
+    }
+    
+    if (count && _frozen_build_hash(frozen, sources, slots) != 0)   {
+        fprintf(stderr, "Could not build a perfect hash for a dictionary of %u markers\n", count);
+        free(frozen);
+        frozen = 0;
+    }
+    
+    for (i = 0; frozen && i < count; i++)   {
+        item = &frozen->items[slots[i]];
+        memcpy(item, sources[i], sizeof(_dictionary_item));
+        
+        // Whatever was inline in the original is packed like everything else.  Pooled values
+        // stay in the pool, which outlives the dictionary anyway
+        item->flags = 0;
+        item->marker = _frozen_pack(&strings, sources[i]->marker, strlen(sources[i]->marker));
+        if (item->type == ITEM_STRING && !(sources[i]->flags & ITEM_POOLED_VALUE)) {
+            item->val.string_value = _frozen_pack(&strings, item->val.string_value, strlen(item->val.string_value));
+        } else if (item->type == ITEM_BUFFER && item->val.buffer_value.owned)  {
+            item->val.buffer_value.data = _frozen_pack(&strings, item->val.buffer_value.data, item->val.buffer_value.length);
+        } else if (item->type & ITEM_D_LIST)    {
+            // Sections and includes now belong to the frozen item, so clearing the table must
+            // not destroy them along with the original
+            memset(&sources[i]->val, 0, sizeof(sources[i]->val));
+        }
+    }
+    
+    free(sources);
+    free(slots);
+    
+    return frozen;
+}
+
+/**
+ * Helper function - destroys what the items of the frozen dictionary own, and the layout itself
+ */
+void _frozen_destroy(_frozen_dictionary* frozen)    {
+    _dictionary_item* item;
+    unsigned i;
+    
+    for (i = 0; i < frozen->count; i++) {
+        item = &frozen->items[i];
+        
+        if (item->type & ITEM_D_LIST && item->val.d_list_value != 0)    {
+            list_destroy(item->val.d_list_value);
+            free(item->val.d_list_value);
+        }
+        
+        if (item->type == ITEM_INCLUDE) {
+            if (item->val.include_value.cleanup_template)   {
+                item->val.include_value.cleanup_template(item->marker, item->val.include_value.template);
+            }
+            
+            if (item->val.include_value.filename)   {
+                free(item->val.include_value.filename);
+            }
+        }
+    }
+    
+    free(frozen);
+}
+
+/**
+ * Freezes the dictionary, and the dictionaries of its sections if recurse is nonzero
+ *
+ * Returns 0 if the operation succeeded, -1 otherwise
+ */
+int _freeze_dictionary(ngt_dictionary* dict, int recurse)   {
+    _frozen_dictionary* frozen;
+    _dictionary_item* item;
+    _item_cursor cursor;
+    list_element* child;
+    int res = 0;
+    
+    // The I/O threads may still be loading includes that live in the items we are about to move
+    _prefetch_wait(&dict->prefetching);
+    
+    if (!dict->frozen)  {
+        frozen = _frozen_new(dict);
+        if (!frozen)    {
+            return -1;
+        }
+        
+        // The table only holds the shells of the moved items now
+        _table_clear(dict);
+        dict->frozen = frozen;
+    }
+    
+    if (!recurse)   {
+        return 0;
+    }
+    
+    memset(&cursor, 0, sizeof(_item_cursor));
+    while ((item = _next_item(dict, &cursor)) != 0) {
+        if (!(item->type & ITEM_D_LIST) || !item->val.d_list_value) {
+            continue;
+        }
+        
+        for (child = list_head(item->val.d_list_value); child; child = list_next(child)) {
+            if (_freeze_dictionary(ROW_DICTIONARY(child), 1) != 0)  {
+                res = -1;
+            }
+        }
+    }
+    
+    return res;
+}
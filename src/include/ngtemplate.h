@@ -1,11 +1,23 @@
 /**
  * Public interface to the ngtemplate engine
+ *
+ * Thread safety:
+ *  - Once a template is prepared (template string, delimiters, modifiers and callbacks are set) and
+ *    a dictionary is no longer being modified, any number of threads may call ngt_expand_dictionary()
+ *    on them at the same time without any locking.  ngt_expand() is equally safe as long as nobody
+ *    calls ngt_set_dictionary() on the shared template in the meantime
+ *  - Include templates are loaded at most once per dictionary item, even when several threads
+ *    reach the include at the same time
+ *  - Building a template or a dictionary is NOT thread-safe.  Finish building it before sharing it
+ *  - User callbacks (modifiers, variable_missing, get_template) may be called from several threads
+ *    at once and must be thread-safe themselves
  */
 #ifndef NGTEMPLATE_H
 #define NGTEMPLATE_H
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include "hashtable.h"
 #include "stringbuilder.h"
 
@@ -43,13 +55,71 @@ typedef void (*modifier_fn)(const char* name, const char* args, const char* mark
  */
 typedef char* (*get_variable_fn)(const char* marker);
 
+/**
+ * Pointer to a function that will be called once before a template is expanded with the names of
+ * all the variable markers in it that have no value in the dictionary, so they can be looked up in
+ * one go
+ *   markers - The marker names, each one only once
+ *   values - Set values[i] to an allocated string with the value of markers[i], or leave it 0
+ *   count - The number of markers
+ */
+typedef void (*get_variables_fn)(const char** markers, char** values, int count);
+
+/**
+ * Pointer to a function that will be called to compute the value of a lazy variable marker the 
+ * first time an expansion reaches it
+ *   marker - The marker name
+ *   ctx - The pointer that was given to ngt_set_lazy()
+ *
+ * Return an allocated string containing the value, or 0
+ */
+typedef char* (*lazy_value_fn)(const char* marker, void* ctx);
+
+/**
+ * The markers a template references, each with a fixed slot.  Dictionaries bound to a schema keep
+ * the values of those markers in a flat array, and expanding the template the schema was made 
+ * from reads them by slot without hashing marker names
+ */
+typedef struct ngt_schema_tag ngt_schema;
+
+/**
+ * One shared copy of every long string value set in the dictionaries that use the pool, see 
+ * ngt_dictionary_set_pool()
+ */
+typedef struct ngt_string_pool_tag ngt_string_pool;
+
 typedef struct ngt_dictionary_tag   {
-    hashtable dictionary;
-    int should_expand;                          /* Determines whether the section represented by
-                                                    this dictionary should be shown */
-    struct ngt_dictionary_tag* parent;
+    struct _dictionary_item_tag** index;        /* The items by the hash of their marker, open
+                                                    addressed.  A power of two long */
+    unsigned index_capacity;
+    unsigned index_used;                        /* Places taken by items or by removed ones */
+    struct _item_block_tag* blocks;             /* Where the items live, newest block first */
+    struct _dictionary_item_tag* removed;       /* Removed items, to be reused first */
+    struct ngt_dictionary_tag* parent;          /* The dictionary this one was first added to.  
+                                                    Expansions don't use it, they know which 
+                                                    section they are in */
+    int references;                             /* See ngt_dictionary_ref() */
+    int prefetching;                            /* Background include loads started by 
+                                                    ngt_prefetch_includes() still in flight */
+    struct ngt_dictionary_tag* base;            /* Markers not found here are looked up in the 
+                                                    base, see ngt_dictionary_overlay() */
+    struct _frozen_dictionary_tag* frozen;      /* Where the items are once the dictionary is
+                                                    frozen, see ngt_dictionary_freeze() */
+    ngt_schema* schema;                         /* The schema the dictionary is bound to, if any */
+    struct _dictionary_item_tag* slots;         /* The values of the schema's markers, by slot */
+    ngt_string_pool* pool;                      /* Where long string values are kept, if set */
 } ngt_dictionary;
 
+/**
+ * Pointer to a function that hands out the dictionaries of a section one at a time
+ *   marker - The name of the section
+ *   ctx - The pointer that was given to ngt_set_section_iterator()
+ *
+ * Return a new dictionary for the next time the section repeats, or 0 when there are no more.  
+ * Each dictionary is destroyed for you as soon as it has been expanded
+ */
+typedef ngt_dictionary* (*section_next_fn)(const char* marker, void* ctx);
+
 // Represents a start or stop marker delimiter
 #define MAX_DELIMITER_LENGTH    8               /* I really don't know why someone would want a 
                                                     delimiter this long, but just in case */
@@ -73,8 +143,37 @@ typedef struct ngt_template_tag {
         
     modifier_fn         modifier_missing;
     get_variable_fn     variable_missing;
+    get_variables_fn    variables_missing;
+    
+    char*   loaded_tmpl;                        /* The template string loaded by ngt_load_from_*(),
+                                                    released along with the template */
+    int     loaded_file;                        /* Nonzero if loaded_tmpl came from 
+                                                    _map_template_file() or 
+                                                    _read_template_file() */
+    
+    struct _include_paths_tag* include_paths;   /* Set by ngt_add_include_path() */
 } ngt_template;
 
+/**
+ * Pointer to a function that will be called to set up a template the system created for you (for
+ * example, to add custom modifiers to templates loaded by a registry)
+ */
+typedef void (*init_template_fn)(ngt_template* tpl);
+
+/**
+ * A thread-safe collection of named templates.  New versions of a template can be published while
+ * other threads are expanding the old one; readers never block and old versions are freed once
+ * no reader can still be using them.  Templates loaded from files can be evicted under a memory
+ * limit and are reloaded on demand
+ */
+typedef struct ngt_registry_tag ngt_registry;
+
+/**
+ * Initializes the ngtemplate library.  This is called for you by ngt_new(), but it is safe to call
+ * it yourself, any number of times and from any number of threads
+ */
+void ngt_init();
+
 /**
  * Creates a new ngt_template
  *
@@ -88,13 +187,141 @@ ngt_template* ngt_new();
  */
 ngt_dictionary* ngt_dictionary_new();
 
+/**
+ * Creates a new, empty dictionary layered over "base".  Markers that are not set in the overlay are
+ * looked up in the base, and whatever is set in the overlay hides the base value of the same name, 
+ * so one fully built base can be shared by every request while each request only fills in what is
+ * its own.  Markers a section of the base doesn't have are looked up in the overlay first, so the
+ * values of the request are seen inside the shared sections as well.  Hiding a section of the base
+ * with ngt_set_section_visibility() only hides it in the overlay.  The overlay of a dictionary 
+ * bound to a schema is bound to the same schema.  The base is never modified through the overlay,
+ * and must outlive it
+ */
+ngt_dictionary* ngt_dictionary_overlay(ngt_dictionary* base);
+
+/**
+ * Freezes a dictionary that is done being built, and the dictionaries of its sections as well if
+ * recurse is nonzero.  Its markers and values are moved into one compact block and found through
+ * a perfect hash, which makes lookups cheaper and never takes a lock.  A frozen dictionary can't
+ * be changed anymore: layer an overlay over it with ngt_dictionary_overlay() instead
+ *
+ * Returns 0 if the operation succeeded, -1 otherwise
+ */
+int ngt_dictionary_freeze(ngt_dictionary* dict, int recurse);
+
+/**
+ * Creates the schema of the given template: a slot for every variable, section and include it
+ * references, numbered from 0 in the order they first appear.  The schema refers to the template
+ * text, which must not change while the schema is in use
+ *
+ * Returns the schema, or NULL if the template has no template text
+ */
+ngt_schema* ngt_schema_from_template(ngt_template* tpl);
+
+/**
+ * Destroys the schema.  No dictionary may be bound to it anymore
+ */
+void ngt_schema_destroy(ngt_schema* schema);
+
+/**
+ * Returns the slot of the given marker in the schema, or -1 if the template doesn't reference it
+ */
+int ngt_schema_slot(const ngt_schema* schema, const char* marker);
+
+/**
+ * Returns the number of slots in the schema
+ */
+int ngt_schema_slot_count(const ngt_schema* schema);
+
+/**
+ * Creates a new dictionary bound to the schema.  Values of markers that have a slot in the schema
+ * are kept in a flat array, however they are set, and everything else in its item table as usual.
+ * The schema must outlive the dictionary
+ */
+ngt_dictionary* ngt_dictionary_new_from_schema(ngt_schema* schema);
+
+/**
+ * Sets a string value in the given slot of a schema-bound dictionary, which is the same as setting
+ * it under the marker of the slot, but without looking the marker up
+ *
+ * Returns 0 if the operation succeeded, -1 otherwise
+ */
+int ngt_set_slot(ngt_dictionary* dict, int slot, const char* value);
+
+/**
+ * Creates a new, empty string pool
+ */
+ngt_string_pool* ngt_string_pool_new();
+
+/**
+ * Destroys the string pool and every string in it.  No dictionary may use it anymore
+ */
+void ngt_string_pool_destroy(ngt_string_pool* pool);
+
+/**
+ * Gives the dictionary and the dictionaries of its sections the pool.  Long string values they
+ * already have are moved into the pool, and so is every long string value set from now on, in
+ * them or in dictionaries added to them later.  Identical values then share a single copy, which
+ * stays in the pool until the pool is destroyed, so the pool must outlive the dictionaries
+ *
+ * NOTE: Section dictionaries that are shared with ngt_dictionary_ref() keep the pool they have, 
+ *      since one of their other sections may well outlive this pool
+ */
+void ngt_dictionary_set_pool(ngt_dictionary* dict, ngt_string_pool* pool);
+
 /** 
- * Destroys the given template.  Does NOT destroy the dictionary associated with the template
+ * Destroys the given template.  Does NOT destroy the dictionary associated with the template, nor
+ * a template string you assigned yourself
  */
 void ngt_destroy(ngt_template* tpl);
 
 /**
- * Destroys the given template dictionary and any sub-dictionaries
+ * Empties the dictionary of all its values and sections, but keeps the memory it had for the next
+ * values.  A frozen dictionary can be changed again after a reset.  The dictionary keeps its 
+ * schema, base and string pool, and its references
+ */
+void ngt_dictionary_reset(ngt_dictionary* dict);
+
+/**
+ * Returns an empty dictionary, reusing one the calling thread gave back with 
+ * ngt_dictionary_release() if there is any.  Steady request handling then keeps using the same
+ * dictionaries and never allocates their memory again
+ */
+ngt_dictionary* ngt_dictionary_acquire();
+
+/**
+ * Drops a reference to the dictionary like ngt_dictionary_destroy(), but once that was the last
+ * one the dictionary and its section dictionaries are reset and kept for the calling thread's next
+ * ngt_dictionary_acquire() instead of being destroyed.  Dictionaries with a schema or a base are
+ * always destroyed
+ */
+void ngt_dictionary_release(ngt_dictionary* dict);
+
+/**
+ * Moves every value and section of src into dst, and leaves src empty.  Strings and section rows
+ * are not copied but change hands, so dictionaries built on separate threads can be put together
+ * cheaply.  When both have a value for the same marker, the rows of a section in src are added
+ * after the rows dst has, and any other value of src replaces the one in dst.  src still has to be
+ * destroyed afterwards, and can't be frozen.  If it has a string pool, that pool must outlive dst
+ *
+ * Returns 0 if the operation succeeded, -1 otherwise
+ */
+int ngt_dictionary_merge(ngt_dictionary* dst, ngt_dictionary* src);
+
+/**
+ * Takes another reference to the dictionary, so the same dictionary can be added under one more
+ * section with ngt_add_dictionary(), in the same parent or in another one.  Every section it is
+ * added to drops its reference when it is destroyed, and the dictionary goes with the last one.
+ * A shared dictionary keeps the string pool it had when it was first shared, see 
+ * ngt_dictionary_set_pool()
+ *
+ * Returns the dictionary
+ */
+ngt_dictionary* ngt_dictionary_ref(ngt_dictionary* dict);
+
+/**
+ * Drops a reference to the given template dictionary, and destroys it and its sub-dictionaries 
+ * once that was the last one.  A new dictionary has a single reference
  */
 void ngt_dictionary_destroy(ngt_dictionary* dict);
 
@@ -111,12 +338,26 @@ void ngt_set_dictionary(ngt_template* tpl, ngt_dictionary* dict);
 int ngt_load_from_file(ngt_template* tpl, FILE* fp);
 
 /**
- * Loads the template string from the given file name
+ * Loads the template string from the given file name.  The file is mapped into memory rather than
+ * copied, so its pages are shared with every other process using it, and it may be larger than 
+ * 2 GB.  The file may be replaced (renamed over) while the template is in use, but must not be 
+ * truncated or rewritten in place
  *
  * Returns 0 if successful, -1 otherwise
  */
 int ngt_load_from_filename(ngt_template* tpl, const char* filename);
 
+/**
+ * Adds a directory to search for include files in.  Filenames set with ngt_set_include_filename()
+ * are looked up in every directory in the order they were added, then relative to the working 
+ * directory.  Include files are cached with the search paths, so they are only read again when
+ * they change, no matter how many dictionaries include them
+ *
+ * NOTE: Add the search paths before expanding the template.  Dictionaries remember the include 
+ *       templates they were expanded with
+ */
+void ngt_add_include_path(ngt_template* tpl, const char* dir);
+
 /**
  * Sets the default start and end delimiters for the given template
  *
@@ -151,6 +392,14 @@ void ngt_set_modifier_missing_cb(ngt_template* tpl, modifier_fn mod_fn);
  */
 void ngt_set_variable_missing_cb(ngt_template* tpl, get_variable_fn get_fn);
 
+/**
+ * Sets a callback function that will be called once before every expansion with all the variable
+ * markers of the template that have no value in the dictionary.  Markers it leaves without a value
+ * go to the variable_missing callback when they are reached, or if there is none, to this callback
+ * again one at a time.  Values from either callback are remembered until the expansion is done
+ */
+void ngt_set_variables_missing_cb(ngt_template* tpl, get_variables_fn get_fn);
+
 /**
  * Returns nonzero if the variable with the given marker name equals str, zero otherwise
  */
@@ -164,6 +413,32 @@ int ngt_variable_equals(ngt_dictionary* dict, const char* marker, const char* st
  */
 int ngt_set_string(ngt_dictionary* dict, const char* marker, const char* value);
 
+/**
+ * Sets "count" string values in the template dictionary at once, values[i] under markers[i].
+ * Much cheaper than setting them one by one when filling a dictionary with many values
+ *
+ * Returns 0 if the operation succeeded, -1 otherwise
+ */
+int ngt_set_strings(ngt_dictionary* dict, const char** markers, const char** values, int count);
+
+/**
+ * Sets a string value in the template dictionary from the first "length" characters of "value",
+ * which does not have to be zero terminated.  The characters are copied
+ *
+ * Returns 0 if the operation succeeded, -1 otherwise
+ */
+int ngt_set_string_n(ngt_dictionary* dict, const char* marker, const char* value, size_t length);
+
+/**
+ * Sets a string value in the template dictionary that borrows the "length" characters at "value"
+ * instead of copying them.  They do not have to be zero terminated, but must stay valid and 
+ * unchanged for as long as the dictionary is used.  Expanding the marker copies them to the output
+ * in one go without looking for the end of the string
+ *
+ * Returns 0 if the operation succeeded, -1 otherwise
+ */
+int ngt_set_string_ref(ngt_dictionary* dict, const char* marker, const char* value, size_t length);
+
 /**
  * Sets a string value in the template dictionary using printf-style format specifiers.  Any
  * instance of "marker" in the template will be replaced by "value"
@@ -180,9 +455,48 @@ int ngt_set_stringf(ngt_dictionary* dict, const char* marker, const char* fmt, .
  */
 int ngt_set_int(ngt_dictionary* dict, const char* marker, int value);
 
+/**
+ * Sets a 64-bit integer value in the template dictionary.  The number is stored as it is and only
+ * formatted when an expansion reaches "marker"
+ *
+ * Returns 0 if the operations succeeded, -1 otherwise
+ */
+int ngt_set_int64(ngt_dictionary* dict, const char* marker, int64_t value);
+
+/**
+ * Sets a floating point value in the template dictionary.  The number is stored as it is and only
+ * formatted when an expansion reaches "marker", with up to 15 significant digits and always with
+ * a '.' as the decimal point, whatever the locale
+ *
+ * Returns 0 if the operations succeeded, -1 otherwise
+ */
+int ngt_set_double(ngt_dictionary* dict, const char* marker, double value);
+
+/**
+ * Sets a boolean value in the template dictionary.  Expands to "true" if value is nonzero, 
+ * "false" otherwise
+ *
+ * Returns 0 if the operations succeeded, -1 otherwise
+ */
+int ngt_set_bool(ngt_dictionary* dict, const char* marker, int value);
+
+/**
+ * Sets a value in the template dictionary that is only computed when an expansion actually reaches
+ * "marker" in a visible part of the template.  fn is called with ctx at most once per expansion
+ * and its value is used for every other instance of the marker in that expansion.  Expansions in
+ * several threads may call fn at the same time
+ *
+ * Returns 0 if the operations succeeded, -1 otherwise
+ */
+int ngt_set_lazy(ngt_dictionary* dict, const char* marker, lazy_value_fn fn, void* ctx);
+
 /**
  * On an include template dictionary, sets the filename that will be loaded to obtain the template data
  * NOTES: - It is illegal to call this function on a string value marker
+ *        - The file is looked up in the template's include paths, read into memory and cached with
+ *          them.  Dictionaries built later that include the same filename share it, and the disk 
+ *          is checked at most once a second for a changed file, which is then read again.  A 
+ *          dictionary keeps the version it first expanded with
  *        - Calling template_set_include_cb is not necessary if you set a filename, as the file will
  *          be looked up for you.  However, if you need to perform custom logic (such as searching
  *          through a list of pre-defined directories for the file), you can do the load logic yourself
@@ -210,7 +524,8 @@ int ngt_set_include_cb(ngt_dictionary* dict, const char* marker, get_template_fn
 /**
  * Sets the visibility for the section indicated by "section" in the given dictionary
  * 
- * NOTE: visibility can be one of NGT_SECTION_VISIBLE, NGT_SECTION_HIDDEN
+ * NOTE: visibility can be one of NGT_SECTION_VISIBLE, NGT_SECTION_HIDDEN.  Sections an overlay 
+ *      only gets from its base can be hidden, but not shown
  */
 void ngt_set_section_visibility(ngt_dictionary* dict, const char* section, int visibility);
 
@@ -218,13 +533,29 @@ void ngt_set_section_visibility(ngt_dictionary* dict, const char* section, int v
  * Adds a child dictionary under the given marker.  If there is an existing dictionary under this marker, 
  * the new dictionary will be ADDED to the end of the list, NOT replace the old one
  *
+ * The section takes over one reference to the child.  To add the same child under more sections,
+ * take a reference for each one with ngt_dictionary_ref().  Markers the child doesn't have are 
+ * looked up in whichever section the expansion finds it in
+ *
  * NOTE: Set visible to non-zero if you wish section to be shown automatically, zero if you wish to 
- *      hide it and show later with ngt_show_section();
+ *      hide it and show later with ngt_show_section();  The visibility belongs to this section, a 
+ *      child that is in other sections as well keeps its visibility there
  *
  * Returns 0 if the operation succeeded, -1 otherwise
  */
 int ngt_add_dictionary(ngt_dictionary* dict, const char* marker, ngt_dictionary* child, int visible);
 
+/**
+ * Makes "marker" a section whose dictionaries are pulled from next_fn one at a time while it is
+ * expanded, instead of all being added up front with ngt_add_dictionary().  Only the dictionary
+ * being expanded and the one after it exist at any time, no matter how often the section repeats.
+ * next_fn is called until it returns NULL every time the section is expanded.  Replaces any value
+ * the marker had
+ *
+ * Returns 0 if the operation succeeded, -1 otherwise
+ */
+int ngt_set_section_iterator(ngt_dictionary* dict, const char* marker, section_next_fn next_fn, void* ctx);
+
 /**
  * Expands the given template according to the dictionary, putting the result in "result" pointer.
  * Sufficient space will be allocated for the result, and it will then be 
@@ -234,6 +565,162 @@ int ngt_add_dictionary(ngt_dictionary* dict, const char* marker, ngt_dictionary*
  */
 int ngt_expand(ngt_template* tpl, char** result);
 
+/**
+ * Expands the given template according to the given dictionary instead of the one set on the
+ * template, putting the result in "result" pointer.  The template is not modified, so any number
+ * of threads may expand the same template at once, each with its own dictionary or a shared one
+ *
+ * Returns 0 if the template was successfully processed, -1 if there was an error
+ */
+int ngt_expand_dictionary(ngt_template* tpl, ngt_dictionary* dict, char** result);
+
+/**
+ * Starts loading the include templates that expanding the given template with the given 
+ * dictionary (or the template's own if it is NULL) may need, including the ones nested inside 
+ * other includes, on background I/O threads.  An expansion that follows only waits for the 
+ * includes it actually reaches, and only if they are still loading.  Include callbacks may be 
+ * called from the I/O threads.  Destroying, freezing or changing the dictionary, or any other one
+ * whose includes are being loaded (its sections, its parent, its base or the global dictionary), 
+ * waits for the loads to finish.  Include callbacks must therefore not change those dictionaries
+ */
+void ngt_prefetch_includes(ngt_template* tpl, ngt_dictionary* dict);
+
+/**
+ * Creates a new, empty template registry
+ */
+ngt_registry* ngt_registry_new();
+
+/**
+ * Destroys the registry and every template in it.  Stops the file watcher if it is running
+ *
+ * NOTE: No other thread may be using the registry, or any template acquired from it, anymore
+ */
+void ngt_registry_destroy(ngt_registry* reg);
+
+/**
+ * Sets a callback that will be called on every template the registry creates when loading a file,
+ * so you can add modifiers, missing callbacks or delimiters before the template is published
+ */
+void ngt_registry_set_init_cb(ngt_registry* reg, init_template_fn init_fn);
+
+/**
+ * Adds a directory to search for include files in when expanding templates through 
+ * ngt_registry_expand().  Works like ngt_add_include_path(), for every template in the registry 
+ * that doesn't have include paths of its own
+ */
+void ngt_registry_add_include_path(ngt_registry* reg, const char* dir);
+
+/**
+ * Publishes a template under the given name, atomically replacing the current version if there
+ * is one.  The registry takes ownership of the template.  Threads that are expanding the old 
+ * version will finish with it; the next ngt_registry_acquire() returns the new one
+ *
+ * Returns 0 if the operation succeeded, -1 otherwise
+ */
+int ngt_registry_publish(ngt_registry* reg, const char* name, ngt_template* tpl);
+
+/**
+ * Loads the given file into a new template and publishes it under the given name.  If the file
+ * cannot be loaded the current version, if any, stays published
+ *
+ * Returns 0 if the operation succeeded, -1 otherwise
+ */
+int ngt_registry_load(ngt_registry* reg, const char* name, const char* filename);
+
+/**
+ * Loads every file below the given directory into the registry, using the given number of threads
+ * (or one per CPU if nthreads is 0 or less).  Each template is published under its path relative 
+ * to the directory, so "templates/mail/footer.tpl" preloaded from "templates" is named 
+ * "mail/footer.tpl".  Files that can't be loaded are reported on stderr and skipped
+ *
+ * Returns the number of files that could not be loaded, or -1 if the directory could not be read
+ */
+int ngt_registry_preload_dir(ngt_registry* reg, const char* path, int nthreads);
+
+/**
+ * Removes the template published under the given name.  It is freed once no thread can still be
+ * expanding it
+ *
+ * Returns 0 if the operation succeeded, -1 if there was no such template
+ */
+int ngt_registry_remove(ngt_registry* reg, const char* name);
+
+/**
+ * Returns the current version of the template published under the given name, or 0 if there is
+ * none.  Never blocks.  The template stays valid until you call ngt_registry_release(), even if a 
+ * new version is published in the meantime.  Do NOT modify or destroy it
+ *
+ * NOTE: Every successful acquire must be paired with a release from the same thread
+ */
+ngt_template* ngt_registry_acquire(ngt_registry* reg, const char* name);
+
+/**
+ * Like ngt_registry_acquire(), but if no template is resident under the given name it is loaded,
+ * either from the file it was originally loaded from (if it was evicted) or from the file with 
+ * that name.  A file is only loaded once no matter how many threads ask for it at the same time
+ *
+ * NOTE: Every successful get must be paired with a ngt_registry_release() from the same thread
+ */
+ngt_template* ngt_registry_get(ngt_registry* reg, const char* name);
+
+/**
+ * Tells the registry the calling thread is done with a template returned by ngt_registry_acquire()
+ * or ngt_registry_get()
+ */
+void ngt_registry_release(ngt_registry* reg, ngt_template* tpl);
+
+/**
+ * Sets the amount of memory, in bytes, the templates in the registry may use.  When a template is
+ * loaded or published past this limit, the least recently used templates that were loaded from
+ * files are evicted until the registry fits again.  They are transparently reloaded the next time
+ * they are needed.  The include files cached for the registry's include paths are held to the same
+ * limit.  Zero (the default) means no limit on the templates
+ */
+void ngt_registry_set_memory_limit(ngt_registry* reg, size_t bytes);
+
+/**
+ * Returns the amount of memory, in bytes, held by the templates resident in the registry and the 
+ * include files cached for it
+ */
+size_t ngt_registry_memory_used(ngt_registry* reg);
+
+/**
+ * Expands the current version of the named template with the given dictionary, loading it if it
+ * is not resident.  Include filenames are looked up in the registry's include paths unless the
+ * template has its own.  A convenience wrapper around ngt_registry_get(), ngt_expand_dictionary()
+ * and ngt_registry_release()
+ *
+ * Returns 0 if the template was successfully processed, -1 if there was an error or no template
+ * was published under that name
+ */
+int ngt_registry_expand(ngt_registry* reg, const char* name, ngt_dictionary* dict, char** result);
+
+/**
+ * Like ngt_prefetch_includes() for the current version of the named template, loading it if it is
+ * not resident.  Include filenames are looked up the same way ngt_registry_expand() does
+ *
+ * Returns 0 if the loads were started, -1 if no template was published under that name
+ */
+int ngt_registry_prefetch_includes(ngt_registry* reg, const char* name, ngt_dictionary* dict);
+
+/**
+ * Starts a background thread that reloads templates whenever the file they were loaded from 
+ * changes.  Only supported on Linux (inotify)
+ *
+ * NOTE: While the watcher runs, the registry loads every template into a private copy instead of
+ *      mapping the file, so a file rewritten in place can't change or truncate a template that is
+ *      being expanded.  Templates loaded before the watcher started stay mapped until their file
+ *      changes, so start the watcher before loading if files are edited in place
+ *
+ * Returns 0 if the watcher is running, -1 otherwise
+ */
+int ngt_registry_watch(ngt_registry* reg);
+
+/**
+ * Stops the background thread started by ngt_registry_watch()
+ */
+void ngt_registry_unwatch(ngt_registry* reg);
+
 /**
  * Returns that Global Dictionary in which the Standard Values for all templates are defined 
  */
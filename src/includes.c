@@ -0,0 +1,464 @@
+/**
+ * Include search paths and the include caches for the ngtemplate engine.  Include filenames are 
+ * looked up through the search directories of the template (or registry) being expanded, and each
+ * set of search paths keeps the files its names resolved to, so building a new dictionary for every
+ * expansion does not touch the disk again.
+ *
+ * Loaded include files are reference counted: the cache holds one reference, and every dictionary
+ * that memoized the text holds another, so a file that changed or was dropped from the cache stays
+ * around for the dictionaries still using it.  A name is looked up on disk again at most once every
+ * INCLUDE_REVALIDATE_SECONDS, and mapped again if the file it resolves to has changed, so include 
+ * files should be replaced with a rename rather than rewritten in place.  The cache of
+ * a set of search paths is emptied when its files grow past its limit, INCLUDE_CACHE_MAX_BYTES 
+ * unless a registry set its own memory limit.
+ */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "ngtemplate.h"
+#include "internal.h"
+
+#define INCLUDE_TABLE_INITIAL_CAPACITY  64
+#define INCLUDE_MAX_LINKED_LENGTH       65536
+#define INCLUDE_MAX_LINKED_BODIES       8
+#define INCLUDE_REVALIDATE_SECONDS      1
+#define INCLUDE_CACHE_MAX_BYTES         (16 * 1024 * 1024)
+
+/**
+ * Serializes adding linked bodies to include files.  Readers walk the lists without it
+ */
+static pthread_mutex_t s_linked_bodies_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Search paths for templates that have none of their own
+ */
+static _include_paths s_default_include_paths = { .lock = PTHREAD_MUTEX_INITIALIZER, .max_bytes = INCLUDE_CACHE_MAX_BYTES };
+
+/**
+ * Helper function - returns the entry stored under the given key, or 0 if there is none
+ */
+static _include_entry* _include_table_find(_include_table* table, const char* key)    {
+    _include_entry* entry;
+    int hash;
+    
+    if (!table->capacity)   {
+        return 0;
+    }
+    
+    hash = ht_hashpjw(key);
+    for (entry = table->buckets[(unsigned)hash & (table->capacity - 1)]; entry; entry = entry->next)    {
+        if (entry->hash == hash && !strcmp(entry->key, key))    {
+            return entry;
+        }
+    }
+    
+    return 0;
+}
+
+/**
+ * Helper function - adds an empty entry under the given key, growing the table when the chains
+ * get long
+ *
+ * Returns the new entry
+ */
+static _include_entry* _include_table_insert(_include_table* table, const char* key)  {
+    _include_entry** buckets;
+    _include_entry* entry, *next;
+    int i, capacity;
+    
+    if (table->used >= table->capacity * 2) {
+        capacity = table->capacity ? table->capacity * 2 : INCLUDE_TABLE_INITIAL_CAPACITY;
+        buckets = (_include_entry**)malloc(capacity * sizeof(_include_entry*));
+        memset(buckets, 0, capacity * sizeof(_include_entry*));
+        
+        for (i = 0; i < table->capacity; i++)   {
+            for (entry = table->buckets[i]; entry; entry = next)    {
+                next = entry->next;
+                entry->next = buckets[(unsigned)entry->hash & (capacity - 1)];
+                buckets[(unsigned)entry->hash & (capacity - 1)] = entry;
+            }
+        }
+        
+        if (table->buckets) {
+            free(table->buckets);
+        }
+        table->buckets = buckets;
+        table->capacity = capacity;
+    }
+    
+    entry = (_include_entry*)malloc(sizeof(_include_entry));
+    memset(entry, 0, sizeof(_include_entry));
+    entry->key = (char*)malloc(strlen(key) + 1);
+    strcpy(entry->key, key);
+    entry->hash = ht_hashpjw(key);
+    entry->next = table->buckets[(unsigned)entry->hash & (table->capacity - 1)];
+    table->buckets[(unsigned)entry->hash & (table->capacity - 1)] = entry;
+    table->used++;
+    
+    return entry;
+}
+
+/**
+ * Helper function - frees the table and its entries, and drops the references they hold
+ */
+static void _include_table_clear(_include_table* table) {
+    _include_entry* entry, *next;
+    int i;
+    
+    for (i = 0; i < table->capacity; i++)   {
+        for (entry = table->buckets[i]; entry; entry = next)    {
+            next = entry->next;
+            if (entry->template)    {
+                _release_template_file(entry->template);
+            }
+            if (entry->path)    {
+                free(entry->path);
+            }
+            free(entry->key);
+            free(entry);
+        }
+    }
+    
+    if (table->buckets) {
+        free(table->buckets);
+    }
+    
+    memset(table, 0, sizeof(_include_table));
+}
+
+/**
+ * Helper function - makes a copy of the include body with the indentation after every newline
+ *
+ * Returns the linked body, or 0 if it would have no room left in the list of the file
+ */
+static _linked_body* _include_link(_template_file* file, const char* indent, size_t indent_length)  {
+    size_t lines;
+    const char* p;
+    char* out;
+    _linked_body* linked;
+    
+    if (file->linked_count >= INCLUDE_MAX_LINKED_BODIES)    {
+        return 0;
+    }
+    
+    lines = 0;
+    for (p = file->text; *p; p++)   {
+        if (*p == '\n')    {
+            lines++;
+        }
+    }
+    
+    linked = (_linked_body*)malloc(sizeof(_linked_body) + indent_length + file->length + lines * indent_length + 1);
+    linked->indent_length = indent_length;
+    linked->body = (char*)(linked + 1) + indent_length;
+    memcpy(linked + 1, indent, indent_length);
+    
+    out = linked->body;
+    for (p = file->text; *p; p++)   {
+        *out++ = *p;
+        if (*p == '\n')    {
+            memcpy(out, indent, indent_length);
+            out += indent_length;
+        }
+    }
+    *out = '\0';
+    
+    return linked;
+}
+
+/**
+ * Helper function - returns the linked body in the list that was made for the given indentation,
+ * or 0 if there is none
+ */
+static _linked_body* _include_find_linked(_linked_body* linked, const char* indent, size_t indent_length)   {
+    for (; linked; linked = linked->next)  {
+        if (linked->indent_length == indent_length && !memcmp(linked + 1, indent, indent_length))   {
+            return linked;
+        }
+    }
+    
+    return 0;
+}
+
+/**
+ * Returns a copy of the given include body with the given indentation spliced in after every 
+ * newline, so it can be expanded without re-indenting each line.  The body must come from
+ * _map_template_file(); copies are kept with it and shared by every expansion
+ *
+ * Returns the linked body, or 0 if the body is too large to be worth copying
+ */
+char* _include_linked_body(const char* template, const char* indent, size_t indent_length)  {
+    _template_file* file;
+    _linked_body* linked;
+    
+    if (!indent_length) {
+        // Nothing to splice in
+        return (char*)template;
+    }
+    
+    file = (_template_file*)(template - offsetof(_template_file, text));
+    if (file->length > INCLUDE_MAX_LINKED_LENGTH)   {
+        return 0;
+    }
+    
+    // Bodies are only ever added to the front of the list, so a snapshot of it stays valid
+    linked = _include_find_linked(NGT_ATOMIC_LOAD(&file->linked), indent, indent_length);
+    if (!linked)    {
+        pthread_mutex_lock(&s_linked_bodies_lock);
+        
+        // Someone may have linked it while we were waiting
+        linked = _include_find_linked(file->linked, indent, indent_length);
+        if (!linked)    {
+            linked = _include_link(file, indent, indent_length);
+            if (linked) {
+                linked->next = file->linked;
+                file->linked_count++;
+                NGT_ATOMIC_STORE(&file->linked, linked);
+            }
+        }
+        
+        pthread_mutex_unlock(&s_linked_bodies_lock);
+    }
+    
+    return linked ? linked->body : 0;
+}
+
+/**
+ * Helper function - finds the file the given include name refers to.  Absolute names are taken
+ * as they are, relative names are tried in every search directory in the order they were added
+ * and finally relative to the working directory, just like includes without search paths
+ *
+ * Returns 0 if the file was found, with its canonical path in "resolved" and what it looks like in
+ * "st", -1 otherwise
+ */
+static int _include_paths_resolve(char** dirs, int count, const char* name, char* resolved, struct stat* st)  {
+    char candidate[PATH_MAX];
+    int i;
+    
+    if (name[0] != '/') {
+        for (i = 0; i < count; i++) {
+            snprintf(candidate, PATH_MAX, "%s/%s", dirs[i], name);
+            if (stat(candidate, st) == 0 && S_ISREG(st->st_mode) && realpath(candidate, resolved)) {
+                return 0;
+            }
+        }
+    }
+    
+    if (stat(name, st) == 0 && S_ISREG(st->st_mode) && realpath(name, resolved))    {
+        return 0;
+    }
+    
+    return -1;
+}
+
+/**
+ * Creates an empty set of include search paths
+ */
+_include_paths* _include_paths_new()    {
+    _include_paths* paths;
+    
+    paths = (_include_paths*)malloc(sizeof(_include_paths));
+    memset(paths, 0, sizeof(_include_paths));
+    pthread_mutex_init(&paths->lock, 0);
+    paths->max_bytes = INCLUDE_CACHE_MAX_BYTES;
+    
+    return paths;
+}
+
+/**
+ * Returns the search paths used for file includes of templates that have none.  They contain no
+ * directories, so include filenames are relative to the working directory
+ */
+_include_paths* _default_include_paths()    {
+    return &s_default_include_paths;
+}
+
+/**
+ * Destroys the given set of include search paths once no prefetch is using them anymore.  Include
+ * files loaded through it stay loaded for as long as a dictionary still holds them
+ */
+void _include_paths_destroy(_include_paths* paths)  {
+    int i;
+    
+    _prefetch_wait(&paths->prefetching);
+    
+    for (i = 0; i < paths->count; i++)  {
+        free(paths->dirs[i]);
+    }
+    
+    if (paths->dirs)    {
+        free(paths->dirs);
+    }
+    
+    _include_table_clear(&paths->names);
+    pthread_mutex_destroy(&paths->lock);
+    free(paths);
+}
+
+/**
+ * Adds a directory to the end of the search paths.  Names resolved so far are forgotten, since
+ * they may be found somewhere else now
+ */
+void _include_paths_add(_include_paths* paths, const char* dir) {
+    pthread_mutex_lock(&paths->lock);
+    
+    paths->dirs = (char**)realloc(paths->dirs, (paths->count + 1) * sizeof(char*));
+    paths->dirs[paths->count] = (char*)malloc(strlen(dir) + 1);
+    strcpy(paths->dirs[paths->count], dir);
+    paths->count++;
+    
+    _include_table_clear(&paths->names);
+    paths->bytes = 0;
+    
+    pthread_mutex_unlock(&paths->lock);
+}
+
+/**
+ * Limits how much include text the search paths keep cached.  Zero restores the default limit
+ */
+void _include_paths_set_limit(_include_paths* paths, size_t bytes)  {
+    pthread_mutex_lock(&paths->lock);
+    
+    paths->max_bytes = bytes ? bytes : INCLUDE_CACHE_MAX_BYTES;
+    if (paths->bytes > paths->max_bytes)    {
+        _include_table_clear(&paths->names);
+        paths->bytes = 0;
+    }
+    
+    pthread_mutex_unlock(&paths->lock);
+}
+
+/**
+ * Returns how much include text the search paths keep cached, in bytes
+ */
+size_t _include_paths_bytes(_include_paths* paths)  {
+    size_t bytes;
+    
+    pthread_mutex_lock(&paths->lock);
+    bytes = paths->bytes;
+    pthread_mutex_unlock(&paths->lock);
+    
+    return bytes;
+}
+
+/**
+ * Helper function - returns nonzero if the file still looks the way it did when the entry read it
+ */
+static int _include_entry_current(_include_entry* entry, const char* resolved, struct stat* st)   {
+    return !strcmp(entry->path, resolved) && entry->inode == st->st_ino && entry->size == st->st_size && 
+            entry->modified.tv_sec == st->st_mtim.tv_sec && entry->modified.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/**
+ * Helper function - caches the text read from the given file under the include name, unless 
+ * another thread got there first with the same file.  Must be called with the paths locked
+ *
+ * Returns the cached text with a reference for the caller
+ */
+static char* _include_paths_store(_include_paths* paths, const char* name, char* template, const char* resolved,
+                                    struct stat* st, time_t now)    {
+    _include_entry* entry;
+    
+    entry = _include_table_find(&paths->names, name);
+    if (entry && _include_entry_current(entry, resolved, st))   {
+        _release_template_file(template);
+        entry->checked = now;
+        return _template_file_ref(entry->template);
+    }
+    
+    if (entry)  {
+        // The file changed.  Dictionaries still holding the old text keep their reference
+        paths->bytes -= _template_file_length(entry->template);
+        _release_template_file(entry->template);
+        free(entry->path);
+    } else {
+        if (paths->bytes + _template_file_length(template) > paths->max_bytes)   {
+            _include_table_clear(&paths->names);
+            paths->bytes = 0;
+        }
+        
+        entry = _include_table_insert(&paths->names, name);
+    }
+    
+    entry->template = _template_file_ref(template);
+    entry->path = (char*)malloc(strlen(resolved) + 1);
+    strcpy(entry->path, resolved);
+    entry->inode = st->st_ino;
+    entry->size = st->st_size;
+    entry->modified = st->st_mtim;
+    entry->checked = now;
+    paths->bytes += _template_file_length(template);
+    
+    return template;
+}
+
+/**
+ * Returns the template text for the given include name, looking it up in the search paths the 
+ * first time the name is seen and reading it again once the file has changed.  The caller gets a
+ * reference to the text and releases it with _release_template_file().  The lock is only held to
+ * look at the cache and to publish a file, never while touching the disk, so loads of different
+ * files (from the prefetch I/O threads, say) go on in parallel
+ *
+ * Returns the template text, or 0 if no such file could be found
+ */
+char* _include_paths_load(_include_paths* paths, const char* name)  {
+    char resolved[PATH_MAX];
+    struct stat st;
+    _include_entry* entry;
+    char** dirs;
+    char* template;
+    time_t now;
+    int count;
+    
+    now = time(0);
+    
+    pthread_mutex_lock(&paths->lock);
+    
+    entry = _include_table_find(&paths->names, name);
+    if (entry && now - entry->checked < INCLUDE_REVALIDATE_SECONDS)    {
+        template = _template_file_ref(entry->template);
+        pthread_mutex_unlock(&paths->lock);
+        return template;
+    }
+    
+    // The directories themselves stay put until the paths are destroyed, only the array moves
+    count = paths->count;
+    dirs = (char**)malloc((count + 1) * sizeof(char*));
+    if (count)  {
+        memcpy(dirs, paths->dirs, count * sizeof(char*));
+    }
+    
+    pthread_mutex_unlock(&paths->lock);
+    
+    if (_include_paths_resolve(dirs, count, name, resolved, &st) != 0)  {
+        free(dirs);
+        return 0;
+    }
+    free(dirs);
+    
+    pthread_mutex_lock(&paths->lock);
+    
+    // Nothing to read if the file we have is still the one the name refers to
+    entry = _include_table_find(&paths->names, name);
+    if (entry && _include_entry_current(entry, resolved, &st))  {
+        entry->checked = now;
+        template = _template_file_ref(entry->template);
+        pthread_mutex_unlock(&paths->lock);
+        return template;
+    }
+    
+    pthread_mutex_unlock(&paths->lock);
+    
+    template = _map_template_file(resolved);
+    if (template)   {
+        pthread_mutex_lock(&paths->lock);
+        template = _include_paths_store(paths, name, template, resolved, &st, now);
+        pthread_mutex_unlock(&paths->lock);
+    }
+    
+    return template;
+}
@@ -3,33 +3,35 @@
  */
 
 #include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
 #include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "ngtemplate.h"
 #include "internal.h"
 
 /**
- * The hash function we will use for the template dictionary
+ * Serializes the first load of include templates.  Only taken when an include has never been
+ * loaded before, never on the expansion hot path
  */
-int _dictionary_item_hash(const void* key)  {
-    // Hash by the marker value
-    return ht_hashpjw(((_dictionary_item*)key)->marker);
-}
-
-/**
- * The function we will use to determine if two dictionary_items match
- */
-int _dictionary_item_match(const void* key1, const void* key2)  {
-    return !strcmp(((_dictionary_item*)key1)->marker, ((_dictionary_item*)key2)->marker);
-}
+static pthread_mutex_t s_include_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /**
- * The function that will be called when a dictionary_item must be destroyed
+ * Helper function - destroys the value of the item, but neither its marker nor the item itself
  */
-void _dictionary_item_destroy(void *data)   {
-    _dictionary_item* d = (_dictionary_item*)data;
-    
+void _dictionary_item_release(_dictionary_item* d)  {
     if (d->type == ITEM_STRING) {
-        free(d->val.string_value);
+        if (!(d->flags & ITEM_VALUE_FLAGS))  {
+            free(d->val.string_value);
+        }
+    } else if (d->type == ITEM_BUFFER && d->val.buffer_value.owned) {
+        free((char*)d->val.buffer_value.data);
     } else if (d->type & ITEM_D_LIST && d->val.d_list_value != 0) {
         list_destroy(d->val.d_list_value);
         free(d->val.d_list_value);
@@ -44,12 +46,6 @@ void _dictionary_item_destroy(void *data)   {
             free(d->val.include_value.filename);
         }
     }
-    
-    if (d->marker)  {
-        free(d->marker);
-    }
-    
-    free(d);
 }
 
 /**
@@ -57,11 +53,71 @@ void _dictionary_item_destroy(void *data)   {
  */ 
 void _dictionary_destroy(void* data)    {
     ngt_dictionary* dict = (ngt_dictionary*)data;
+    int i;
+    
+    if (NGT_ATOMIC_FETCH_ADD(&dict->references, -1) > 1)   {
+        // Still added to another section, or held by someone else
+        return;
+    }
+    
+    // The I/O threads may still be loading includes that live in this dictionary
+    _prefetch_wait(&dict->prefetching);
     
-    ht_destroy((hashtable*)dict);
+    if (dict->frozen)   {
+        _frozen_destroy(dict->frozen);
+    }
+    
+    if (dict->slots)    {
+        for (i = 0; i < dict->schema->count; i++)   {
+            _slot_item_clear(&dict->slots[i]);
+        }
+        free(dict->slots);
+    }
+    
+    _table_clear(dict);
     free(dict);
 }
 
+/**
+ * Helper function - returns nonzero if the dictionary is a row of more than one section, or is 
+ * held by someone else as well
+ */
+int _dictionary_shared(ngt_dictionary* dict)    {
+    return NGT_ATOMIC_LOAD(&dict->references) > 1;
+}
+
+/**
+ * Helper function - returns a new, empty list of section rows
+ */
+list* _section_list_new()   {
+    list* rows = (list*)malloc(sizeof(list));
+    
+    list_init(rows, _section_row_destroy);
+    return rows;
+}
+
+/**
+ * Helper function - adds the dictionary to the end of the section list, which takes over one 
+ * reference to it
+ */
+void _section_list_add(list* rows, ngt_dictionary* child, int visible)  {
+    _section_row* row = (_section_row*)malloc(sizeof(_section_row));
+    
+    row->dictionary = child;
+    row->visible = visible;
+    list_insert_next(rows, list_tail(rows), row);
+}
+
+/**
+ * The function that will be called when a row of a section list must be destroyed
+ */
+void _section_row_destroy(void* data)   {
+    _section_row* row = (_section_row*)data;
+    
+    _dictionary_destroy(row->dictionary);
+    free(row);
+}
+
 /**
  * The hash function we will use for the modifier dictionary
  */
@@ -95,37 +151,73 @@ void _destroy_template(void* data)  {
     ngt_template* tpl = (ngt_template*)data;
     
     ht_destroy(&tpl->modifiers);
+    _release_loaded_template(tpl);
+    
+    if (tpl->include_paths) {
+        _include_paths_destroy(tpl->include_paths);
+    }
     
     free(tpl);
 }
 
 /**
- * Helper function to retrieve a template string from a file
+ * Frees the template string loaded by one of the ngt_load_from_*() functions, if any
  */
-char* _get_template_from_file(FILE* fd) {
-    int length;
-    int ch, i;
-    char* contents;
+void _release_loaded_template(ngt_template* tpl)    {
+    if (!tpl->loaded_tmpl)  {
+        return;
+    }
     
-    fseek(fd, 0, SEEK_END);
-    length = ftell(fd);
-    if (!length) {
-        return 0;
+    if (tpl->loaded_file)   {
+        _release_template_file(tpl->loaded_tmpl);
+    } else {
+        free(tpl->loaded_tmpl);
     }
     
-    rewind(fd);
+    tpl->loaded_tmpl = 0;
+    tpl->loaded_file = 0;
+}
+
+/**
+ * Helper function to retrieve a template string from a file.  Regular files are read in one go,
+ * anything else (pipes and the like) is read until it runs dry.  An empty file is an empty template
+ */
+char* _get_template_from_file(FILE* fd) {
+    struct stat st;
+    size_t length, capacity, rd;
+    char* contents;
     
-    int pos = 0;
-    contents = (char*)malloc(length+1);
-    while(pos < length) {
-        int rd = length - pos > 4096 ? 4096 : length - pos;
+    if (fstat(fileno(fd), &st) == 0 && S_ISREG(st.st_mode)) {
+        length = (size_t)st.st_size;
+        contents = (char*)malloc(length + 1);
+        if (!contents)  {
+            return 0;
+        }
         
-        if(fread(contents+pos, rd, 1, fd) != 1) {
+        rewind(fd);
+        if (length && fread(contents, length, 1, fd) != 1)  {
             free(contents);
             return 0;
         }
         
-        pos += rd;
+        contents[length] = '\0';
+        return contents;
+    }
+    
+    length = 0;
+    capacity = 4096;
+    contents = (char*)malloc(capacity);
+    while ((rd = fread(contents + length, 1, capacity - length - 1, fd)) > 0)  {
+        length += rd;
+        if (capacity - length == 1) {
+            capacity *= 2;
+            contents = (char*)realloc(contents, capacity);
+        }
+    }
+    
+    if (ferror(fd)) {
+        free(contents);
+        return 0;
     }
     
     contents[length] = '\0';
@@ -145,49 +237,358 @@ char* _get_template_from_filename(const char* filename) {
     }
     
     template = _get_template_from_file(fd);
+    fclose(fd);
+    
+    return template;
+}
+
+/**
+ * Maps the given template file into memory, read only.  The text is shared with the page cache
+ * (and every other process mapping the file) instead of being copied, and may be larger than 2 GB.
+ * It is zero terminated even when the file exactly fills its pages.  The file must not be 
+ * truncated or rewritten in place while the text is in use; replace it with a rename instead.  The
+ * length of the text is kept in front of it, see _template_file_length()
+ *
+ * Returns the template string, or 0 if the file could not be mapped
+ */
+char* _map_template_file(const char* filename)  {
+    _template_file* file;
+    struct stat st;
+    size_t page, length, total;
+    char* base, *template;
+    int fd;
+    
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    
+    page = (size_t)sysconf(_SC_PAGESIZE);
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || (unsigned long long)st.st_size > (size_t)-1 - 2 * page) {
+        // Only regular files can be mapped, and the file has to fit in our address space
+        close(fd);
+        return 0;
+    }
+    
+    // The header gets a page of its own in front of the file, and the file is followed by at 
+    // least one zero byte of anonymous memory
+    length = (size_t)st.st_size;
+    total = page + (length / page + 1) * page;
+    
+    base = (char*)mmap(0, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return 0;
+    }
+    
+    template = base + page;
+    if (mprotect(template, total - page, PROT_READ) != 0 || 
+        (length && mmap(template, length, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)) {
+        munmap(base, total);
+        close(fd);
+        return 0;
+    }
     close(fd);
     
+    file = (_template_file*)(template - offsetof(_template_file, text));
+    file->length = length;
+    file->references = 1;
+    file->mapped = total;
+    file->linked = 0;
+    file->linked_count = 0;
+    
     return template;
 }
 
 /**
- * Helper function - allocates and initializes a new _dictionary_item
+ * Reads the given template file into a private copy.  The copy is never touched by anything that
+ * happens to the file afterwards, so a template being expanded stays intact even if the file is
+ * rewritten in place or truncated while a live reload is on its way.  Laid out like the text of
+ * _map_template_file(), so the two are released the same way
+ *
+ * Returns the template string, or 0 if the file could not be read
  */
-_dictionary_item* _new_dictionary_item()    {
-    _dictionary_item* item;
+char* _read_template_file(const char* filename) {
+    _template_file* file, *grown;
+    struct stat st;
+    size_t capacity;
+    ssize_t rd;
+    int fd;
+    
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
     
-    item = (_dictionary_item*)malloc(sizeof(_dictionary_item));
-    memset(item, 0, sizeof(_dictionary_item));
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))   {
+        close(fd);
+        return 0;
+    }
     
-    return item;
+    // One byte more than the file has, so a file that didn't change is read in one go and the 
+    // read that finds the end needs no room of its own
+    capacity = (size_t)st.st_size + 1;
+    file = (_template_file*)malloc(sizeof(_template_file) + capacity);
+    file->length = 0;
+    file->references = 1;
+    file->mapped = 0;
+    file->linked = 0;
+    file->linked_count = 0;
+    
+    // The file may be changing under us, so read until the end instead of trusting its size
+    for (;;)    {
+        rd = read(fd, file->text + file->length, capacity - file->length);
+        if (rd < 0) {
+            free(file);
+            close(fd);
+            return 0;
+        }
+        
+        if (rd == 0)    {
+            break;
+        }
+        
+        file->length += (size_t)rd;
+        if (file->length == capacity)   {
+            capacity *= 2;
+            grown = (_template_file*)realloc(file, sizeof(_template_file) + capacity);
+            if (!grown) {
+                free(file);
+                close(fd);
+                return 0;
+            }
+            file = grown;
+        }
+    }
+    
+    close(fd);
+    file->text[file->length] = '\0';
+    
+    return file->text;
 }
 
 /**
- * Helper function for the template_set_* functions.  Does NOT make a copy of the given value
- * string, but uses the pointer directly.
+ * Returns the length of a template string returned by _map_template_file() or 
+ * _read_template_file(), without looking for its end
  */
-int _set_string(ngt_dictionary* dict, const char* marker, char* value)  {
-    _dictionary_item* item, *prev_item;
+size_t _template_file_length(const char* template)  {
+    return ((const _template_file*)(template - offsetof(_template_file, text)))->length;
+}
+
+/**
+ * Takes another reference to a template string returned by _map_template_file() or 
+ * _read_template_file()
+ *
+ * Returns the template string
+ */
+char* _template_file_ref(char* template)    {
+    NGT_ATOMIC_FETCH_ADD(&((_template_file*)(template - offsetof(_template_file, text)))->references, 1);
+    return template;
+}
+
+/**
+ * Drops a reference to a template string returned by _map_template_file() or 
+ * _read_template_file(), and releases it along with the linked copies of it once the last one is
+ * gone
+ */
+void _release_template_file(char* template) {
+    _template_file* file;
+    _linked_body* linked;
+    
+    file = (_template_file*)(template - offsetof(_template_file, text));
+    if (NGT_ATOMIC_FETCH_ADD(&file->references, -1) != 1)  {
+        return;
+    }
+    
+    while (file->linked)    {
+        linked = file->linked;
+        file->linked = linked->next;
+        free(linked);
+    }
+    
+    if (file->mapped)   {
+        munmap(template - sysconf(_SC_PAGESIZE), file->mapped);
+    } else {
+        free(file);
+    }
+}
+
+/**
+ * Loads the template string of the template from the given file, mapped or as a private copy of 
+ * its own if private_copy is nonzero
+ *
+ * Returns 0 if successful, -1 otherwise
+ */
+int _load_template_file(ngt_template* tpl, const char* filename, int private_copy) {
+    char* template;
     
-    item = _new_dictionary_item();
-    item->type = ITEM_STRING;
-    item->marker = (char*)malloc(strlen(marker) + 1);
-    item->val.string_value = value;
+    template = private_copy ? _read_template_file(filename) : _map_template_file(filename);
+    if (!template)  {
+        return -1;
+    }
     
-    strcpy(item->marker, marker);
+    _release_loaded_template(tpl);
+    
+    tpl->tmpl = tpl->loaded_tmpl = template;
+    tpl->loaded_file = 1;
+    return 0;
+}
+
+/**
+ * Helper function - loads the template text for an include exactly once and publishes it in the
+ * include params, so concurrent expansions of the same dictionary agree on a single copy.  File 
+ * includes are looked up in the given search paths (or the working directory if there are none) 
+ * and come out of their include cache, so a new dictionary only reads a file that has changed
+ *
+ * Returns the template text, or 0 if the include could not be loaded
+ */
+char* _load_include_template(struct _include_params_tag* params, const char* marker, _include_paths* include_paths) {
+    char* template, *published;
+    
+    if (params->filename && params->get_template == _map_template_file) {
+        // Loads from the cache need no serializing.  Whoever publishes first wins, and the others
+        // drop the reference they got
+        template = _include_paths_load(include_paths ? include_paths : _default_include_paths(), params->filename);
+        published = 0;
+        if (template && !NGT_ATOMIC_CAS(&params->template, &published, template))   {
+            _release_template_file(template);
+            template = published;
+        }
         
-    if (ht_insert((hashtable*)dict, item) == 1) {
-        // Already in the table, replace
-        prev_item = item;
-        ht_remove((hashtable*)dict, (void *)&prev_item);
-        _dictionary_item_destroy((void*)prev_item);
+        return template;
+    }
+    
+    pthread_mutex_lock(&s_include_lock);
+    
+    // Someone may have beaten us to it while we were waiting
+    template = NGT_ATOMIC_LOAD(&params->template);
+    if (!template)  {
+        // The way this works is if someone has set a filename for us, we'll pass that to 
+        // the get_template callback, else we'll just pass the marker name and hope they know
+        // what to do with it
+        if (params->filename)   {
+            template = params->get_template(params->filename);
+        } else {
+            template = params->get_template(marker);
+        }
         
-        ht_insert((hashtable*)dict, item);
+        NGT_ATOMIC_STORE(&params->template, template);
+    }
+    
+    pthread_mutex_unlock(&s_include_lock);
+    
+    return template;
+}
+
+/**
+ * Helper function - returns the next item of the dictionary, frozen or not, or 0 when there are 
+ * no more.  Nothing may be added to the dictionary during the walk
+ */
+_dictionary_item* _next_item(ngt_dictionary* dict, _item_cursor* cursor)   {
+    // Set slots come first
+    while (dict->slots && cursor->slot < dict->schema->count)   {
+        if (dict->slots[cursor->slot++].marker) {
+            return &dict->slots[cursor->slot - 1];
+        }
+    }
+    
+    if (dict->frozen)   {
+        return cursor->index < dict->frozen->count ? &dict->frozen->items[cursor->index++] : 0;
+    }
+    
+    if (!cursor->started)   {
+        cursor->block = dict->blocks;
+        cursor->started = 1;
+    }
+    
+    while (cursor->block)   {
+        if (cursor->index == cursor->block->count)  {
+            cursor->block = cursor->block->next;
+            cursor->index = 0;
+        } else if (cursor->block->items[cursor->index++].marker)    {
+            // Removed items have no marker
+            return &cursor->block->items[cursor->index - 1];
+        }
     }
     
     return 0;
 }
 
+/**
+ * Helper function - returns the dictionary's own item under the marker, adding an empty one of the
+ * given type if there is none yet
+ */
+_dictionary_item* _get_or_add_item(ngt_dictionary* dict, const char* marker, int type)  {
+    _dictionary_item* item;
+    unsigned hash;
+    
+    item = _slot_item(dict, marker);
+    if (item)   {
+        if (!item->marker)  {
+            item->type = type;
+            item->marker = dict->schema->markers[item - dict->slots];
+        }
+        
+        return item;
+    }
+    
+    // Hashed once for both the lookup and the add
+    hash = _marker_hash(marker, 0);
+    item = _table_find_hashed(dict, marker, hash);
+    return item ? item : _table_add_hashed(dict, marker, hash, type);
+}
+
+/**
+ * Helper function - returns the dictionary's own item under the marker with whatever value it had
+ * destroyed, ready to take a value of the given type.  The dictionary must be writable
+ */
+_dictionary_item* _replace_item(ngt_dictionary* dict, const char* marker, int type)  {
+    _dictionary_item* item;
+    
+    // Overwritten in place, so the item keeps its marker and its place in the dictionary
+    item = _get_or_add_item(dict, marker, type);
+    _dictionary_item_release(item);
+    
+    memset(&item->val, 0, sizeof(item->val));
+    item->flags &= ~ITEM_VALUE_FLAGS;
+    item->type = type;
+    
+    return item;
+}
+
+/**
+ * Helper function - returns nonzero if the dictionary may be changed, and complains if it is 
+ * frozen.  Waits for the prefetches that still load includes living in the dictionary
+ */
+int _dictionary_writable(ngt_dictionary* dict)  {
+    if (dict->frozen)   {
+        fprintf(stderr, "Cannot change a frozen dictionary\n");
+        return 0;
+    }
+    
+    // Changes may move or free the include items the I/O threads are writing to
+    if (NGT_ATOMIC_LOAD(&dict->prefetching))    {
+        _prefetch_wait(&dict->prefetching);
+    }
+    
+    return 1;
+}
+
+/**
+ * Helper function for the template_set_* functions.  Does NOT make a copy of the given value
+ * string, but uses the pointer directly.
+ */
+int _set_string(ngt_dictionary* dict, const char* marker, char* value)  {
+    _dictionary_item item;
+    
+    memset(&item, 0, sizeof(_dictionary_item));
+    item.type = ITEM_STRING;
+    item.marker = (char*)marker;
+    item.val.string_value = value;
+    
+    return _set_item(dict, &item);
+}
+
 /**
  * Callback function for cleanup of default file template-includes
  */
@@ -195,91 +596,418 @@ void _cleanup_template(const char* filename, char* template)    {
     free(template);
 }
 
+/**
+ * Callback function for cleanup of includes set with ngt_set_include_filename(), which hold a 
+ * reference to a file from the include cache
+ */
+void _cleanup_include_file(const char* filename, char* template)    {
+    if (template)   {
+        _release_template_file(template);
+    }
+}
+
 /** 
  * Helper Function - Queries the dictionary for the item under the given marker and returns the 
- * item if it exists
+ * item if it exists.  Overlay dictionaries fall through to their base
+ * 
+ * Returns a pointer to the item if it exists, zero if not
+ */
+_dictionary_item* _query_item(ngt_dictionary* dict, const char* marker) {
+    _dictionary_item* item;
+    
+    for (item = 0; dict && !item; dict = dict->base)    {
+        item = _query_own_item(dict, marker);
+    }
+    
+    return item;
+}
+
+/** 
+ * Helper Function - Like _query_item(), but only looks in the dictionary itself and never in its
+ * base
  * 
  * Returns a pointer to the item if it exists, zero if not
  */
-_dictionary_item* _query_item(ngt_dictionary* dict, const char* marker) {
-    _dictionary_item* query_item, *item;
-    
+_dictionary_item* _query_own_item(ngt_dictionary* dict, const char* marker) {
+    _dictionary_item* item;
+    
+    if (!dict)  {
+        return 0;
+    }
+    
+    item = _slot_item(dict, marker);
+    if (item && item->marker)   {
+        return item;
+    }
+    
+    if (dict->frozen)   {
+        // Everything else is in the frozen layout
+        return _frozen_find(dict->frozen, marker);
+    }
+    
+    return _table_find(dict, marker);
+}
+
+/**
+ * Helper function - Gets the modifier by the given name if it exists anywhere in the
+ * template modifier list
+ */
+_modifier* _query_modifier(ngt_template* tpl, const char* name) {
+    _modifier* query_mod, *mod;
+    if (!tpl)   {
+        return 0;
+    }
+    
+    query_mod = (_modifier*)malloc(sizeof(_modifier));
+    query_mod->name = (char*)name;
+    
+    mod = query_mod;
+    
+    if (ht_lookup(&tpl->modifiers, (void*)&mod) != 0)   {
+        mod = 0;
+    }
+    
+    free(query_mod);
+    
+    return mod; 
+}
+
+/**
+ * Helper function - looks the marker up in the dictionary, then in its parent, its parent's parent
+ * and so on, and finally in the global dictionary.  If scope is given, the dictionary the item was
+ * found in is put there
+ *
+ * Returns the first item found, or 0 if there is none
+ */
+_dictionary_item* _find_item(ngt_dictionary* dict, const char* marker, ngt_dictionary** scope)  {
+    ngt_dictionary* global = ngt_get_global_dictionary();
+    _dictionary_item* item;
+    int seen_global;
+    
+    item = 0;
+    seen_global = 0;
+    for (; dict; dict = dict->parent)   {
+        seen_global |= dict == global;
+        item = _query_item(dict, marker);
+        if (item)   {
+            break;
+        }
+    }
+    
+    if (!item && !seen_global)  {
+        // Last chance, look up in global dictionary
+        dict = global;
+        item = _query_item(dict, marker);
+    }
+    
+    if (scope)  {
+        *scope = item ? dict : 0;
+    }
+    
+    return item;
+}
+
+/**
+ * Helper function - returns the entry for the marker occurrence, or the empty entry where it 
+ * belongs
+ */
+static _scope_entry* _scope_cache_probe(_scope_entry* entries, unsigned capacity, const char* occurrence)   {
+    unsigned i;
+    
+    i = ((unsigned)(uintptr_t)occurrence * 2654435761u) & (capacity - 1);
+    while (entries[i].occurrence && entries[i].occurrence != occurrence)  {
+        i = (i + 1) & (capacity - 1);
+    }
+    
+    return &entries[i];
+}
+
+/**
+ * Helper function - returns the slot for the marker occurrence in the scope cache, which is empty
+ * if the occurrence has not been looked up yet.  The cache grows as needed
+ */
+static _scope_entry* _scope_cache_slot(_scope_cache* cache, const char* occurrence) {
+    _scope_entry* entries;
+    unsigned i, capacity;
+    
+    if (cache->used * 2 >= cache->capacity) {
+        capacity = cache->capacity ? cache->capacity * 2 : SCOPE_CACHE_INITIAL_CAPACITY;
+        entries = (_scope_entry*)malloc(capacity * sizeof(_scope_entry));
+        memset(entries, 0, capacity * sizeof(_scope_entry));
+        
+        for (i = 0; i < cache->capacity; i++)   {
+            if (cache->entries[i].occurrence)   {
+                *_scope_cache_probe(entries, capacity, cache->entries[i].occurrence) = cache->entries[i];
+            }
+        }
+        
+        if (cache->entries) {
+            free(cache->entries);
+        }
+        cache->entries = entries;
+        cache->capacity = capacity;
+    }
+    
+    return _scope_cache_probe(cache->entries, cache->capacity, occurrence);
+}
+
+/**
+ * Helper function - looks the marker up in the dictionaries enclosing the active dictionary of the
+ * context.  Those are the dictionaries of the sections being expanded around it, innermost first,
+ * and then the parents of the dictionary the expansion started with and the global dictionary.  A
+ * dictionary may be added to any number of sections, so the expansion is the only one that knows
+ * which of them it is in right now.  If scope is given, the dictionary the item was found in is
+ * put there
+ *
+ * Returns the first item found, or 0 if there is none
+ */
+static _dictionary_item* _find_enclosing_item(_parse_context* ctx, const char* marker, ngt_dictionary** scope)    {
+    ngt_dictionary* dict = ctx->active_dictionary;
+    _dictionary_item* item;
+    
+    for (ctx = ctx->parent; ctx; ctx = ctx->parent) {
+        if (!ctx->active_dictionary || ctx->active_dictionary == dict)  {
+            // Includes expand in the dictionary of the context they are in
+            continue;
+        }
+        
+        dict = ctx->active_dictionary;
+        item = _query_item(dict, marker);
+        if (item)   {
+            if (scope)  {
+                *scope = dict;
+            }
+            return item;
+        }
+    }
+    
+    return _find_item(dict->parent, marker, scope);
+}
+
+/**
+ * Helper function - resolves a marker for the active dictionary of the context, and then through
+ * the dictionaries enclosing it.  occurrence is where the marker is in the template, or 0 if the
+ * lookup should not be cached
+ *
+ * All dictionaries of a section instance are enclosed by the same dictionaries, so if a marker is
+ * not in the dictionary itself it ends up in the same place every time.  Where that was is 
+ * remembered by occurrence, and the next rows go straight there instead of walking them again
+ *
+ * Returns the item found, or 0 if there is none
+ */
+_dictionary_item* _resolve_item(_parse_context* ctx, const char* marker, const char* occurrence)  {
+    ngt_dictionary* dict = ctx->active_dictionary, *layer;
+    _scope_cache* cache = ctx->scopes;
+    _scope_entry* entry;
+    _dictionary_item* item;
+    int slot;
+    
+    if (!dict)  {
+        return 0;
+    }
+    
+    if (dict->slots && occurrence)  {
+        // Markers of the schema's own template know their slot, so no hashing at all.  Overlays
+        // of a schema-bound dictionary are bound to the same schema, so their bases are read by
+        // slot as well
+        slot = _schema_slot_at(dict->schema, occurrence);
+        for (layer = dict; slot >= 0 && layer && layer->schema == dict->schema; layer = layer->base)  {
+            if (layer->slots[slot].marker)  {
+                return &layer->slots[slot];
+            }
+        }
+    }
+    
+    // The dictionary itself is different for every row, so it is always looked at
+    item = _query_item(dict, marker);
+    if (item)   {
+        return item;
+    }
+    
+    if (!cache || !occurrence)  {
+        return _find_enclosing_item(ctx, marker, 0);
+    }
+    
+    entry = _scope_cache_slot(cache, occurrence);
+    if (entry->occurrence)  {
+        return entry->scope ? _query_item(entry->scope, marker) : 0;
+    }
+    
+    entry->occurrence = occurrence;
+    item = _find_enclosing_item(ctx, marker, &entry->scope);
+    cache->used++;
+    
+    return item;
+}
+
+/**
+ * Helper function - frees what the scope cache holds
+ */
+void _scope_cache_clear(_scope_cache* cache)    {
+    if (cache->entries) {
+        free(cache->entries);
+    }
+    
+    memset(cache, 0, sizeof(_scope_cache));
+}
+
+/**
+ * Gets the string value in the dictionary for the given marker
+ * NOTE: The string returned is managed by the dictionary.  Do NOT retain a reference to
+ *      it or destroy it
+ *
+ * Returns the pointer to the value of the marker, or 0 if not found
+ */
+const char* _get_string_value_ref(ngt_dictionary* dict, const char* marker) {
+    _dictionary_item* item;
+    if (!dict)  {
+        return 0;
+    }
+    
+    item = _find_item(dict, marker, 0);
+    
+    if (!item || item->type != ITEM_STRING) {
+        // Getting a non-string item as a string is not defined
+        return 0;
+    }
+    
+    return item->val.string_value;
+}
+
+/**
+ * Gets the item holding the value for the given marker: a string, a buffer or a typed value
+ *
+ * Returns the item, or 0 if not found or if the given node is not a value
+ */
+_dictionary_item* _get_value_item_ref(ngt_dictionary* dict, const char* marker)   {
+    _dictionary_item* item;
     if (!dict)  {
         return 0;
     }
     
-    query_item = (_dictionary_item*)malloc(sizeof(_dictionary_item));
-    memset(query_item, 0, sizeof(_dictionary_item));
-    query_item->marker = (char*)marker;
-    query_item->val.string_value = 0;
+    item = _find_item(dict, marker, 0);
     
-    item = query_item;
-    
-    if (ht_lookup((hashtable*)dict, (void*)&item) != 0) {
-        // No value for this key
-        free(query_item);
+    if (!item || !ITEM_IS_VALUE(item->type))    {
         return 0;
     }
     
-    free(query_item);
-    
     return item;
 }
 
 /**
- * Helper function - Gets the modifier by the given name if it exists anywhere in the
- * template modifier list
+ * Helper function - returns the characters of the value item and puts their number in length.
+ * Typed values are formatted into buf
  */
-_modifier* _query_modifier(ngt_template* tpl, const char* name) {
-    _modifier* query_mod, *mod;
-    if (!tpl)   {
-        return 0;
+const char* _format_value(_dictionary_item* item, char* buf, size_t* length) {
+    switch(item->type)  {
+        case ITEM_BUFFER:
+            *length = item->val.buffer_value.length;
+            return item->val.buffer_value.data;
+        case ITEM_INT:
+            *length = _format_int64(item->val.int_value, buf);
+            return buf;
+        case ITEM_DOUBLE:
+            *length = _format_double(item->val.double_value, buf);
+            return buf;
+        case ITEM_BOOL:
+            strcpy(buf, item->val.bool_value ? "true" : "false");
+            *length = strlen(buf);
+            return buf;
+        default:
+            *length = strlen(item->val.string_value);
+            return item->val.string_value;
     }
+}
+
+/**
+ * Helper function - sets the item in the dictionary, replacing any item with the same marker.  The
+ * item is destroyed if the dictionary can't be changed
+ *
+ * Returns 0 if the operation succeeded, -1 otherwise
+ */
+int _set_item(ngt_dictionary* dict, _dictionary_item* item) {
+    _dictionary_item* target;
     
-    query_mod = (_modifier*)malloc(sizeof(_modifier));
-    query_mod->name = (char*)name;
+    if (!_dictionary_writable(dict))    {
+        _dictionary_item_release(item);
+        return -1;
+    }
     
-    mod = query_mod;
+    target = _replace_item(dict, item->marker, item->type);
+    target->val = item->val;
     
-    if (ht_lookup(&tpl->modifiers, (void*)&mod) != 0)   {
-        mod = 0;
+    return 0;
+}
+
+/**
+ * Helper function - formats the integer into buf without going through printf
+ *
+ * Returns the number of characters written, not counting the terminating zero
+ */
+int _format_int64(int64_t value, char* buf)  {
+    char digits[VALUE_BUFFER_LENGTH];
+    uint64_t magnitude;
+    int n, length;
+    
+    // Work on the magnitude as unsigned, so the most negative number doesn't overflow
+    magnitude = value < 0 ? -(uint64_t)value : (uint64_t)value;
+    n = 0;
+    do {
+        digits[n++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude);
+    
+    length = 0;
+    if (value < 0)  {
+        buf[length++] = '-';
     }
     
-    free(query_mod);
+    while (n)   {
+        buf[length++] = digits[--n];
+    }
+    buf[length] = '\0';
     
-    return mod; 
+    return length;
 }
 
 /**
- * Gets the string value in the dictionary for the given marker
- * NOTE: The string returned is managed by the dictionary.  Do NOT retain a reference to
- *      it or destroy it
+ * Helper function - formats the number into buf with up to 15 significant digits and a '.' as the
+ * decimal point, whatever the locale.  localeconv() is not thread-safe, so instead of asking for 
+ * the decimal point we replace whatever printf put between the digits
  *
- * Returns the pointer to the value of the marker, or 0 if not found
+ * Returns the number of characters written, not counting the terminating zero
  */
-const char* _get_string_value_ref(ngt_dictionary* dict, const char* marker) {
-    _dictionary_item* item;
-    if (!dict)  {
-        return 0;
-    }
+int _format_double(double value, char* buf)  {
+    char* p, *end;
+    int length;
     
-    item = _query_item(dict, marker);
-    if (!item)  {
-        // Look in the parent dictionary
-        item = _query_item(dict->parent, marker);
+    if (value > -1e15 && value < 1e15 && value == (double)(int64_t)value)   {
+        // Whole numbers are by far the most common, and don't need printf
+        return _format_int64((int64_t)value, buf);
     }
     
-    if (!item && dict != ngt_get_global_dictionary())   {
-        // Last chance, look up in global dictionary
-        item = _query_item(ngt_get_global_dictionary(), marker);
+    length = snprintf(buf, VALUE_BUFFER_LENGTH, "%.15g", value);
+    if (!isfinite(value))   {
+        return length;
     }
     
-    if (!item || item->type != ITEM_STRING) {
-        // Getting a non-string item as a string is not defined
-        return 0;
+    // Only digits, signs and the exponent are left once the decimal point is skipped.  It may be
+    // more than one byte in some locales
+    for (p = buf; *p; p++)  {
+        if ((*p < '0' || *p > '9') && *p != '-' && *p != '+' && *p != 'e')  {
+            end = p;
+            while (*end && (*end < '0' || *end > '9'))  {
+                end++;
+            }
+            
+            *p = '.';
+            memmove(p + 1, end, strlen(end) + 1);
+            length -= (int)(end - p) - 1;
+            break;
+        }
     }
     
-    return item->val.string_value;
+    return length;
 }
 
 /**
@@ -296,16 +1024,7 @@ const list* _get_dictionary_list_ref(ngt_dictionary* dict, const char* marker)
         return 0;
     }
     
-    item = _query_item(dict, marker);
-    if (!item)  {
-        // Look in the parent dictionary
-        item = _query_item(dict->parent, marker);
-    }
-    
-    if (!item && dict != ngt_get_global_dictionary())   {
-        // Last chance, look up in global dictionary
-        item = _query_item(ngt_get_global_dictionary(), marker);
-    }
+    item = _find_item(dict, marker, 0);
     
     if (!item || !(item->type & ITEM_D_LIST))   {
         // Getting a non-d-list item as a d-list is not defined
@@ -329,16 +1048,7 @@ struct _include_params_tag* _get_include_params_ref(ngt_dictionary* dict, const
         return 0;
     }
     
-    item = _query_item(dict, marker);
-    if (!item)  {
-        // Look in the parent dictionary
-        item = _query_item(dict->parent, marker);
-    }
-    
-    if (!item && dict != ngt_get_global_dictionary())   {
-        // Last chance, look up in global dictionary
-        item = _query_item(ngt_get_global_dictionary(), marker);
-    }
+    item = _find_item(dict, marker, 0);
     
     if (!item || item->type != ITEM_INCLUDE)    {
         // Getting a non-include item as an include is not defined
@@ -348,6 +1058,48 @@ struct _include_params_tag* _get_include_params_ref(ngt_dictionary* dict, const
     return &item->val.include_value;
 }
 
+/**
+ * Gets the lazy value params struct in the template dictionary for the given marker
+ *
+ * Returns the pointer to the value of the marker, or 0 if not found or if the given node is not
+ * a LAZY value
+ */
+struct _lazy_params_tag* _get_lazy_params_ref(ngt_dictionary* dict, const char* marker) {
+    _dictionary_item* item;
+    if (!dict)  {
+        return 0;
+    }
+    
+    item = _find_item(dict, marker, 0);
+    
+    if (!item || item->type != ITEM_LAZY)   {
+        return 0;
+    }
+    
+    return &item->val.lazy_value;
+}
+
+/**
+ * Gets the section iterator params struct in the template dictionary for the given marker
+ *
+ * Returns the pointer to the value of the marker, or 0 if not found or if the given node is not
+ * an ITERATOR
+ */
+struct _iterator_params_tag* _get_iterator_params_ref(ngt_dictionary* dict, const char* marker)  {
+    _dictionary_item* item;
+    if (!dict)  {
+        return 0;
+    }
+    
+    item = _find_item(dict, marker, 0);
+    
+    if (!item || item->type != ITEM_ITERATOR)   {
+        return 0;
+    }
+    
+    return &item->val.iterator_value;
+}
+
 /**
  * Helper function - returns nonzero if the portion of the input string starting at p matches the given
  * marker, 0 otherwise
@@ -424,35 +1176,33 @@ _parse_context* _duplicate_context(_parse_context* ctx) {
 }
 
 /**
- * Helper function - appends the marked whitespace at the current position in the output
+ * Helper function - appends the first n characters of str to the string builder in one go.  Like
+ * the string builder's own appends, it keeps count of its reallocations, and it leaves the string
+ * zero terminated without counting the terminator in pos
  */
-void _append_line_whitespace(_parse_context* line_ctx, _parse_context* out_ctx) {
-    char* ptr;
+void _sb_append_n(stringbuilder* sb, const char* str, size_t n) {
+    size_t size;
     
-    if (line_ctx->parent)   {
-        _append_line_whitespace(line_ctx->parent, out_ctx);
-    } else {
-        return;
-    }
-    
-    if (!line_ctx->expanding_include)   {
-        return;
-    }
-    
-    if (line_ctx->parent->line_ws_range == 0)   {
-        return;
+    if (n >= (size_t)INT_MAX - sb->pos)    {
+        // The string builder counts in ints
+        fprintf(stderr, "Expanded template is too long\n");
+        exit(-1);
     }
     
-    ptr = line_ctx->parent->line_ws_start;
-    while(ptr)  {
-        
-        sb_append_ch(out_ctx->out_sb, *ptr++);
-        
-        if ((ptr - line_ctx->parent->line_ws_start) == line_ctx->parent->line_ws_range) {
-            // We're done
-            ptr = 0;
+    if (sb->pos + n >= (size_t)sb->size)    {
+        size = sb->size ? (size_t)sb->size : 16;
+        while (sb->pos + n >= size) {
+            size = size < INT_MAX / 2 ? size * 2 : INT_MAX;
         }
+        
+        sb->cstr = (char*)realloc(sb->cstr, size);
+        sb->size = (int)size;
+        sb->reallocs++;
     }
+    
+    memcpy(sb->cstr + sb->pos, str, n);
+    sb->pos += (int)n;
+    sb->cstr[sb->pos] = '\0';
 }
 
 /**
@@ -495,6 +1245,101 @@ void _process_set_delimiter(_parse_context* ctx)    {
     }
 }
 
+/**
+ * Helper function - reads through the template text without expanding anything and calls scan_fn
+ * with the name of every marker of the given kinds (a mask of MODE_MARKER_* flags) along with the
+ * delimiters in effect there.  Set Delimiter markers are followed, comments are skipped.  Scanning
+ * stops quietly at the first malformed marker, expanding the template will report it
+ */
+void _scan_markers(const char* tmpl, const delimiter* start, const delimiter* end, int kinds, _marker_scan_fn scan_fn, void* data)    {
+    delimiter start_delimiter, end_delimiter, new_start, new_end;
+    char marker[MAXMARKERLENGTH];
+    const char* p;
+    int kind, m;
+    
+    _copy_delimiter(&start_delimiter, start);
+    _copy_delimiter(&end_delimiter, end);
+    
+    p = tmpl;
+    while (*p)  {
+        if (!_match_marker(p, &start_delimiter))    {
+            p++;
+            continue;
+        }
+        
+        p += start_delimiter.length;
+        EAT_WHITESPACE(p);
+        switch(*p)  {
+            case '!':   kind = MODE_MARKER_COMMENT;     p++;    break;
+            case '#':   kind = MODE_MARKER_SECTION;     p++;    break;
+            case '/':   kind = MODE_MARKER_ENDSECTION;  p++;    break;
+            case '=':   kind = MODE_MARKER_DELIMITER;   p++;    break;
+            case '>':   kind = MODE_MARKER_INCLUDE;     p++;    break;
+            default:    kind = MODE_MARKER_VARIABLE;            break;
+        }
+        
+        if (kind == MODE_MARKER_DELIMITER)  {
+            // Same rules as _process_set_delimiter()
+            EAT_WHITESPACE(p);
+            p = _extract_delimiter(p, &new_start);
+            EAT_SPACES(p);
+            if (*p == '=')  {
+                _copy_delimiter(&new_end, &new_start);
+            } else {
+                p = _extract_delimiter(p, &new_end);
+                EAT_SPACES(p);
+                if (*p != '=')  {
+                    return;
+                }
+            }
+            
+            p++;
+            if (!_match_marker(p, &end_delimiter))  {
+                return;
+            }
+            
+            p += end_delimiter.length;
+            _copy_delimiter(&start_delimiter, &new_start);
+            _copy_delimiter(&end_delimiter, &new_end);
+            continue;
+        }
+        
+        // Whitespace is allowed anywhere in a marker, and a variable name ends at its modifiers
+        m = 0;
+        while (*p && !_match_marker(p, &end_delimiter)) {
+            if (kind != MODE_MARKER_COMMENT && *p == ':')   {
+                break;
+            }
+            
+            if (kind != MODE_MARKER_COMMENT && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')  {
+                if ((!isalnum(*p) && *p != '_') || m == MAXMARKERLENGTH - 1)    {
+                    return;
+                }
+                
+                marker[m++] = *p;
+            }
+            
+            p++;
+        }
+        
+        // Skip the modifiers, if any
+        while (*p && !_match_marker(p, &end_delimiter))    {
+            p++;
+        }
+        
+        if (!*p)    {
+            return;
+        }
+        
+        p += end_delimiter.length;
+        marker[m] = '\0';
+        
+        if (kind & kinds)   {
+            scan_fn(kind, marker, p, &start_delimiter, &end_delimiter, data);
+        }
+    }
+}
+
 /*
  * Helper function - Given a marker with modifiers and the original value, parses the modifiers and 
  *                   runs them
@@ -613,31 +1458,212 @@ void _process_modifiers(const char* marker, const char* modifiers, const char* v
     }
 }
 
+/**
+ * Helper function - returns the table of values resolved during the expansion, creating it the
+ * first time it is needed
+ */
+ngt_dictionary* _resolved_values(_parse_context* ctx)   {
+    if (!*ctx->resolved)    {
+        *ctx->resolved = ngt_dictionary_new();
+    }
+    
+    return *ctx->resolved;
+}
+
+/**
+ * Helper function - adds every marker the dictionary or any of its section dictionaries has a
+ * string, typed or lazy value for to the given set
+ */
+static void _collect_section_values(ngt_dictionary* dict, ngt_dictionary* values)   {
+    _item_cursor cursor;
+    _dictionary_item* item;
+    list_element* child;
+    
+    memset(&cursor, 0, sizeof(_item_cursor));
+    while ((item = _next_item(dict, &cursor)) != 0) {
+        if (ITEM_IS_VALUE(item->type) || item->type == ITEM_LAZY)   {
+            if (!_query_item(values, item->marker)) {
+                _set_string(values, item->marker, 0);
+            }
+        } else if (item->type & ITEM_D_LIST && item->val.d_list_value)  {
+            for (child = list_head(item->val.d_list_value); child; child = list_next(child))    {
+                _collect_section_values(ROW_DICTIONARY(child), values);
+            }
+        }
+    }
+    
+    // The sections of an overlay's base count as well
+    if (dict->base) {
+        _collect_section_values(dict->base, values);
+    }
+}
+
+/**
+ * Helper function - _scan_markers() callback that adds variables no dictionary has a value for to
+ * the missing variables, once each
+ */
+static void _collect_missing_variable(int kind, const char* marker, const char* position, const delimiter* start, 
+                                        const delimiter* end, void* data)   {
+    _missing_variables* missing = (_missing_variables*)data;
+    _dictionary_item* item;
+    
+    if (_query_item(missing->resolved, marker) || _get_value_item_ref(missing->dictionary, marker) ||
+        _get_lazy_params_ref(missing->dictionary, marker))  {
+        return;
+    }
+    
+    if (missing->dictionary)    {
+        // Walk the sections once for all the markers, not once for every marker
+        if (!missing->section_values)   {
+            missing->section_values = ngt_dictionary_new();
+            _collect_section_values(missing->dictionary, missing->section_values);
+        }
+        
+        if (_query_item(missing->section_values, marker))   {
+            return;
+        }
+    }
+    
+    _set_string(missing->resolved, marker, 0);
+    item = _query_item(missing->resolved, marker);
+    
+    if (missing->count == missing->capacity)    {
+        missing->capacity = missing->capacity ? missing->capacity * 2 : 16;
+        missing->markers = (const char**)realloc(missing->markers, missing->capacity * sizeof(char*));
+    }
+    
+    missing->markers[missing->count++] = item->marker;
+}
+
+/**
+ * Helper function - gives the bulk variables_missing callback of the template all the variables of
+ * the template that have no value in the dictionary, before the expansion starts
+ */
+void _resolve_missing_variables(_parse_context* ctx)    {
+    _missing_variables missing;
+    _dictionary_item* item;
+    char** values;
+    int i;
+    
+    memset(&missing, 0, sizeof(_missing_variables));
+    missing.dictionary = ctx->active_dictionary;
+    missing.resolved = _resolved_values(ctx);
+    
+    _scan_markers(ctx->in_ptr, &ctx->active_start_delimiter, &ctx->active_end_delimiter, MODE_MARKER_VARIABLE, _collect_missing_variable, &missing);
+    if (missing.section_values) {
+        ngt_dictionary_destroy(missing.section_values);
+    }
+    
+    if (!missing.count) {
+        return;
+    }
+    
+    values = (char**)malloc(missing.count * sizeof(char*));
+    memset(values, 0, missing.count * sizeof(char*));
+    
+    ctx->template->variables_missing(missing.markers, values, missing.count);
+    
+    for (i = 0; i < missing.count; i++) {
+        if (values[i] || !ctx->template->variable_missing)  {
+            item = _query_item(missing.resolved, missing.markers[i]);
+            item->val.string_value = values[i];
+        } else {
+            // Leave it to the variable_missing callback.  This frees the marker name as well
+            item = _query_item(missing.resolved, missing.markers[i]);
+            _table_remove(missing.resolved, item);
+        }
+    }
+    
+    free(values);
+    free(missing.markers);
+}
+
 /**
  * Helper function - Expands a variable marker in the template
  */
 void _process_variable(const char* marker, const char* modifiers, _parse_context* ctx)  {
-    char* value;
+    struct _lazy_params_tag* lazy;
+    _dictionary_item* item, *found;
+    char key[32], buf[VALUE_BUFFER_LENGTH];
+    char* value, *copy;
+    size_t length;
+    
+    if (ctx->discarding)    {
+        // Nobody will see it, so don't go computing or fetching anything for it
+        return;
+    }
     
-    value = (char*)_get_string_value_ref(ctx->active_dictionary, marker);
-    if (!value) {
+    // Typed values are formatted on the stack, only now that we know they are needed
+    value = 0;
+    found = _resolve_item(ctx, marker, ctx->in_ptr);
+    item = found && ITEM_IS_VALUE(found->type) ? found : 0;
+    if (item)   {
+        value = (char*)_format_value(item, buf, &length);
+        if (!(ctx->mode & MODE_MARKER_MODIFIER))    {
+            // Nothing to modify, so it goes straight to the output without looking for the end
+            _sb_append_n(ctx->out_sb, value, length);
+            return;
+        }
         
-        // Find the first parse context up the chain with a valid
-        // template dictionary and variable missing cb
-        _parse_context* this_ctx = ctx;
-        ngt_template* tpl = 0;
-        while (this_ctx)    {
-            if (this_ctx && this_ctx->template && this_ctx->template->variable_missing) {
-                tpl = this_ctx->template;
-                break;
-            }
+        if (item->type == ITEM_BUFFER && !item->val.buffer_value.owned) {
+            // Modifiers want a zero terminated string, which a borrowed buffer doesn't have to be
+            copy = (char*)malloc(length + 1);
+            memcpy(copy, value, length);
+            copy[length] = '\0';
             
-            this_ctx = this_ctx->parent;
+            _process_modifiers(marker, modifiers, copy, ctx);
+            free(copy);
+            return;
+        }
+    }
+    
+    if (!value && found && found->type == ITEM_LAZY)    {
+        lazy = &found->val.lazy_value;
+        // Lazy values are remembered by the address of their params, since sections may have
+        // different ones for the same marker.  Markers can't contain ':' so this never clashes
+        sprintf(key, ":%p", (void*)lazy);
+        item = _query_item(*ctx->resolved, key);
+        if (item)   {
+            value = item->val.string_value;
+        } else {
+            value = lazy->compute(marker, lazy->data);
+            _set_string(_resolved_values(ctx), key, value);
         }
+    }
+    
+    if (!value) {
         
-        if (tpl && tpl->variable_missing)   {
-            // Give user code a chance to fill in this value
-            value = tpl->variable_missing(marker);
+        // Values the callbacks gave us before are good for the whole expansion, even if they 
+        // didn't have one
+        item = _query_item(*ctx->resolved, marker);
+        if (item)   {
+            value = item->val.string_value;
+        } else {
+            // Find the first parse context up the chain with a valid
+            // template dictionary and variable missing cb
+            _parse_context* this_ctx = ctx;
+            ngt_template* tpl = 0;
+            while (this_ctx)    {
+                if (this_ctx && this_ctx->template && 
+                    (this_ctx->template->variable_missing || this_ctx->template->variables_missing)) {
+                    tpl = this_ctx->template;
+                    break;
+                }
+                
+                this_ctx = this_ctx->parent;
+            }
+            
+            if (tpl && tpl->variable_missing)   {
+                // Give user code a chance to fill in this value
+                value = tpl->variable_missing(marker);
+            } else if (tpl) {
+                // Not one the bulk callback has seen before, probably from an include
+                tpl->variables_missing(&marker, &value, 1);
+            }
+            
+            if (tpl)    {
+                _set_string(_resolved_values(ctx), marker, value);
+            }
         }
         
         if (!value) {
@@ -690,15 +1716,46 @@ int _process_separator_section(const char* marker, _parse_context* ctx) {
     return 1;
 }
 
+/**
+ * Helper function - forgets the lazy values of the dictionary and its sections that were resolved
+ * during the expansion, since its memory is about to be reused
+ */
+static void _forget_lazy_values(ngt_dictionary* resolved, ngt_dictionary* dict) {
+    _item_cursor cursor;
+    _dictionary_item* item, *resolved_item;
+    list_element* child;
+    char key[32];
+    
+    memset(&cursor, 0, sizeof(_item_cursor));
+    while ((item = _next_item(dict, &cursor)) != 0) {
+        if (item->type == ITEM_LAZY)    {
+            // Same key as _process_variable() uses
+            sprintf(key, ":%p", (void*)&item->val.lazy_value);
+            resolved_item = _query_item(resolved, key);
+            if (resolved_item)  {
+                _table_remove(resolved, resolved_item);
+            }
+        } else if (item->type & ITEM_D_LIST && item->val.d_list_value)   {
+            for (child = list_head(item->val.d_list_value); child; child = list_next(child)) {
+                _forget_lazy_values(resolved, ROW_DICTIONARY(child));
+            }
+        }
+    }
+}
+
 /**
  * Helper function - Expands a section in the template
  */
 void _process_section(const char* marker, _parse_context* ctx, int is_include)  {
     list *d_list_value;
     list_element* child;
+    struct _iterator_params_tag* iterator;
+    ngt_dictionary* row, *next_row;
+    _dictionary_item* item;
     char* resume;
     _parse_context* section_ctx;
-    int saved_out_pos;
+    _scope_cache scopes;
+    int saved_out_pos, discarding, visible;
     
     if (_process_separator_section(marker, ctx))    {
         // Section was a separator, which has to be handled differently
@@ -706,8 +1763,11 @@ void _process_section(const char* marker, _parse_context* ctx, int is_include)
     }
     
     // We loop through each dictionary in the dictionary list for this marker 
-    // (0 or more), and for each one we recursively process the template there
-    d_list_value = (list*)_get_dictionary_list_ref(ctx->active_dictionary, marker);
+    // (0 or more), and for each one we recursively process the template there.  An include 
+    // starts at the top of its body, which is no place to remember the lookup by
+    item = _resolve_item(ctx, marker, is_include ? 0 : ctx->in_ptr);
+    d_list_value = item && item->type & ITEM_D_LIST ? item->val.d_list_value : 0;
+    iterator = item && item->type == ITEM_ITERATOR ? &item->val.iterator_value : 0;
     
     if (is_include) {
         section_ctx = ctx;
@@ -715,19 +1775,40 @@ void _process_section(const char* marker, _parse_context* ctx, int is_include)
         section_ctx = _duplicate_context(ctx);
         section_ctx->parent = ctx;
         section_ctx->expanding_include = 0;
+        
+        // Every instance of a section gets its own scope cache
+        memset(&scopes, 0, sizeof(_scope_cache));
+        section_ctx->scopes = &scopes;
     }
     
     section_ctx->current_section = (char*)marker;
     resume = section_ctx->in_ptr;
     
+    // An include expands in our own context, so remember whether we were discarding before
+    discarding = ctx->discarding;
+    
     child = 0;
+    row = next_row = 0;
     if (d_list_value)   {
         child = list_head(d_list_value);
+    } else if (iterator && !discarding) {
+        // Rows are pulled one ahead of the one being expanded, so we know which one is the last
+        next_row = iterator->next(marker, iterator->data);
     }
     
     do {
-        section_ctx->last_expansion = (child && list_next(child) == 0) ? 1: 0;
-        section_ctx->active_dictionary = child? (ngt_dictionary*)list_data(child) : 0;
+        if (iterator)   {
+            row = next_row;
+            next_row = row ? iterator->next(marker, iterator->data) : 0;
+            section_ctx->last_expansion = row && !next_row;
+            section_ctx->active_dictionary = row;
+            visible = row != 0;
+        } else {
+            section_ctx->last_expansion = (child && list_next(child) == 0) ? 1: 0;
+            section_ctx->active_dictionary = child ? ROW_DICTIONARY(child) : 0;
+            visible = child && ((_section_row*)list_data(child))->visible;
+        }
+        section_ctx->discarding = discarding || !visible;
         section_ctx->in_ptr = ctx->in_ptr;
         saved_out_pos = ctx->out_sb->pos;
             
@@ -741,15 +1822,24 @@ void _process_section(const char* marker, _parse_context* ctx, int is_include)
             exit(-1);
         }
             
-        if (!section_ctx->active_dictionary || !section_ctx->active_dictionary->should_expand)  {
+        if (!visible)   {
             // We only use the output if we had an actual dictionary, else we have to throw it 
             // out because we didn't ultimately expand anything
             ctx->out_sb->pos = saved_out_pos;
         }
+        
+        if (row)    {
+            // Done with this row for good
+            if (*ctx->resolved) {
+                _forget_lazy_values(*ctx->resolved, row);
+            }
+            ngt_dictionary_destroy(row);
+        }
     
-    } while (child && (child = list_next(child)) != 0);
+    } while (iterator ? next_row != 0 : (child && (child = list_next(child)) != 0));
     
     if (!is_include)    {
+        _scope_cache_clear(&scopes);
         free(section_ctx);
     }
     ctx->in_ptr = resume;   // Now we can skip over the read template section
@@ -760,39 +1850,82 @@ void _process_section(const char* marker, _parse_context* ctx, int is_include)
  */
 void _process_include(const char* marker, _parse_context* ctx)  {
     struct _include_params_tag* params;
+    _dictionary_item* item;
     _parse_context* include_ctx;
+    _scope_cache scopes;
+    char* template, *linked;
+    int base_length;
     
-    params = _get_include_params_ref(ctx->active_dictionary, marker);
+    item = _resolve_item(ctx, marker, ctx->in_ptr);
+    params = item && item->type == ITEM_INCLUDE ? &item->val.include_value : 0;
     if (!params || !params->get_template)   {
         // Can't do anything with this one
         return;
     }
-        
-    // The way this works is if someone has set a filename for us, we'll pass that to 
-    // the get_template callback, else we'll just pass the marker name and hope they know
-    // what to do with it
-    if (!params->template)  {
-        if (params->filename)   {
-            params->template = params->get_template(params->filename);
-        } else {
-            params->template = params->get_template(marker);
-        }
+    
+    // The dictionary may be shared by several expanding threads, so the memoized template is 
+    // only ever read and published atomically
+    template = NGT_ATOMIC_LOAD(&params->template);
+    if (!template)  {
+        template = _load_include_template(params, marker, ctx->include_paths);
     }
 
-    if (!params->template)  {
+    if (!template)  {
         // We got nothin'
         return;
     }   
     
     include_ctx = _duplicate_context(ctx);
     include_ctx->parent = ctx;
-    include_ctx->in_ptr = params->template;
+    include_ctx->in_ptr = template;
     include_ctx->template_line = 1;
     include_ctx->expanding_include = 1;
+    include_ctx->linked = 0;
+    
+    // The same include body is expanded for every row around it, so the markers in it can't be
+    // remembered in the cache of our section instance.  Each include instance gets its own
+    memset(&scopes, 0, sizeof(_scope_cache));
+    include_ctx->scopes = &scopes;
+    
+    // Every line of the include but the first is indented like we are, plus the whitespace in
+    // front of the include marker.  Past our first line a linked body already has our own 
+    // indentation in that whitespace
+    base_length = (ctx->linked && ctx->template_line > 1) ? 0 : ctx->indent_length;
+    include_ctx->indent_length = base_length + ctx->line_ws_range;
+    include_ctx->indent = 0;
+    if (include_ctx->indent_length) {
+        include_ctx->indent = (char*)malloc(include_ctx->indent_length + 1);
+        if (base_length)    {
+            memcpy(include_ctx->indent, ctx->indent, base_length);
+        }
+        memcpy(include_ctx->indent + base_length, ctx->line_ws_start, ctx->line_ws_range);
+        include_ctx->indent[include_ctx->indent_length] = '\0';
+    }
+    
+    if (ctx->linked && ctx->template_line > 1)  {
+        // Until it reaches its first newline the include keeps using our line whitespace, which
+        // starts with the indentation spliced into our body.  Skip that, it's applied separately
+        include_ctx->line_ws_start += ctx->indent_length;
+        include_ctx->line_ws_range -= ctx->indent_length;
+    }
+    
+    if (params->filename && params->get_template == _map_template_file) {
+        // File includes never change, so we can expand a copy of the body that has the 
+        // indentation of this spot already spliced into every line
+        linked = _include_linked_body(template, include_ctx->indent, include_ctx->indent_length);
+        if (linked) {
+            include_ctx->in_ptr = linked;
+            include_ctx->linked = 1;
+        }
+    }
     
     // Now we can treat it just like a normal section, then restore the original template
     _process_section(marker, include_ctx, 1);
     
+    _scope_cache_clear(&scopes);
+    if (include_ctx->indent)    {
+        free(include_ctx->indent);
+    }
     free(include_ctx);
 }
 
@@ -924,11 +2057,11 @@ char* _process(_parse_context *ctx) {
             
             sb_append_ch(ctx->out_sb, *ctx->in_ptr++);
             
-            if (ctx->template_line > 1 && *(ctx->in_ptr-1) == '\n') {
+            if (ctx->template_line > 1 && *(ctx->in_ptr-1) == '\n' && ctx->indent_length && !ctx->linked) {
                 // We're currenlty expanding an include section, which means we need
                 // to copy the accumulated whitespace at the beginning of each line
                 // other than the first one
-                _append_line_whitespace(ctx, ctx);
+                _sb_append_n(ctx->out_sb, ctx->indent, ctx->indent_length);
             }
             
         }
@@ -4,6 +4,9 @@
 #ifndef INTERNAL_H
 #define INTERNAL_H
 
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
 #include "ngtemplate.h"
 
 /* Parse modes */
@@ -18,12 +21,73 @@
 #define MODE_MARKER_MODIFIER        128
 
 
+/* 
+ * Atomic helpers.  Everything that an expansion may read while another thread publishes it goes
+ * through these so the hot path stays lock-free
+ */
+#define NGT_ATOMIC_LOAD(p)              __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define NGT_ATOMIC_STORE(p, v)          __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define NGT_ATOMIC_LOAD_RELAXED(p)      __atomic_load_n((p), __ATOMIC_RELAXED)
+#define NGT_ATOMIC_STORE_RELAXED(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define NGT_ATOMIC_LOAD_SC(p)           __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define NGT_ATOMIC_STORE_SC(p, v)       __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define NGT_ATOMIC_EXCHANGE(p, v)       __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define NGT_ATOMIC_FETCH_ADD(p, v)      __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define NGT_ATOMIC_CAS(p, expected, v)  __atomic_compare_exchange_n((p), (expected), (v), 0, \
+                                            __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+
+/* Items that hold a number or a boolean instead of a string */
+#define ITEM_IS_TYPED(type)         ((type) == ITEM_INT || (type) == ITEM_DOUBLE || (type) == ITEM_BOOL)
+
+/* Items that expand to a value: strings, buffers and typed values */
+#define ITEM_IS_VALUE(type)         ((type) == ITEM_STRING || (type) == ITEM_BUFFER || ITEM_IS_TYPED(type))
+
+/* Big enough for any typed value, formatted */
+#define VALUE_BUFFER_LENGTH         32
+
+/* Markers and string values this long or shorter are kept inside their item */
+#define ITEM_INLINE_LENGTH          22
+
+/* Item flags: the marker or the string value is kept inside the item, and is not freed */
+#define ITEM_INLINE_MARKER          1
+#define ITEM_INLINE_VALUE           2
+
+/* Item flag: the string value belongs to the dictionary's string pool, and is not freed */
+#define ITEM_POOLED_VALUE           4
+
+/* Item flags: the marker or the string value is kept in the strings of an item block, and is not
+   freed */
+#define ITEM_BLOCK_MARKER           8
+#define ITEM_BLOCK_VALUE            16
+
+/* Item flags that say where the string value is kept */
+#define ITEM_VALUE_FLAGS            (ITEM_INLINE_VALUE | ITEM_POOLED_VALUE | ITEM_BLOCK_VALUE)
+
+/* Size of the chunks a string pool carves its strings out of */
+#define POOL_CHUNK_SIZE             65536
+
+/* Starting number of buckets of a string pool, a power of two */
+#define POOL_INITIAL_CAPACITY       256
+
+/* Reset dictionaries a thread keeps for ngt_dictionary_acquire(), past which they are destroyed */
+#define SPARE_DICTIONARIES_MAX      256
+
+/* Items in the first block of a dictionary.  Every later block is twice the size, up to the max */
+#define ITEM_BLOCK_INITIAL          8
+#define ITEM_BLOCK_MAX              512
+
+/* Starting size of a dictionary's index, a power of two */
+#define ITEM_INDEX_INITIAL_CAPACITY 16
+
+/* Starting size of a section's scope cache, a power of two */
+#define SCOPE_CACHE_INITIAL_CAPACITY    16
+
 #define EAT_SPACES(p)       while(*(p) == ' ' || *(p) == '\t') { (p)++; }
 #define EAT_WHITESPACE(p)   while(*(p) == ' ' || *(p) == '\t' || *(p) == '\r' || *(p) == '\n') { (p)++; }
 
 
 /** 
- * These are the items we will hold in the dictionary hash
+ * These are the items we will hold in the dictionary
  *
  * NOTE: This is a kind of "self-inherited struct".  By that, I mean that any item that is an
  *      ITEM_INCLUDE is ALSO an ITEM_D_LIST, and you can treat it as such by (e.g.) using 
@@ -38,16 +102,32 @@
  *
  */
 typedef struct _dictionary_item_tag {
-    char* marker;
+    char* marker;                   /* Points at inline_marker if the marker is short enough */
     enum { 
         ITEM_STRING = 0, 
         ITEM_D_LIST = 1, 
-        ITEM_INCLUDE = 3    /* So a bitwise AND test on ITEM_D_LIST will succeed on ITEM_INCLUDE */ 
+        ITEM_INCLUDE = 3,   /* So a bitwise AND test on ITEM_D_LIST will succeed on ITEM_INCLUDE */ 
+        ITEM_LAZY = 4,
+        ITEM_ITERATOR = 6,  /* Even, so it is never mistaken for an ITEM_D_LIST */
+        ITEM_INT = 8,
+        ITEM_DOUBLE = 10,
+        ITEM_BOOL = 12,
+        ITEM_BUFFER = 14    /* A string with a stored length, borrowed or owned */
     } type;
+    unsigned hash;                  /* Of the marker, see _marker_hash() */
     
     union   {
         char* string_value;
         list* d_list_value;
+        int64_t int_value;
+        double double_value;
+        int bool_value;
+        
+        struct _buffer_params_tag   {
+            const char*     data;           /* Not necessarily zero terminated if borrowed */
+            size_t          length;
+            int             owned;          /* Nonzero if we have to free data */
+        } buffer_value;
         
         struct  _include_params_tag {
             list* d_list;           /* NOTE: MUST be the first item in the struct.  This lets us use
@@ -60,9 +140,222 @@ typedef struct _dictionary_item_tag {
             char* filename;         /* Only used in case of template_set_filename */
             
         } include_value;
+        
+        struct _lazy_params_tag {
+            lazy_value_fn   compute;
+            void*           data;
+        } lazy_value;
+        
+        struct _iterator_params_tag {
+            section_next_fn next;
+            void*           data;
+        } iterator_value;
+        
+        struct _inline_string_tag   {
+            char*           data;           /* NOTE: MUST be the first item in the struct, since it
+                                                is string_value.  Points at chars              */
+            char            chars[ITEM_INLINE_LENGTH + 1];
+        } inline_value;
     } val;
+    
+    char inline_marker[ITEM_INLINE_LENGTH + 1];
+    unsigned char flags;            /* ITEM_INLINE_*, ITEM_BLOCK_* and ITEM_POOLED_VALUE */
 } _dictionary_item;
 
+// A row of a section.  The same dictionary may be a row of other sections as well, so whether it
+// is shown belongs to the row rather than to the dictionary
+typedef struct _section_row_tag {
+    ngt_dictionary*     dictionary;         // Holds one reference to it
+    int                 visible;            // NGT_SECTION_VISIBLE or NGT_SECTION_HIDDEN
+} _section_row;
+
+// The dictionary of a list_element in a section list
+#define ROW_DICTIONARY(e)   (((_section_row*)list_data(e))->dictionary)
+
+// A block of dictionary items.  Blocks never move, so pointers to items stay good for as long as
+// the items are in the dictionary.  A block reserved for a batch of items also has room for their
+// long markers and values
+typedef struct _item_block_tag  {
+    struct _item_block_tag* next;           // The block allocated before this one
+    unsigned            count;
+    unsigned            capacity;
+    _dictionary_item*   items;              // Right behind the block header
+    char*               strings;            // Right behind the items
+    size_t              strings_used;
+    size_t              strings_capacity;
+} _item_block;
+
+// An include name resolved through a set of search paths, and the file it was read from
+typedef struct _include_entry_tag   {
+    char*   key;
+    int     hash;
+    char*   template;                       // Holds a reference to the text
+    char*   path;                           // Canonical path of the file
+    ino_t   inode;                          // What the file looked like when it was read
+    off_t   size;
+    struct timespec modified;
+    time_t  checked;                        // When the name was last looked up on disk
+    struct _include_entry_tag* next;
+} _include_entry;
+
+// A copy of an include body with an indentation spliced in after every newline
+typedef struct _linked_body_tag {
+    struct _linked_body_tag* next;
+    size_t              indent_length;
+    char*               body;               // Allocated along with the header, then the indentation
+} _linked_body;
+
+// A template file mapped by _map_template_file() or read by _read_template_file(), which hand out
+// the text
+typedef struct _template_file_tag   {
+    size_t              length;
+    int                 references;         // Starts at one, the text is freed when it drops to zero
+    size_t              mapped;             // Length of the mapping the text lives in, or 0 if the
+                                            //  text was read into the heap
+    _linked_body*       linked;             // Linked copies of the text made so far, newest first.
+                                            //  Published atomically and never changed after
+    int                 linked_count;       // Protected by the linked body lock
+    char                text[1];            // Zero terminated, allocated along with the header
+} _template_file;
+
+// A chained hash table from names to include template text
+typedef struct _include_table_tag   {
+    _include_entry**    buckets;
+    int                 capacity;           // Always a power of two, or 0 before the first insert
+    int                 used;
+} _include_table;
+
+// The include search directories of a template or registry
+typedef struct _include_paths_tag   {
+    pthread_mutex_t     lock;
+    char**              dirs;               // Searched in the order they were added
+    int                 count;
+    _include_table      names;              // Include names resolved through these directories
+    size_t              bytes;              // Length of all the texts the names refer to
+    size_t              max_bytes;          // The names are forgotten once the texts grow past this
+    int                 prefetching;        // Prefetches still using these paths, protected by 
+                                            //  the prefetch lock
+} _include_paths;
+
+// An include the prefetcher may load on behalf of a dictionary
+typedef struct _prefetch_item_tag   {
+    const char*         marker;
+    struct _include_params_tag* params;
+    int                 queued;             // Nonzero once a load has been queued for it
+} _prefetch_item;
+
+// One call to ngt_prefetch_includes().  Holds every include of the dictionary so includes found
+// in loaded bodies can be queued without touching the dictionary from the I/O threads
+typedef struct _prefetch_batch_tag  {
+    ngt_dictionary*     dictionary;
+    _include_paths*     include_paths;
+    _prefetch_item*     items;
+    int                 count;
+    int                 capacity;
+    ngt_dictionary**    dictionaries;       // The dictionary, and every other one the items live in.
+                                            //  Their prefetching counts include the batch
+    int                 dictionary_count;
+    int                 dictionary_capacity;
+    int                 pending;            // Queued loads plus the caller while it is scanning
+} _prefetch_batch;
+
+// A load waiting for an I/O thread
+typedef struct _prefetch_job_tag    {
+    _prefetch_batch*    batch;
+    int                 index;              // The item to load
+    delimiter           start_delimiter;    // In effect where the include was found, used to 
+    delimiter           end_delimiter;      //  look for includes in the loaded body
+    struct _prefetch_job_tag* next;
+} _prefetch_job;
+
+// The immutable layout of a frozen dictionary, in a single block.  A marker's hash with seed 0
+// picks a bucket, whose seed is 0 if no marker hashed there, -(slot + 1) if a single one did, and
+// otherwise the seed for a second hash that gives the slot
+typedef struct _frozen_dictionary_tag   {
+    unsigned            count;              // Number of items, slots and buckets alike
+    int*                seeds;              // One per bucket
+    _dictionary_item*   items;              // Markers and string values point into the block
+} _frozen_dictionary;
+
+// A bucket of markers while a frozen dictionary is being built
+typedef struct _frozen_bucket_tag   {
+    unsigned            index;              // Which bucket this is
+    unsigned            first;              // Its first marker among the ones sorted by bucket
+    int                 count;
+    int                 placed;
+} _frozen_bucket;
+
+// Where a walk over the items of a dictionary is, see _next_item().  Start with a zeroed one
+typedef struct _item_cursor_tag {
+    int                 slot;               // The next slot of a schema-bound dictionary
+    _item_block*        block;
+    unsigned            index;
+    int                 started;
+} _item_cursor;
+
+// A string in a string pool
+typedef struct _pool_entry_tag  {
+    struct _pool_entry_tag* next;           // The next entry in the same bucket
+    unsigned            hash;
+    size_t              length;
+    char                chars[1];           // Zero terminated, allocated along with the entry
+} _pool_entry;
+
+// A chunk of memory a string pool carves its entries out of, followed by the entries
+typedef struct _pool_chunk_tag  {
+    struct _pool_chunk_tag* next;
+    size_t              capacity;
+    size_t              used;
+} _pool_chunk;
+
+struct ngt_string_pool_tag  {
+    pthread_mutex_t     lock;               // Taken for every string interned
+    _pool_entry**       buckets;
+    unsigned            capacity;
+    unsigned            count;
+    _pool_chunk*        chunks;             // The chunk being filled comes first
+};
+
+// The reset dictionaries a thread keeps for reuse, see ngt_dictionary_acquire()
+typedef struct _spare_dictionaries_tag  {
+    ngt_dictionary*     dictionaries[SPARE_DICTIONARIES_MAX];
+    int                 count;
+} _spare_dictionaries;
+
+// The variables of a template that have no value in the dictionary, gathered for the bulk
+// variables_missing callback
+typedef struct _missing_variables_tag   {
+    ngt_dictionary*     dictionary;         // The dictionary being expanded
+    ngt_dictionary*     resolved;           // Gets an entry for every marker, to weed out repeats
+    ngt_dictionary*     section_values;     // Every marker with a value somewhere in the sections
+                                            //  of the dictionary, collected on first use
+    const char**        markers;            // Point at the marker names of those entries
+    int                 count;
+    int                 capacity;
+} _missing_variables;
+
+// Called by _scan_markers() for every marker found.  position is just past the end of the marker
+typedef void (*_marker_scan_fn)(int kind, const char* marker, const char* position, const delimiter* start, 
+                                    const delimiter* end, void* data);
+
+// A marker in the template of a schema.  position is just past its end delimiter, which is where
+// the expander is when it gets to the marker
+typedef struct _schema_occurrence_tag   {
+    const char*         position;
+    int                 slot;
+} _schema_occurrence;
+
+struct ngt_schema_tag   {
+    const char*         tmpl;               // The template text the positions point into
+    char**              markers;            // The marker of every slot
+    int*                by_name;            // Slots sorted by marker, for lookups by name
+    int                 count;
+    int                 capacity;
+    _schema_occurrence* occurrences;        // Every marker of the template, in order
+    int                 occurrence_count;
+    int                 occurrence_capacity;
+};
+
 // Represents a marker modifier
 typedef struct _modifier_tag    {
     char* name;                             // The name that will be used to call the modifier
@@ -70,6 +363,20 @@ typedef struct _modifier_tag    {
                                             // invoked
 } _modifier;
 
+// Where a marker occurrence inside a section was found, past the section dictionary itself
+typedef struct _scope_entry_tag {
+    const char*     occurrence;             // Where the marker is in the template, 0 if unused
+    ngt_dictionary* scope;                  // The dictionary it was found in, 0 if none has it
+} _scope_entry;
+
+// The scope cache of one section instance, good for every dictionary of the instance since they
+// are all enclosed by the same dictionaries
+typedef struct _scope_cache_tag {
+    _scope_entry*   entries;                // Open addressed by occurrence
+    unsigned        capacity;
+    unsigned        used;
+} _scope_cache;
+
 // Represents the current state of the template parser
 typedef struct _parse_context_tag   {
     struct _parse_context_tag* parent;      
@@ -80,7 +387,15 @@ typedef struct _parse_context_tag   {
     int last_expansion;                     // Nonzero if this is the last expansion in a series of
                                             //  section expansions.  Used for separator logic
     ngt_template* template;                 // The current template
+    _include_paths* include_paths;          // Where include filenames are looked up, may be null
     ngt_dictionary* active_dictionary;      // The curently active dictionary
+    ngt_dictionary** resolved;              // Values from lazy markers and the variable missing
+                                            //  callbacks so far, shared by the whole expansion.
+                                            //  Created on first use, see _resolved_values()
+    int     discarding;                     // Nonzero if the output is going to be thrown away, 
+                                            //  like in a hidden section
+    _scope_cache* scopes;                   // Where the markers of the section instance being
+                                            //  expanded were found, may be null
     
     delimiter active_start_delimiter;       // The current start delimiter
     delimiter active_end_delimiter;         // The current end delimiter
@@ -92,6 +407,11 @@ typedef struct _parse_context_tag   {
     int     out_pos;                        // Pointer representing position in the output string
     
     int     expanding_include;
+    char*   indent;                         // Whitespace to put in front of every line but the
+    int     indent_length;                  //  first, worked out once when an include is entered
+    int     linked;                         // Nonzero if in_ptr is in a linked include body, which
+                                            //  has the indentation spliced into every line but the
+                                            //  first already
     char*   line_ws_start;                  // When we include a template from another file, we want                    
     int     line_ws_range;                  //   every line of the expanded template to respect the 
                                             //   indention level of the include.  Furthermore, we keep
@@ -101,25 +421,119 @@ typedef struct _parse_context_tag   {
                                             //   right before the template include
 } _parse_context;
 
+// A named slot in a template registry.  Entries are never modified in place except for the 
+// template pointer, which is swapped atomically when a new version is published
+typedef struct _registry_entry_tag  {
+    char*           name;                   // The name the template is registered under
+    int             hash;                   // Hash of the name, so probes rarely need a strcmp
+    char*           filename;               // The file the template came from, or 0 if it was 
+                                            //  published from code.  Only touched under the lock
+    ngt_template*   template;               // The current version of the template, 0 if it has been
+                                            //  evicted and has to be loaded from filename again
+    unsigned long   last_used;              // Coarse timestamp of the last acquire, for LRU eviction
+    size_t          bytes;                  // Memory held by the current version
+    int             loading;                // Nonzero while a thread is loading it on a miss.  Only
+                                            //  touched under the lock
+} _registry_entry;
+
+// The registry lookup table.  Open addressing with linear probing, so readers never take a lock.
+// Writers fill empty slots in place and replace the whole table when it needs to grow
+#define REGISTRY_TOMBSTONE  ((_registry_entry*)1)
+typedef struct _registry_table_tag  {
+    int             capacity;               // Always a power of two
+    int             used;                   // Live entries plus tombstones
+    _registry_entry* slots[1];              // Over-allocated to hold "capacity" slots
+} _registry_table;
+
+// Per-thread record of the epoch a reader entered the registry in, 0 if it isn't reading
+typedef struct _registry_reader_tag {
+    unsigned long   epoch;
+    int             depth;                  // Nested acquires only enter the epoch once
+    int             owned;                  // Nonzero while a live thread is using this record
+    struct _registry_reader_tag* next;
+} _registry_reader;
+
+// Something that was unpublished but may still be in use by a reader
+typedef struct _registry_retired_tag    {
+    void*           data;
+    void            (*destroy)(void* data);
+    unsigned long   epoch;                  // Global epoch at the time it was retired
+    struct _registry_retired_tag* next;
+} _registry_retired;
+
+// A directory watched for changes on behalf of the registry
+typedef struct _registry_watch_tag  {
+    int             wd;
+    char*           dir;
+    struct _registry_watch_tag* next;
+} _registry_watch;
+
+struct ngt_registry_tag {
+    _registry_table*    table;              // The current lookup table
+    pthread_mutex_t     lock;               // Serializes writers.  Readers never take it
+    
+    unsigned long       epoch;              // Global reclamation epoch, starts at 1
+    _registry_reader*   readers;            // Every reader record ever created (push only)
+    pthread_key_t       reader_key;         // The calling thread's reader record
+    _registry_retired*  retired;            // Waiting to be freed, protected by the lock
+    
+    init_template_fn    init_template;      // Called on every template the registry loads
+    _include_paths*     include_paths;      // Used for templates expanded through the registry
+    
+    size_t              bytes_used;         // Memory held by all resident templates
+    size_t              memory_limit;       // Evict least recently used templates above this, 0 
+                                            //  for no limit
+    pthread_cond_t      loaded;             // Signalled whenever a load on a miss finishes
+    
+    int                 watching;           // Nonzero while the watcher thread is running
+    pthread_t           watcher;
+    int                 watch_fd;           // inotify descriptor
+    int                 wake_fd[2];         // Pipe used to stop the watcher thread
+    _registry_watch*    watches;            // Protected by the lock
+};
+
+// The files found by ngt_registry_preload_dir(), shared by its worker threads
+typedef struct _registry_preload_tag    {
+    ngt_registry*   reg;
+    char**          names;                  // Names to publish the templates under
+    char**          filenames;              // Set to 0 once the registry owns the filename
+    int             count;
+    int             capacity;
+    int             next;                   // Next file to be claimed by a worker
+    int             failures;
+} _registry_preload;
+
 /**
- * The hash function we will use for the template dictionary
+ * Helper function - destroys the value of the item, but neither its marker nor the item itself
  */
-int _dictionary_item_hash(const void* key);
+void _dictionary_item_release(_dictionary_item* d);
 
 /**
- * The function we will use to determine if two dictionary_items match
+ * The function that will be called when an ngt_dictionary must be destroyed
+ */ 
+void _dictionary_destroy(void* data);
+
+/**
+ * Helper function - returns nonzero if the dictionary is a row of more than one section, or is 
+ * held by someone else as well
  */
-int _dictionary_item_match(const void* key1, const void* key2); 
+int _dictionary_shared(ngt_dictionary* dict);
 
 /**
- * The function that will be called when a dictionary_item must be destroyed
+ * Helper function - returns a new, empty list of section rows
  */
-void _dictionary_item_destroy(void *data);
+list* _section_list_new();
 
 /**
- * The function that will be called when an ngt_dictionary must be destroyed
- */ 
-void _dictionary_destroy(void* data);
+ * Helper function - adds the dictionary to the end of the section list, which takes over one 
+ * reference to it
+ */
+void _section_list_add(list* rows, ngt_dictionary* child, int visible);
+
+/**
+ * The function that will be called when a row of a section list must be destroyed
+ */
+void _section_row_destroy(void* data);
 
 /**
  * The hash function we will use for the modifier dictionary
@@ -153,9 +567,69 @@ char* _get_template_from_file(FILE* fd);
 char* _get_template_from_filename(const char* filename);
 
 /**
- * Helper function - allocates and initializes a new _dictionary_item
+ * Frees the template string loaded by one of the ngt_load_from_*() functions, if any
+ */
+void _release_loaded_template(ngt_template* tpl);
+
+/**
+ * Maps the given template file into memory, read only.  The text is shared with the page cache
+ * (and every other process mapping the file) instead of being copied, and may be larger than 2 GB.
+ * It is zero terminated even when the file exactly fills its pages.  The file must not be 
+ * truncated or rewritten in place while the text is in use; replace it with a rename instead.  The
+ * length of the text is kept in front of it, see _template_file_length()
+ *
+ * Returns the template string, or 0 if the file could not be mapped
+ */
+char* _map_template_file(const char* filename);
+
+/**
+ * Reads the given template file into a private copy.  The copy is never touched by anything that
+ * happens to the file afterwards, so a template being expanded stays intact even if the file is
+ * rewritten in place or truncated while a live reload is on its way.  Laid out like the text of
+ * _map_template_file(), so the two are released the same way
+ *
+ * Returns the template string, or 0 if the file could not be read
+ */
+char* _read_template_file(const char* filename);
+
+/**
+ * Returns the length of a template string returned by _map_template_file() or 
+ * _read_template_file(), without looking for its end
+ */
+size_t _template_file_length(const char* template);
+
+/**
+ * Takes another reference to a template string returned by _map_template_file() or 
+ * _read_template_file()
+ *
+ * Returns the template string
+ */
+char* _template_file_ref(char* template);
+
+/**
+ * Drops a reference to a template string returned by _map_template_file() or 
+ * _read_template_file(), and releases it along with the linked copies of it once the last one is
+ * gone
+ */
+void _release_template_file(char* template);
+
+/**
+ * Loads the template string of the template from the given file, mapped or as a private copy of 
+ * its own if private_copy is nonzero
+ *
+ * Returns 0 if successful, -1 otherwise
+ */
+int _load_template_file(ngt_template* tpl, const char* filename, int private_copy);
+
+/**
+ * Helper function - loads the template text for an include exactly once and publishes it in the
+ * include params, so concurrent expansions of the same dictionary agree on a single copy.  File 
+ * includes are looked up in the given search paths (or the working directory if there are none) 
+ * and come out of their include cache
+ *
+ * Returns the template text, or 0 if the include could not be loaded
  */
-_dictionary_item* _new_dictionary_item();
+char* _load_include_template(struct _include_params_tag* params, const char* marker, _include_paths* include_paths);
 
 /**
  * Helper function for the template_set_* functions.  Does NOT make a copy of the given value
@@ -168,20 +642,293 @@ int _set_string(ngt_dictionary* dict, const char* marker, char* value);
  */
 void _cleanup_template(const char* filename, char* template);
 
+/**
+ * Callback function for cleanup of includes set with ngt_set_include_filename(), which hold a 
+ * reference to a file from the include cache
+ */
+void _cleanup_include_file(const char* filename, char* template);
+
+/**
+ * Expands the template with the given dictionary, looking up include filenames in the template's
+ * own include paths or, if it has none, the given ones
+ *
+ * Returns 0 if the template was successfully processed, -1 if there was an error
+ */
+int _expand_template(ngt_template* tpl, ngt_dictionary* dict, _include_paths* include_paths, char** result);
+
+/**
+ * Creates an empty set of include search paths
+ */
+_include_paths* _include_paths_new();
+
+/**
+ * Returns the search paths used for file includes of templates that have none.  They contain no
+ * directories, so include filenames are relative to the working directory
+ */
+_include_paths* _default_include_paths();
+
+/**
+ * Returns a copy of the given include body with the given indentation spliced in after every 
+ * newline, so it can be expanded without re-indenting each line.  The body must come from
+ * _map_template_file(); copies are kept with it and shared by every expansion
+ *
+ * Returns the linked body, or 0 if the body is too large to be worth copying
+ */
+char* _include_linked_body(const char* template, const char* indent, size_t indent_length);
+
+/**
+ * Destroys the given set of include search paths once no prefetch is using them anymore.  Include
+ * files loaded through it stay loaded for as long as a dictionary still holds them
+ */
+void _include_paths_destroy(_include_paths* paths);
+
+/**
+ * Adds a directory to the end of the search paths
+ */
+void _include_paths_add(_include_paths* paths, const char* dir);
+
+/**
+ * Limits how much include text the search paths keep cached.  Zero restores the default limit
+ */
+void _include_paths_set_limit(_include_paths* paths, size_t bytes);
+
+/**
+ * Returns how much include text the search paths keep cached, in bytes
+ */
+size_t _include_paths_bytes(_include_paths* paths);
+
+/**
+ * Returns the template text for the given include name, looking it up in the search paths the 
+ * first time the name is seen and reading it again once the file has changed.  The caller gets a
+ * reference to the text and releases it with _release_template_file().  The disk is never touched
+ * with the paths locked, so different files load in parallel
+ *
+ * Returns the template text, or 0 if no such file could be found
+ */
+char* _include_paths_load(_include_paths* paths, const char* name);
+
+/**
+ * Starts loading the includes that expanding the template with the given dictionary may need on
+ * background I/O threads.  Include filenames are looked up like _expand_template() does
+ */
+void _prefetch_includes(ngt_template* tpl, ngt_dictionary* dict, _include_paths* include_paths);
+
+/**
+ * Blocks until the given count of prefetches in flight drops to zero
+ */
+void _prefetch_wait(int* pending);
+
+/**
+ * Freezes the dictionary, and the dictionaries of its sections if recurse is nonzero
+ *
+ * Returns 0 if the operation succeeded, -1 otherwise
+ */
+int _freeze_dictionary(ngt_dictionary* dict, int recurse);
+
+/**
+ * Returns the item under the given marker in the frozen dictionary, or 0 if there is none
+ */
+_dictionary_item* _frozen_find(const _frozen_dictionary* frozen, const char* marker);
+
+/**
+ * Hashes the marker with the given seed.  Items keep the hash with seed 0
+ */
+unsigned _marker_hash(const char* marker, unsigned seed);
+
+/**
+ * Returns the item under the given marker in the dictionary's table, or 0 if there is none.  Set
+ * slots and frozen items are not in the table
+ */
+_dictionary_item* _table_find(const ngt_dictionary* dict, const char* marker);
+
+/**
+ * Like _table_find(), for a marker whose _marker_hash() with seed 0 is known already
+ */
+_dictionary_item* _table_find_hashed(const ngt_dictionary* dict, const char* marker, unsigned hash);
+
+/**
+ * Adds an empty item of the given type under the marker to the dictionary's table, which must not
+ * have one yet
+ *
+ * Returns the new item
+ */
+_dictionary_item* _table_add(ngt_dictionary* dict, const char* marker, int type);
+
+/**
+ * Like _table_add(), for a marker whose _marker_hash() with seed 0 is known already
+ */
+_dictionary_item* _table_add_hashed(ngt_dictionary* dict, const char* marker, unsigned hash, int type);
+
+/**
+ * Puts an item that lives in one of the dictionary's blocks into its index.  The index must not
+ * have an item under the same marker yet
+ */
+void _table_insert(ngt_dictionary* dict, _dictionary_item* item);
+
+/**
+ * Destroys an item that lives in one of the dictionary's blocks but is not in its index, and keeps
+ * its place for the next item added
+ */
+void _table_discard(ngt_dictionary* dict, _dictionary_item* item);
+
+/**
+ * Moves the item blocks of src to the end of dst's, items and all, and leaves src with an empty
+ * table.  None of the items are in dst's index yet, and they don't move, so pointers to them stay
+ * good.  The blocks that were src's are the last ones of dst afterwards
+ *
+ * Returns the first block that was src's, or 0 if src had none
+ */
+_item_block* _table_adopt(ngt_dictionary* dst, ngt_dictionary* src);
+
+/**
+ * Makes room in the dictionary's table for the given number of items to be added, and for
+ * strings_size bytes of their long markers and values, so adding them allocates nothing more
+ */
+void _table_reserve(ngt_dictionary* dict, unsigned count, size_t strings_size);
+
+/**
+ * Returns size bytes out of the strings of the newest item block, which live as long as the
+ * table, or 0 if the block has no room left
+ */
+char* _table_strings(ngt_dictionary* dict, size_t size);
+
+/**
+ * Destroys the item and takes it out of the dictionary's table.  Pointers to other items stay good
+ */
+void _table_remove(ngt_dictionary* dict, _dictionary_item* item);
+
+/**
+ * Destroys every item in the dictionary's table and frees the table
+ */
+void _table_clear(ngt_dictionary* dict);
+
+/**
+ * Destroys every item in the dictionary's table, but keeps the memory of the table for the items
+ * to come
+ */
+void _table_reset(ngt_dictionary* dict);
+
+/**
+ * Helper function - gives the item a copy of the first "length" characters of value, inside the
+ * item if they fit, or else in the pool if there is one
+ *
+ * Returns 0 if the operation succeeded, -1 if the copy could not be allocated
+ */
+int _item_set_string(_dictionary_item* item, const char* value, size_t length, ngt_string_pool* pool);
+
+/**
+ * Moves the value of one item to another, whose own value must have been released.  The item it
+ * came from is left without a value.  Strings kept inside the item or in an item block are copied,
+ * since the other item may not live in the same table; everything else just changes hands
+ */
+void _item_move_value(_dictionary_item* to, _dictionary_item* from);
+
+/**
+ * Makes the item of the dictionary, whatever it held before, a string value with a copy of the
+ * first "length" characters of value.  A string value with room for the new one is overwritten in
+ * place
+ *
+ * Returns 0 if the operation succeeded, -1 if the copy could not be allocated
+ */
+int _item_replace_string(ngt_dictionary* dict, _dictionary_item* item, const char* value, size_t length);
+
+/**
+ * Returns the pool's copy of the first "length" characters of value, making one the first time
+ * they are seen.  The copy is zero terminated and lives as long as the pool
+ */
+const char* _string_pool_intern(ngt_string_pool* pool, const char* value, size_t length);
+
+/**
+ * Helper function - destroys what the items of the frozen dictionary own, and the layout itself
+ */
+void _frozen_destroy(_frozen_dictionary* frozen);
+
+/**
+ * Helper function - returns the next item of the dictionary, frozen or not, or 0 when there are 
+ * no more.  Nothing may be added to the dictionary during the walk
+ */
+_dictionary_item* _next_item(ngt_dictionary* dict, _item_cursor* cursor);
+
+/**
+ * Helper function - returns the dictionary's own item under the marker, adding an empty one of the
+ * given type if there is none yet
+ */
+_dictionary_item* _get_or_add_item(ngt_dictionary* dict, const char* marker, int type);
+
+/**
+ * Helper function - returns the dictionary's own item under the marker with whatever value it had
+ * destroyed, ready to take a value of the given type.  The dictionary must be writable
+ */
+_dictionary_item* _replace_item(ngt_dictionary* dict, const char* marker, int type);
+
+/**
+ * Helper function - returns nonzero if the dictionary may be changed, and complains if it is 
+ * frozen.  Waits for the prefetches that still load includes living in the dictionary
+ */
+int _dictionary_writable(ngt_dictionary* dict);
+
+/**
+ * Returns the slot read by the marker that ends at the given position in the schema's template,
+ * or -1 if no marker of the template ends there
+ */
+int _schema_slot_at(const ngt_schema* schema, const char* position);
+
+/**
+ * Returns the slot item of the given marker in the schema-bound dictionary, set or not, or 0 if
+ * the dictionary is not bound to a schema or the marker has no slot
+ */
+_dictionary_item* _slot_item(ngt_dictionary* dict, const char* marker);
+
+/**
+ * Helper function - destroys what the slot item holds and empties it
+ */
+void _slot_item_clear(_dictionary_item* item);
+
 /** 
  * Helper Function - Queries the dictionary for the item under the given marker and returns the 
- * item if it exists
+ * item if it exists.  Overlay dictionaries fall through to their base
  * 
  * Returns a pointer to the item if it exists, zero if not
  */
 _dictionary_item* _query_item(ngt_dictionary* dict, const char* marker);
 
+/** 
+ * Helper Function - Like _query_item(), but only looks in the dictionary itself and never in its
+ * base
+ * 
+ * Returns a pointer to the item if it exists, zero if not
+ */
+_dictionary_item* _query_own_item(ngt_dictionary* dict, const char* marker);
+
 /**
  * Helper function - Gets the modifier by the given name if it exists in the
  * template modifier list
  */
 _modifier* _query_modifier(ngt_template* tpl, const char* name);
 
+/**
+ * Helper function - looks the marker up in the dictionary, then in its parent, its parent's parent
+ * and so on, and finally in the global dictionary.  If scope is given, the dictionary the item was
+ * found in is put there
+ *
+ * Returns the first item found, or 0 if there is none
+ */
+_dictionary_item* _find_item(ngt_dictionary* dict, const char* marker, ngt_dictionary** scope);
+
+/**
+ * Helper function - resolves a marker for the active dictionary of the context like _find_item(),
+ * remembering where it was found for the other dictionaries of the section instance.  occurrence
+ * is where the marker is in the template, or 0 if the lookup should not be cached
+ *
+ * Returns the item found, or 0 if there is none
+ */
+_dictionary_item* _resolve_item(_parse_context* ctx, const char* marker, const char* occurrence);
+
+/**
+ * Helper function - frees what the scope cache holds
+ */
+void _scope_cache_clear(_scope_cache* cache);
+
 /**
  * Gets the string value in the template dictionary for the given marker
  * NOTE: The string returned is managed by the dictionary.  Do NOT retain a reference to
@@ -191,6 +938,46 @@ _modifier* _query_modifier(ngt_template* tpl, const char* name);
  */
 const char* _get_string_value_ref(ngt_dictionary* dict, const char* marker);
 
+/**
+ * Gets the item holding the value for the given marker: a string, a buffer or a typed value
+ * NOTE: The item returned is managed by the dictionary.  Do NOT retain a reference to it or 
+ *       destroy it
+ *
+ * Returns the item, or 0 if not found or if the given node is not a value
+ */
+_dictionary_item* _get_value_item_ref(ngt_dictionary* dict, const char* marker);
+
+/**
+ * Helper function - returns the characters of the value item and puts their number in length.
+ * Strings and buffers are returned as they are, so a borrowed buffer may not be zero terminated.
+ * Typed values are formatted into buf, which must hold at least VALUE_BUFFER_LENGTH characters
+ */
+const char* _format_value(_dictionary_item* item, char* buf, size_t* length);
+
+/**
+ * Helper function - sets the value of the item in the dictionary under the item's marker, replacing
+ * any value the marker had.  The item is only a template filled in by the caller: its marker is
+ * copied and its value taken over, or destroyed if the dictionary can't be changed
+ *
+ * Returns 0 if the operation succeeded, -1 otherwise
+ */
+int _set_item(ngt_dictionary* dict, _dictionary_item* item);
+
+/**
+ * Helper function - formats the integer into buf without going through printf
+ *
+ * Returns the number of characters written, not counting the terminating zero
+ */
+int _format_int64(int64_t value, char* buf);
+
+/**
+ * Helper function - formats the number into buf with up to 15 significant digits and a '.' as the
+ * decimal point, whatever the locale
+ *
+ * Returns the number of characters written, not counting the terminating zero
+ */
+int _format_double(double value, char* buf);
+
 /**
  * Gets the dictionary list value in the template dictionary for the given marker
  * NOTE: The dictionary list returned is managed by the dictionary.  Do NOT retain a reference to
@@ -201,6 +988,26 @@ const char* _get_string_value_ref(ngt_dictionary* dict, const char* marker);
  */
 const list* _get_dictionary_list_ref(ngt_dictionary* dict, const char* marker);
 
+/**
+ * Gets the lazy value params struct in the template dictionary for the given marker
+ * NOTE: The params struct returned is managed by the dictionary.  Do NOT retain a reference to it
+ *       or destroy it
+ *
+ * Returns the pointer to the value of the marker, or 0 if not found or if the given node is not
+ * a LAZY value
+ */
+struct _lazy_params_tag* _get_lazy_params_ref(ngt_dictionary* dict, const char* marker);
+
+/**
+ * Gets the section iterator params struct in the template dictionary for the given marker
+ * NOTE: The params struct returned is managed by the dictionary.  Do NOT retain a reference to it
+ *       or destroy it
+ *
+ * Returns the pointer to the value of the marker, or 0 if not found or if the given node is not
+ * an ITERATOR
+ */
+struct _iterator_params_tag* _get_iterator_params_ref(ngt_dictionary* dict, const char* marker);
+
 /**
  * Gets the include params struct in the template dictionary for the given marker
  * NOTE: The include params struct returned is managed by the dictionary.  Do NOT retain a reference
@@ -241,15 +1048,23 @@ char* _extract_delimiter(const char* p, delimiter* delim);
 _parse_context* _duplicate_context(_parse_context* ctx);
 
 /**
- * Helper function - appends the marked whitespace at the current position in the output
+ * Helper function - appends the first n characters of str to the string builder in one go, and 
+ * leaves it zero terminated
  */
-void _append_line_whitespace(_parse_context* line_ctx, _parse_context* out_ctx);
+void _sb_append_n(stringbuilder* sb, const char* str, size_t n);
 
 /**
  * Helper function - Processes a set delimiter {{= =}} sequence in the template
  */
 void _process_set_delimiter(_parse_context* ctx);
 
+/**
+ * Helper function - reads through the template text without expanding anything and calls scan_fn
+ * with the name of every marker of the given kinds (a mask of MODE_MARKER_* flags) along with the
+ * delimiters in effect there.  Set Delimiter markers are followed and comments are skipped
+ */
+void _scan_markers(const char* tmpl, const delimiter* start, const delimiter* end, int kinds, _marker_scan_fn scan_fn, void* data);
+
 /*
  * Helper function - Given a marker with modifiers and the original value, parses the modifiers and 
  *                   runs them
@@ -261,6 +1076,18 @@ void _process_modifiers(const char* marker, const char* modifiers, const char* v
  */
 void _process_variable(const char* marker, const char* modifiers, _parse_context* ctx);
 
+/**
+ * Helper function - returns the table of values resolved during the expansion, creating it the
+ * first time it is needed
+ */
+ngt_dictionary* _resolved_values(_parse_context* ctx);
+
+/**
+ * Helper function - gives the bulk variables_missing callback of the template all the variables of
+ * the template that have no value in the dictionary, before the expansion starts
+ */
+void _resolve_missing_variables(_parse_context* ctx);
+
 /**
  * Helper function - Determines if the marker is a special separator section and, if so, 
  *                  processes it
@@ -286,6 +1113,25 @@ void _process_include(const char* marker, _parse_context* ctx);
  */ 
 char* _process(_parse_context *ctx);
 
+/**
+ * Registry helper - enters a read-side critical section for the calling thread.  Anything that was
+ * published when this returns stays valid until the matching _registry_exit()
+ */
+void _registry_enter(ngt_registry* reg);
+
+/**
+ * Registry helper - leaves a read-side critical section entered with _registry_enter()
+ */
+void _registry_exit(ngt_registry* reg);
+
+/**
+ * Registry helper - finds the entry registered under the given name in the current table.  Must be
+ * called inside a read-side critical section or with the registry lock held
+ *
+ * Returns the entry, or 0 if there is none
+ */
+_registry_entry* _registry_find(ngt_registry* reg, const char* name);
+
 /**
  * Sets up the ngtemplate global dictionary with standard values
  *
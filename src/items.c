@@ -0,0 +1,481 @@
+/**
+ * Item tables for the ngtemplate engine.  A dictionary keeps its items side by side in blocks, and
+ * finds them through an open-addressed index of item pointers.  Markers and string values that
+ * are short enough live inside the item itself, so a lookup usually touches the index and a
+ * single item, and setting a short value allocates nothing at all.
+ *
+ * Blocks are never moved or freed before the dictionary is cleared, so an item stays where it is
+ * for as long as it is in the dictionary, no matter how many items are added after it.  Removed
+ * items leave a marker in the index so probes keep going past them, and are reused by the next
+ * items added.  A batch of items can reserve a block of its own with room for their long markers
+ * and values as well, which then live in the block instead of being allocated one by one.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "ngtemplate.h"
+#include "internal.h"
+
+/**
+ * Stands in the index for removed items
+ */
+static _dictionary_item s_removed_item;
+
+/**
+ * Hashes the marker with the given seed.  Items keep the hash with seed 0
+ */
+unsigned _marker_hash(const char* marker, unsigned seed) {
+    unsigned h = 2166136261u ^ seed;
+    
+    while (*marker) {
+        h = (h ^ (unsigned char)*marker++) * 16777619u;
+    }
+    
+    // FNV-1a alone mixes its last characters poorly, and markers often differ only there
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    
+    return h;
+}
+
+/**
+ * Returns the item under the given marker in the dictionary's table, or 0 if there is none.  Set
+ * slots and frozen items are not in the table
+ */
+_dictionary_item* _table_find(const ngt_dictionary* dict, const char* marker)  {
+    return dict->index_capacity ? _table_find_hashed(dict, marker, _marker_hash(marker, 0)) : 0;
+}
+
+/**
+ * Like _table_find(), for a marker whose _marker_hash() with seed 0 is known already
+ */
+_dictionary_item* _table_find_hashed(const ngt_dictionary* dict, const char* marker, unsigned hash)    {
+    _dictionary_item* item;
+    unsigned mask, i;
+    
+    if (!dict->index_capacity)  {
+        return 0;
+    }
+    
+    mask = dict->index_capacity - 1;
+    for (i = hash & mask; (item = dict->index[i]) != 0; i = (i + 1) & mask) {
+        if (item != &s_removed_item && item->hash == hash && !strcmp(item->marker, marker)) {
+            return item;
+        }
+    }
+    
+    return 0;
+}
+
+/**
+ * Helper function - builds a new index with room for at least "extra" more items.  Removed items
+ * are left out, so the index only has to grow if most of it holds live items
+ */
+static void _table_rehash(ngt_dictionary* dict, unsigned extra) {
+    _dictionary_item** index;
+    unsigned i, j, live, capacity;
+    
+    live = 0;
+    for (i = 0; i < dict->index_capacity; i++) {
+        if (dict->index[i] && dict->index[i] != &s_removed_item) {
+            live++;
+        }
+    }
+    
+    capacity = dict->index_capacity ? dict->index_capacity : ITEM_INDEX_INITIAL_CAPACITY;
+    while ((live + extra) * 2 > capacity)   {
+        capacity *= 2;
+    }
+    
+    index = (_dictionary_item**)malloc(capacity * sizeof(_dictionary_item*));
+    memset(index, 0, capacity * sizeof(_dictionary_item*));
+    
+    for (i = 0; i < dict->index_capacity; i++) {
+        if (!dict->index[i] || dict->index[i] == &s_removed_item)   {
+            continue;
+        }
+        
+        for (j = dict->index[i]->hash & (capacity - 1); index[j]; j = (j + 1) & (capacity - 1))   {
+        }
+        index[j] = dict->index[i];
+    }
+    
+    if (dict->index)    {
+        free(dict->index);
+    }
+    
+    dict->index = index;
+    dict->index_capacity = capacity;
+    dict->index_used = live;
+}
+
+/**
+ * Helper function - allocates a block for the given number of items and bytes of strings, and
+ * makes it the newest block of the dictionary
+ */
+static _item_block* _table_new_block(ngt_dictionary* dict, unsigned capacity, size_t strings_capacity)   {
+    _item_block* block;
+    
+    block = (_item_block*)malloc(sizeof(_item_block) + capacity * sizeof(_dictionary_item) + strings_capacity);
+    block->next = dict->blocks;
+    block->count = 0;
+    block->capacity = capacity;
+    block->items = (_dictionary_item*)(block + 1);
+    block->strings = (char*)(block->items + capacity);
+    block->strings_used = 0;
+    block->strings_capacity = strings_capacity;
+    dict->blocks = block;
+    
+    return block;
+}
+
+/**
+ * Helper function - returns a place for a new item, reusing a removed one if there is any
+ */
+static _dictionary_item* _table_new_item(ngt_dictionary* dict)  {
+    _dictionary_item* item;
+    _item_block* block;
+    unsigned capacity;
+    
+    if (dict->removed)  {
+        // Removed items are chained through their value
+        item = dict->removed;
+        dict->removed = (_dictionary_item*)item->val.string_value;
+        return item;
+    }
+    
+    block = dict->blocks;
+    if (!block || block->count == block->capacity)  {
+        capacity = block ? block->capacity * 2 : ITEM_BLOCK_INITIAL;
+        if (capacity > ITEM_BLOCK_MAX)  {
+            capacity = ITEM_BLOCK_MAX;
+        }
+        
+        block = _table_new_block(dict, capacity, 0);
+    }
+    
+    return &block->items[block->count++];
+}
+
+/**
+ * Adds an empty item of the given type under the marker to the dictionary's table, which must not
+ * have one yet
+ *
+ * Returns the new item
+ */
+_dictionary_item* _table_add(ngt_dictionary* dict, const char* marker, int type)   {
+    return _table_add_hashed(dict, marker, _marker_hash(marker, 0), type);
+}
+
+/**
+ * Like _table_add(), for a marker whose _marker_hash() with seed 0 is known already
+ */
+_dictionary_item* _table_add_hashed(ngt_dictionary* dict, const char* marker, unsigned hash, int type)    {
+    _dictionary_item* item;
+    size_t length;
+    
+    item = _table_new_item(dict);
+    memset(item, 0, sizeof(_dictionary_item));
+    item->type = type;
+    item->hash = hash;
+    
+    length = strlen(marker);
+    if (length <= ITEM_INLINE_LENGTH)   {
+        item->marker = item->inline_marker;
+        item->flags = ITEM_INLINE_MARKER;
+    } else if ((item->marker = _table_strings(dict, length + 1)) != 0)  {
+        item->flags = ITEM_BLOCK_MARKER;
+    } else {
+        item->marker = (char*)malloc(length + 1);
+    }
+    memcpy(item->marker, marker, length + 1);
+    
+    _table_insert(dict, item);
+    return item;
+}
+
+/**
+ * Puts an item that lives in one of the dictionary's blocks into its index.  The index must not
+ * have an item under the same marker yet
+ */
+void _table_insert(ngt_dictionary* dict, _dictionary_item* item)   {
+    unsigned mask, i;
+    
+    // Keep at least a quarter of the index free, so probes stay short
+    if ((dict->index_used + 1) * 4 > dict->index_capacity * 3)  {
+        _table_rehash(dict, 1);
+    }
+    
+    // The first place that is free or was left by a removed item is ours
+    mask = dict->index_capacity - 1;
+    for (i = item->hash & mask; dict->index[i] && dict->index[i] != &s_removed_item; i = (i + 1) & mask)   {
+    }
+    
+    if (!dict->index[i])    {
+        dict->index_used++;
+    }
+    dict->index[i] = item;
+}
+
+/**
+ * Helper function - destroys the value and the marker of the item
+ */
+static void _table_release_item(_dictionary_item* item)    {
+    _dictionary_item_release(item);
+    
+    if (!(item->flags & (ITEM_INLINE_MARKER | ITEM_BLOCK_MARKER)))    {
+        free(item->marker);
+    }
+    
+    item->marker = 0;
+    item->flags = 0;
+}
+
+/**
+ * Destroys the item and takes it out of the dictionary's table.  Pointers to other items stay good
+ */
+void _table_remove(ngt_dictionary* dict, _dictionary_item* item)   {
+    unsigned mask, i;
+    
+    mask = dict->index_capacity - 1;
+    for (i = item->hash & mask; dict->index[i] != item; i = (i + 1) & mask)   {
+    }
+    dict->index[i] = &s_removed_item;
+    
+    _table_release_item(item);
+    item->val.string_value = (char*)dict->removed;
+    dict->removed = item;
+}
+
+/**
+ * Destroys an item that lives in one of the dictionary's blocks but is not in its index, and keeps
+ * its place for the next item added
+ */
+void _table_discard(ngt_dictionary* dict, _dictionary_item* item)  {
+    _table_release_item(item);
+    item->val.string_value = (char*)dict->removed;
+    dict->removed = item;
+}
+
+/**
+ * Moves the item blocks of src to the end of dst's, items and all, and leaves src with an empty
+ * table.  None of the items are in dst's index yet, and they don't move, so pointers to them stay
+ * good.  The blocks that were src's are the last ones of dst afterwards
+ *
+ * Returns the first block that was src's, or 0 if src had none
+ */
+_item_block* _table_adopt(ngt_dictionary* dst, ngt_dictionary* src)   {
+    _item_block* adopted = src->blocks, **tail;
+    _dictionary_item** removed;
+    
+    // dst's newest block stays the first one, so its strings are still the ones handed out
+    for (tail = &dst->blocks; *tail; tail = &(*tail)->next)  {
+    }
+    *tail = adopted;
+    
+    for (removed = &dst->removed; *removed; removed = (_dictionary_item**)&(*removed)->val.string_value)   {
+    }
+    *removed = src->removed;
+    
+    if (src->index)    {
+        memset(src->index, 0, src->index_capacity * sizeof(_dictionary_item*));
+    }
+    
+    src->index_used = 0;
+    src->blocks = 0;
+    src->removed = 0;
+    
+    return adopted;
+}
+
+/**
+ * Makes room in the dictionary's table for the given number of items to be added, and for
+ * strings_size bytes of their long markers and values, so adding them allocates nothing more
+ */
+void _table_reserve(ngt_dictionary* dict, unsigned count, size_t strings_size)  {
+    _item_block* block = dict->blocks;
+    
+    if (!count) {
+        return;
+    }
+    
+    if ((dict->index_used + count) * 4 > dict->index_capacity * 3)  {
+        _table_rehash(dict, count);
+    }
+    
+    if (!block || block->capacity - block->count < count || block->strings_capacity - block->strings_used < strings_size)  {
+        _table_new_block(dict, count > ITEM_BLOCK_INITIAL ? count : ITEM_BLOCK_INITIAL, strings_size);
+    }
+}
+
+/**
+ * Returns size bytes out of the strings of the newest item block, which live as long as the
+ * table, or 0 if the block has no room left
+ */
+char* _table_strings(ngt_dictionary* dict, size_t size) {
+    _item_block* block = dict->blocks;
+    
+    if (!block || block->strings_capacity - block->strings_used < size)  {
+        return 0;
+    }
+    
+    block->strings_used += size;
+    return block->strings + block->strings_used - size;
+}
+
+/**
+ * Destroys every item in the dictionary's table and frees the table
+ */
+void _table_clear(ngt_dictionary* dict) {
+    _item_block* block, *next;
+    unsigned i;
+    
+    for (block = dict->blocks; block; block = next)  {
+        next = block->next;
+        
+        for (i = 0; i < block->count; i++)  {
+            if (block->items[i].marker) {
+                _table_release_item(&block->items[i]);
+            }
+        }
+        
+        free(block);
+    }
+    
+    if (dict->index)    {
+        free(dict->index);
+    }
+    
+    dict->index = 0;
+    dict->index_capacity = 0;
+    dict->index_used = 0;
+    dict->blocks = 0;
+    dict->removed = 0;
+}
+
+/**
+ * Destroys every item in the dictionary's table, but keeps the memory of the table for the items
+ * to come
+ */
+void _table_reset(ngt_dictionary* dict) {
+    _item_block* block, *next;
+    size_t strings_capacity;
+    unsigned i, capacity;
+    
+    capacity = 0;
+    strings_capacity = 0;
+    for (block = dict->blocks; block; block = block->next)  {
+        for (i = 0; i < block->count; i++)  {
+            if (block->items[i].marker) {
+                _table_release_item(&block->items[i]);
+            }
+        }
+        
+        block->count = 0;
+        block->strings_used = 0;
+        capacity += block->capacity;
+        strings_capacity += block->strings_capacity;
+    }
+    
+    if (dict->blocks && dict->blocks->next) {
+        // One block as big as all of them together, so the next time around the items fit in a
+        // single block from the start
+        for (block = dict->blocks; block; block = next)  {
+            next = block->next;
+            free(block);
+        }
+        
+        dict->blocks = 0;
+        _table_new_block(dict, capacity, strings_capacity);
+    }
+    
+    if (dict->index)    {
+        memset(dict->index, 0, dict->index_capacity * sizeof(_dictionary_item*));
+    }
+    
+    dict->index_used = 0;
+    dict->removed = 0;
+}
+
+/**
+ * Helper function - gives the item a copy of the first "length" characters of value, inside the
+ * item if they fit, or else in the pool if there is one
+ *
+ * Returns 0 if the operation succeeded, -1 if the copy could not be allocated
+ */
+int _item_set_string(_dictionary_item* item, const char* value, size_t length, ngt_string_pool* pool)    {
+    if (length <= ITEM_INLINE_LENGTH)   {
+        item->val.string_value = item->val.inline_value.chars;
+        item->flags |= ITEM_INLINE_VALUE;
+    } else if (pool)    {
+        // Already zero terminated
+        item->val.string_value = (char*)_string_pool_intern(pool, value, length);
+        item->flags |= ITEM_POOLED_VALUE;
+        return 0;
+    } else {
+        item->val.string_value = (char*)malloc(length + 1);
+        if (!item->val.string_value)    {
+            // Could not allocate enough memory for the string, so it stays empty
+            item->val.string_value = item->val.inline_value.chars;
+            item->val.string_value[0] = '\0';
+            item->flags |= ITEM_INLINE_VALUE;
+            return -1;
+        }
+    }
+    
+    memcpy(item->val.string_value, value, length);
+    item->val.string_value[length] = '\0';
+    
+    return 0;
+}
+
+/**
+ * Moves the value of one item to another, whose own value must have been released.  The item it
+ * came from is left without a value.  Strings kept inside the item or in an item block are copied,
+ * since the other item may not live in the same table; everything else just changes hands
+ */
+void _item_move_value(_dictionary_item* to, _dictionary_item* from)   {
+    to->type = from->type;
+    to->val = from->val;
+    to->flags = (to->flags & ~ITEM_VALUE_FLAGS) | (from->flags & ITEM_VALUE_FLAGS);
+    
+    if (from->type == ITEM_STRING && from->flags & (ITEM_INLINE_VALUE | ITEM_BLOCK_VALUE))  {
+        to->flags &= ~ITEM_VALUE_FLAGS;
+        _item_set_string(to, from->val.string_value, strlen(from->val.string_value), 0);
+    }
+    
+    memset(&from->val, 0, sizeof(from->val));
+    from->flags &= ~ITEM_VALUE_FLAGS;
+}
+
+/**
+ * Makes the item of the dictionary, whatever it held before, a string value with a copy of the
+ * first "length" characters of value.  A string value with room for the new one is overwritten in
+ * place
+ *
+ * Returns 0 if the operation succeeded, -1 if the copy could not be allocated
+ */
+int _item_replace_string(ngt_dictionary* dict, _dictionary_item* item, const char* value, size_t length)  {
+    size_t room;
+    
+    if (item->type == ITEM_STRING && item->val.string_value && !(item->flags & ITEM_POOLED_VALUE)) {
+        // Whatever holds the value now has room for at least as many characters as it holds
+        room = item->flags & ITEM_INLINE_VALUE ? ITEM_INLINE_LENGTH : strlen(item->val.string_value);
+        if (length <= room && (length <= ITEM_INLINE_LENGTH || !dict->pool))  {
+            memmove(item->val.string_value, value, length);
+            item->val.string_value[length] = '\0';
+            return 0;
+        }
+    }
+    
+    _dictionary_item_release(item);
+    
+    memset(&item->val, 0, sizeof(item->val));
+    item->flags &= ~ITEM_VALUE_FLAGS;
+    item->type = ITEM_STRING;
+    
+    return _item_set_string(item, value, length, dict->pool);
+}
@@ -0,0 +1,178 @@
+/**
+ * Dictionary merging for the ngtemplate engine.  A dictionary must not be changed from more than
+ * one thread at a time, but separate dictionaries can be built on separate threads and merged
+ * into one once they are done.  ngt_dictionary_merge() moves what it merges instead of copying it:
+ * the item blocks of the merged dictionary become the target's, so the items, their strings and
+ * their sections stay exactly where they are and only get added to the target's index.
+ *
+ * When both dictionaries have the same marker, sections are joined, with the rows of the merged
+ * dictionary after the target's own.  Everything else is replaced by the merged value, just like
+ * setting the value again.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "ngtemplate.h"
+#include "internal.h"
+
+/**
+ * Helper function - makes dst the dictionary the rows of the section item were added to
+ */
+static void _merge_adopt_rows(ngt_dictionary* dst, ngt_dictionary* src, _dictionary_item* item)   {
+    list_element* row;
+    ngt_dictionary* child;
+    
+    if (!(item->type & ITEM_D_LIST) || !item->val.d_list_value)  {
+        return;
+    }
+    
+    for (row = list_head(item->val.d_list_value); row; row = list_next(row))  {
+        child = ROW_DICTIONARY(row);
+        if (!child->parent || child->parent == src) {
+            child->parent = dst;
+        }
+        
+        if (dst->pool && child->pool != dst->pool && !_dictionary_shared(child))    {
+            ngt_dictionary_set_pool(child, dst->pool);
+        }
+    }
+}
+
+/**
+ * Helper function - moves the rows of the section item from to the end of the section item to
+ *
+ * Returns nonzero if both items are sections and the rows were moved, 0 if the items don't merge
+ */
+static int _merge_sections(_dictionary_item* to, _dictionary_item* from)  {
+    void* data;
+    
+    // Includes are sections too, but there can only be one template for a marker
+    if (to->type != ITEM_D_LIST || from->type != ITEM_D_LIST)   {
+        return 0;
+    }
+    
+    if (!from->val.d_list_value)    {
+        return 1;
+    }
+    
+    if (!to->val.d_list_value)  {
+        to->val.d_list_value = from->val.d_list_value;
+        from->val.d_list_value = 0;
+        return 1;
+    }
+    
+    while (list_remove_next(from->val.d_list_value, 0, &data) == 0)   {
+        list_insert_next(to->val.d_list_value, list_tail(to->val.d_list_value), data);
+    }
+    
+    return 1;
+}
+
+/**
+ * Helper function - merges a slot item of src, which stays where it is, into dst
+ */
+static void _merge_slot(ngt_dictionary* dst, ngt_dictionary* src, _dictionary_item* item)  {
+    _dictionary_item* target;
+    
+    target = _get_or_add_item(dst, item->marker, item->type);
+    if (!_merge_sections(target, item)) {
+        _dictionary_item_release(target);
+        _item_move_value(target, item);
+    }
+    
+    _merge_adopt_rows(dst, src, target);
+    _slot_item_clear(item);
+}
+
+/**
+ * Helper function - merges an item that src's blocks, now dst's, hold into dst's index
+ */
+static void _merge_item(ngt_dictionary* dst, ngt_dictionary* src, _dictionary_item* item)  {
+    _dictionary_item* target;
+    int slot;
+    
+    target = _slot_item(dst, item->marker);
+    slot = target != 0;
+    if (slot && !target->marker)    {
+        target->type = item->type;
+        target->marker = dst->schema->markers[target - dst->slots];
+    } else if (!slot)   {
+        target = _table_find_hashed(dst, item->marker, item->hash);
+    }
+    
+    if (!target)    {
+        // The common case, which moves nothing at all
+        _table_insert(dst, item);
+        _merge_adopt_rows(dst, src, item);
+        return;
+    }
+    
+    if (!_merge_sections(target, item)) {
+        if (slot)   {
+            // A slot keeps its place and takes the value
+            _dictionary_item_release(target);
+            _item_move_value(target, item);
+        } else {
+            // The merged item takes the place of the old one in the index
+            _table_remove(dst, target);
+            _table_insert(dst, item);
+            _merge_adopt_rows(dst, src, item);
+            return;
+        }
+    }
+    
+    _merge_adopt_rows(dst, src, target);
+    _table_discard(dst, item);
+}
+
+/**
+ * Moves every value and section of src into dst, and leaves src empty.  Strings and section rows
+ * are not copied but change hands, so merging is cheap however much src holds.  When both have a
+ * value for the same marker, the rows of a section in src are added after the rows dst has, and
+ * any other value of src replaces the one in dst.  src still has to be destroyed afterwards, and
+ * if it has a string pool, that pool must outlive dst.  Neither dictionary may be used by another
+ * thread while they are merged
+ *
+ * Returns 0 if the operation succeeded, -1 otherwise
+ */
+int ngt_dictionary_merge(ngt_dictionary* dst, ngt_dictionary* src)    {
+    _item_block* block;
+    unsigned i;
+    int slot;
+    
+    if (dst == src) {
+        fprintf(stderr, "Cannot merge a dictionary into itself\n");
+        return -1;
+    }
+    
+    if (src->frozen)    {
+        // The values of a frozen dictionary are packed together and can't be handed out one by one
+        fprintf(stderr, "Cannot merge a frozen dictionary\n");
+        return -1;
+    }
+    
+    if (!_dictionary_writable(dst)) {
+        return -1;
+    }
+    
+    // The I/O threads may still be loading includes that live in src
+    _prefetch_wait(&src->prefetching);
+    
+    if (src->slots) {
+        for (slot = 0; slot < src->schema->count; slot++)   {
+            if (src->slots[slot].marker)    {
+                _merge_slot(dst, src, &src->slots[slot]);
+            }
+        }
+    }
+    
+    for (block = _table_adopt(dst, src); block; block = block->next)    {
+        for (i = 0; i < block->count; i++)  {
+            if (block->items[i].marker) {
+                _merge_item(dst, src, &block->items[i]);
+            }
+        }
+    }
+    
+    return 0;
+}
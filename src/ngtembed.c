@@ -118,4 +118,6 @@ int ngt_embed(const char* code_template, FILE* out, int argc, char** argv)  {
     ngt_destroy(tpl);
     ngt_dictionary_destroy(dict);
     free(output);
+    
+    return 0;
 }
\ No newline at end of file
@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <pthread.h>
 #include "platform.h"
 #include "list.h"
 #include "stringbuilder.h"
@@ -17,22 +18,24 @@
  */
 static ngt_dictionary* s_global_dictionary = 0;
 
-static int s_initialized = 0;
+static pthread_once_t s_init_once = PTHREAD_ONCE_INIT;
 
 /**
- * Initializes the ngtemplate library.  This must be called before dictionaries
- * can be created or templates processed
+ * Sets up the library-wide state.  Run exactly once by ngt_init()
  */
-void ngt_init() {
-    if (s_initialized)  {
-        return;
-    }
-    
-    s_initialized = 1;
+static void _init_once()    {
     s_global_dictionary = ngt_dictionary_new();
     _init_global_dictionary(s_global_dictionary);
 }
 
+/**
+ * Initializes the ngtemplate library.  This must be called before dictionaries
+ * can be created or templates processed.  It is safe to call this from several threads at once
+ */
+void ngt_init() {
+    pthread_once(&s_init_once, _init_once);
+}
+
 /**
  * Creates a new ngt_template, ready to be filled with values and sections
  *
@@ -42,9 +45,7 @@ void ngt_init() {
 ngt_template* ngt_new() {
     ngt_template* tpl;
     
-    if (!s_initialized) {
-        ngt_init();
-    }
+    ngt_init();
     
     tpl = (ngt_template*)malloc(sizeof(ngt_template));
     memset(tpl, 0, sizeof(ngt_template));
@@ -63,15 +64,44 @@ ngt_dictionary* ngt_dictionary_new()    {
     ngt_dictionary* d = (ngt_dictionary*)malloc(sizeof(ngt_dictionary));
     memset(d, 0, sizeof(ngt_dictionary));
     
-    d->should_expand = NGT_SECTION_VISIBLE;
-    
-    // NOTE: Adjust the buckets parameter depending on how many markers are likely to be in a template
-    //      file (then adjust upward to the next prime number
-    ht_init((hashtable*)d, 197, _dictionary_item_hash, _dictionary_item_match, _dictionary_item_destroy);
+    // The item table is allocated with the first item, and grows with the dictionary
+    d->references = 1;
     
     return d;   
 }
 
+/**
+ * Creates a new, empty dictionary layered over "base".  The base is never modified through the
+ * overlay, and must outlive it
+ */
+ngt_dictionary* ngt_dictionary_overlay(ngt_dictionary* base)    {
+    ngt_dictionary* d = (ngt_dictionary*)malloc(sizeof(ngt_dictionary));
+    memset(d, 0, sizeof(ngt_dictionary));
+    
+    d->references = 1;
+    d->parent = base->parent;
+    d->base = base;
+    
+    if (base->slots)    {
+        // Bound to the same schema, so the expander can read both by slot
+        d->schema = base->schema;
+        d->slots = (_dictionary_item*)malloc((d->schema->count ? d->schema->count : 1) * sizeof(_dictionary_item));
+        memset(d->slots, 0, (d->schema->count ? d->schema->count : 1) * sizeof(_dictionary_item));
+    }
+    
+    return d;
+}
+
+/**
+ * Freezes a dictionary that is done being built, and the dictionaries of its sections as well if
+ * recurse is nonzero.  A frozen dictionary can't be changed anymore
+ *
+ * Returns 0 if the operation succeeded, -1 otherwise
+ */
+int ngt_dictionary_freeze(ngt_dictionary* dict, int recurse)    {
+    return _freeze_dictionary(dict, recurse);
+}
+
 /** 
  * Destroys the given template
  */
@@ -80,7 +110,18 @@ void ngt_destroy(ngt_template* tpl) {
 }
 
 /**
- * Destroys the given template dictionary and any sub-dictionaries
+ * Takes another reference to the dictionary, so it can be added under one more section
+ *
+ * Returns the dictionary
+ */
+ngt_dictionary* ngt_dictionary_ref(ngt_dictionary* dict)    {
+    NGT_ATOMIC_FETCH_ADD(&dict->references, 1);
+    return dict;
+}
+
+/**
+ * Drops a reference to the given template dictionary, and destroys it and its sub-dictionaries
+ * once that was the last one
  */
 void ngt_dictionary_destroy(ngt_dictionary* dict)   {
     _dictionary_destroy((void*)dict);
@@ -106,33 +147,39 @@ int ngt_load_from_file(ngt_template* tpl, FILE* fp) {
         return -1;
     }
     
-    if (tpl->tmpl)  {
-        free(tpl->tmpl);
-    }
+    _release_loaded_template(tpl);
     
-    tpl->tmpl = template;
+    tpl->tmpl = tpl->loaded_tmpl = template;
     return 0;
 }
 
 /**
- * Loads the template string from the given file name
+ * Loads the template string from the given file name.  The file is mapped into memory rather than
+ * copied, so its pages are shared with every other process using it, and it may be larger than 
+ * 2 GB.  The file may be replaced (renamed over) while the template is in use, but must not be 
+ * truncated or rewritten in place
  *
  * Returns 0 if successful, -1 otherwise
  */
 int ngt_load_from_filename(ngt_template* tpl, const char* filename) {
-    char* template;
-    
-    template = _get_template_from_filename(filename);
-    if (!template)  {
-        return -1;
-    }
-    
-    if (tpl->tmpl)  {
-        free(tpl->tmpl);
+    return _load_template_file(tpl, filename, 0);
+}
+
+/**
+ * Adds a directory to search for include files in.  Filenames set with ngt_set_include_filename()
+ * are looked up in every directory in the order they were added, then relative to the working 
+ * directory.  Include files are cached with the search paths, so they are only read again when
+ * they change, no matter how many dictionaries include them
+ *
+ * NOTE: Add the search paths before expanding the template.  Dictionaries remember the include 
+ *       templates they were expanded with
+ */
+void ngt_add_include_path(ngt_template* tpl, const char* dir)   {
+    if (!tpl->include_paths)    {
+        tpl->include_paths = _include_paths_new();
     }
     
-    tpl->tmpl = template;
-    return 0;
+    _include_paths_add(tpl->include_paths, dir);
 }
 
 /**
@@ -184,16 +231,30 @@ void ngt_set_variable_missing_cb(ngt_template* tpl, get_variable_fn get_fn) {
     tpl->variable_missing = get_fn;
 }
 
+/**
+ * Sets a callback function that will be called once before every expansion with all the variable
+ * markers of the template that have no value in the dictionary
+ */
+void ngt_set_variables_missing_cb(ngt_template* tpl, get_variables_fn get_fn)   {
+    tpl->variables_missing = get_fn;
+}
+
 /**
  * Returns nonzero if the variable with the given marker name equals str, zero otherwise
  */
 int ngt_variable_equals(ngt_dictionary* dict, const char* marker, const char* str)  {
-    const char* value = _get_string_value_ref(dict, marker);
-    if (!value) {
+    _dictionary_item* item;
+    char buf[VALUE_BUFFER_LENGTH];
+    const char* value;
+    size_t length;
+    
+    item = _get_value_item_ref(dict, marker);
+    if (!item)  {
         return 0;
     }
     
-    return !strcmp(value, str);
+    value = _format_value(item, buf, &length);
+    return length == strlen(str) && !memcmp(value, str, length);
 }
 
 /**
@@ -216,7 +277,7 @@ int ngt_add_modifier(ngt_template* tpl, const char* name, modifier_fn mod_fn)
         // Already in the table, replace
         prev_mod = mod;
         ht_remove(&tpl->modifiers, (void *)&prev_mod);
-        _dictionary_destroy((void*)prev_mod);
+        _modifier_destroy((void*)prev_mod);
         
         ht_insert(&tpl->modifiers, mod);
     }
@@ -232,15 +293,134 @@ int ngt_add_modifier(ngt_template* tpl, const char* name, modifier_fn mod_fn)
  * Returns 0 if the operation succeeded, -1 otherwise
  */
 int ngt_set_string(ngt_dictionary* dict, const char* marker, const char* value) {
+    if (!_dictionary_writable(dict))    {
+        return -1;
+    }
+    
+    // Short values are copied into the item itself, long ones into the pool if there is one.  A
+    // value that fits where the old one is kept overwrites it in place
+    return _item_replace_string(dict, _get_or_add_item(dict, marker, ITEM_STRING), value, strlen(value));
+}
+
+/**
+ * Sets a batch of string values in the template dictionary at once, values[i] under markers[i].
+ * The table gets room for the whole batch up front and the long markers and values are copied
+ * into one block, so a big dictionary is filled with a couple of allocations.  Values replacing
+ * ones that have room for them are overwritten in place
+ *
+ * Returns 0 if the operation succeeded, -1 otherwise
+ */
+int ngt_set_strings(ngt_dictionary* dict, const char** markers, const char** values, int count) {
+    _dictionary_item* item;
+    size_t strings_size, length;
+    unsigned hash;
+    char* copy;
+    int i, res = 0;
+    
+    if (!_dictionary_writable(dict))    {
+        return -1;
+    }
+    
+    // Room for every long marker and value, as if they were all new
+    strings_size = 0;
+    for (i = 0; i < count; i++) {
+        length = strlen(markers[i]);
+        if (length > ITEM_INLINE_LENGTH)    {
+            strings_size += length + 1;
+        }
+        
+        length = strlen(values[i]);
+        if (length > ITEM_INLINE_LENGTH && !dict->pool) {
+            strings_size += length + 1;
+        }
+    }
+    
+    _table_reserve(dict, count, strings_size);
+    
+    for (i = 0; i < count; i++) {
+        if (_slot_item(dict, markers[i]))   {
+            // Slots are not in the table, and don't keep values in its blocks
+            res |= ngt_set_string(dict, markers[i], values[i]);
+            continue;
+        }
+        
+        length = strlen(values[i]);
+        hash = _marker_hash(markers[i], 0);
+        item = _table_find_hashed(dict, markers[i], hash);
+        if (item)   {
+            res |= _item_replace_string(dict, item, values[i], length);
+            continue;
+        }
+        
+        item = _table_add_hashed(dict, markers[i], hash, ITEM_STRING);
+        copy = length > ITEM_INLINE_LENGTH && !dict->pool ? _table_strings(dict, length + 1) : 0;
+        if (copy)   {
+            memcpy(copy, values[i], length + 1);
+            item->val.string_value = copy;
+            item->flags |= ITEM_BLOCK_VALUE;
+        } else {
+            res |= _item_set_string(item, values[i], length, dict->pool);
+        }
+    }
+    
+    return res;
+}
+
+/**
+ * Helper function - sets a buffer value in the template dictionary
+ *
+ * Returns 0 if the operation succeeded, -1 otherwise
+ */
+static int _set_buffer(ngt_dictionary* dict, const char* marker, const char* data, size_t length, int owned)  {
+    _dictionary_item item;
+    
+    memset(&item, 0, sizeof(_dictionary_item));
+    item.type = ITEM_BUFFER;
+    item.marker = (char*)marker;
+    item.val.buffer_value.data = data;
+    item.val.buffer_value.length = length;
+    item.val.buffer_value.owned = owned;
+    
+    return _set_item(dict, &item);
+}
+
+/**
+ * Sets a string value in the template dictionary from the first "length" characters of "value"
+ *
+ * Returns 0 if the operation succeeded, -1 otherwise
+ */
+int ngt_set_string_n(ngt_dictionary* dict, const char* marker, const char* value, size_t length)  {
     char* str;
-    str = (char*)malloc(strlen(value) + 1);
+    
+    if ((length <= ITEM_INLINE_LENGTH || dict->pool) && !memchr(value, '\0', length))  {
+        // Kept in the item or in the pool as a plain string
+        if (!_dictionary_writable(dict))    {
+            return -1;
+        }
+        
+        return _item_replace_string(dict, _get_or_add_item(dict, marker, ITEM_STRING), value, length);
+    }
+    
+    str = (char*)malloc(length + 1);
     if (!str)   {
         // Could not allocate enough memory for the string
         return -1;
     }
     
-    strcpy(str, value);
-    return _set_string(dict, marker, str);
+    // Zero terminated as well, so modifiers can use it as it is
+    memcpy(str, value, length);
+    str[length] = '\0';
+    
+    return _set_buffer(dict, marker, str, length, 1);
+}
+
+/**
+ * Sets a string value in the template dictionary that borrows the "length" characters at "value"
+ *
+ * Returns 0 if the operation succeeded, -1 otherwise
+ */
+int ngt_set_string_ref(ngt_dictionary* dict, const char* marker, const char* value, size_t length)    {
+    return _set_buffer(dict, marker, value, length, 0);
 }
 
 /**
@@ -252,6 +432,7 @@ int ngt_set_string(ngt_dictionary* dict, const char* marker, const char* value)
 int ngt_set_stringf(ngt_dictionary* dict, const char* marker, const char* fmt, ...) {
     char *str;
     va_list arglist;
+    int res;
 
     va_start(arglist, fmt);
     xp_vasprintf(&str, fmt, arglist);
@@ -261,6 +442,13 @@ int ngt_set_stringf(ngt_dictionary* dict, const char* marker, const char* fmt, .
         return -1;
     }
     
+    if (dict->pool) {
+        // The pool keeps its own copy
+        res = ngt_set_string(dict, marker, str);
+        free(str);
+        return res;
+    }
+    
     return _set_string(dict, marker, str);
 }
 
@@ -271,7 +459,71 @@ int ngt_set_stringf(ngt_dictionary* dict, const char* marker, const char* fmt, .
  * Returns 0 if the operations succeeded, -1 otherwise
  */
 int ngt_set_int(ngt_dictionary* dict, const char* marker, int value)    {
-    return ngt_set_stringf(dict, marker, "%d", value);
+    return ngt_set_int64(dict, marker, value);
+}
+
+/**
+ * Helper function - fills in an item of the given type for the marker
+ */
+static void _init_item(_dictionary_item* item, const char* marker, int type)  {
+    memset(item, 0, sizeof(_dictionary_item));
+    item->type = type;
+    item->marker = (char*)marker;
+}
+
+/**
+ * Sets a 64-bit integer value in the template dictionary, formatted only when it is expanded
+ *
+ * Returns 0 if the operations succeeded, -1 otherwise
+ */
+int ngt_set_int64(ngt_dictionary* dict, const char* marker, int64_t value)  {
+    _dictionary_item item;
+    
+    _init_item(&item, marker, ITEM_INT);
+    item.val.int_value = value;
+    return _set_item(dict, &item);
+}
+
+/**
+ * Sets a floating point value in the template dictionary, formatted only when it is expanded
+ *
+ * Returns 0 if the operations succeeded, -1 otherwise
+ */
+int ngt_set_double(ngt_dictionary* dict, const char* marker, double value)  {
+    _dictionary_item item;
+    
+    _init_item(&item, marker, ITEM_DOUBLE);
+    item.val.double_value = value;
+    return _set_item(dict, &item);
+}
+
+/**
+ * Sets a boolean value in the template dictionary
+ *
+ * Returns 0 if the operations succeeded, -1 otherwise
+ */
+int ngt_set_bool(ngt_dictionary* dict, const char* marker, int value)   {
+    _dictionary_item item;
+    
+    _init_item(&item, marker, ITEM_BOOL);
+    item.val.bool_value = value != 0;
+    return _set_item(dict, &item);
+}
+
+/**
+ * Sets a value in the template dictionary that is computed by fn the first time an expansion
+ * reaches "marker"
+ *
+ * Returns 0 if the operations succeeded, -1 otherwise
+ */
+int ngt_set_lazy(ngt_dictionary* dict, const char* marker, lazy_value_fn fn, void* ctx)  {
+    _dictionary_item item;
+    
+    _init_item(&item, marker, ITEM_LAZY);
+    item.val.lazy_value.compute = fn;
+    item.val.lazy_value.data = ctx;
+    
+    return _set_item(dict, &item);
 }
 
 /**
@@ -285,24 +537,16 @@ int ngt_set_int(ngt_dictionary* dict, const char* marker, int value)    {
  */
 int ngt_set_include_cb(ngt_dictionary* dict, const char* marker, get_template_fn get_template, 
                             cleanup_template_fn cleanup_template)   {
-    _dictionary_item* item, *prev_item;
-    
-    item = _new_dictionary_item();
-    item->marker = (char*)malloc(strlen(marker) + 1);
+    _dictionary_item* item;
     
-    strcpy(item->marker, marker);
+    if (!_dictionary_writable(dict))    {
+        return -1;
+    }
     
-    if (ht_insert((hashtable*)dict, item) == 1) {
-        // Already in the hashtable
-        prev_item = item;
-        ht_lookup((hashtable*)dict, (void*)&prev_item);
-        _dictionary_item_destroy(item);
-        item = prev_item;
-        
-        if (!(item->type & ITEM_D_LIST))    {
-            // Cannot call set_include_cb on a string value
-            return -1;
-        }
+    item = _get_or_add_item(dict, marker, ITEM_INCLUDE);
+    if (!(item->type & ITEM_D_LIST))    {
+        // Cannot call set_include_cb on a string value
+        return -1;
     }
     
     item->type = ITEM_INCLUDE;
@@ -321,7 +565,7 @@ int ngt_set_include_cb(ngt_dictionary* dict, const char* marker, get_template_fn
 int ngt_set_include_filename(ngt_dictionary* dict, const char* marker, const char* filename)    {
     _dictionary_item* item;
     
-    if (ngt_set_include_cb(dict, marker, _get_template_from_filename, _cleanup_template) != 0)  {
+    if (ngt_set_include_cb(dict, marker, _map_template_file, _cleanup_include_file) != 0)  {
         // Something went wrong
         return -1;
     }
@@ -336,27 +580,43 @@ int ngt_set_include_filename(ngt_dictionary* dict, const char* marker, const cha
 /**
  * Sets the visibility for the section indicated by "section" in the given dictionary
  * 
- * NOTE: visibility can be one of NGT_SECTION_VISIBLE, NGT_SECTION_HIDDEN
+ * NOTE: visibility can be one of NGT_SECTION_VISIBLE, NGT_SECTION_HIDDEN.  Sections an overlay 
+ *      only gets from its base can be hidden, but not shown
  */
 void ngt_set_section_visibility(ngt_dictionary* dict, const char* section, int visibility)  {
     list_element* child;
     const list* d_list = _get_dictionary_list_ref(dict, section);
+    _dictionary_item* item;
     
-    child = 0;
-    if (d_list) {
-        child = list_head(d_list);
-    } else {
+    if (!_dictionary_writable(dict))    {
+        return;
+    }
+    
+    if (dict->base && !_query_own_item(dict, section))  {
+        // The section comes from the base, which is not ours to change.  An empty section of our
+        // own hides it, but there is no way to show it
+        if (d_list && visibility == NGT_SECTION_HIDDEN) {
+            item = _get_or_add_item(dict, section, ITEM_D_LIST);
+            item->val.d_list_value = _section_list_new();
+        }
         return;
     }
     
+    if (!d_list)    {
+        return;
+    }
+    
+    // Only the rows of this section change, a dictionary that is also a row elsewhere keeps its
+    // visibility there
     for (child = list_head(d_list); child; child = list_next(child))    {
-        ((ngt_dictionary*)list_data(child))->should_expand = visibility;
+        ((_section_row*)list_data(child))->visible = visibility;
     }
 }
 
 /**
  * Adds a child dictionary under the given marker.  If there is an existing dictionary under this marker, 
- * the new dictionary will be ADDED to the end of the list, NOT replace the old one
+ * the new dictionary will be ADDED to the end of the list, NOT replace the old one.  The section 
+ * takes over one reference to the child, see ngt_dictionary_ref()
  *
  * NOTE: Set visible to non-zero if you wish section to be shown automatically, zero if you wish to 
  *      hide it and show later with ngt_show_section();
@@ -364,40 +624,53 @@ void ngt_set_section_visibility(ngt_dictionary* dict, const char* section, int v
  * Returns 0 if the operation succeeded, -1 otherwise
  */
 int ngt_add_dictionary(ngt_dictionary* dict, const char* marker, ngt_dictionary* child, int visible)    {
-    _dictionary_item* item, *prev_item;
-    
-    item = (_dictionary_item*)malloc(sizeof(_dictionary_item));
-    memset(item, 0, sizeof(_dictionary_item));
-    item->type = ITEM_D_LIST;
-    item->marker = (char*)malloc(strlen(marker) + 1);
+    _dictionary_item* item;
     
-    strcpy(item->marker, marker);
+    if (!_dictionary_writable(dict))    {
+        return -1;
+    }
     
-    if (ht_insert((hashtable*)dict, item) == 1) {
-        // Already in the table, add to it
-        prev_item = item;
-        ht_lookup((hashtable*)dict, (void*)&prev_item);
-        _dictionary_item_destroy(item);
-        item = prev_item;
-        
-        if (!(item->type & ITEM_D_LIST))    {
-            // We already have a marker with this name, but it's of a different type
-            return -1;
-        }
-        
+    // If there already is a section by this name, we add to it
+    item = _get_or_add_item(dict, marker, ITEM_D_LIST);
+    if (!(item->type & ITEM_D_LIST))    {
+        // We already have a marker with this name, but it's of a different type
+        return -1;
     }
     
     if (!item->val.d_list_value)    {
-        item->val.d_list_value = (list*)malloc(sizeof(list));
-        list_init(item->val.d_list_value, _dictionary_destroy);
+        item->val.d_list_value = _section_list_new();
     }
     
-    list_insert_next(item->val.d_list_value, list_tail(item->val.d_list_value), child);
-    child->should_expand = visible;
-    child->parent = dict;
+    _section_list_add(item->val.d_list_value, child, visible);
+    if (!child->parent) {
+        // Expansions look markers up in whatever section they found the child in.  This parent
+        // is only for lookups outside of an expansion
+        child->parent = dict;
+    }
+    
+    if (dict->pool && child->pool != dict->pool && !_dictionary_shared(child))    {
+        // A shared child may outlive this pool in one of its other sections
+        ngt_dictionary_set_pool(child, dict->pool);
+    }
     return 0;
 }
 
+/**
+ * Makes "marker" a section whose dictionaries are pulled from next_fn one at a time while it is
+ * expanded
+ *
+ * Returns 0 if the operation succeeded, -1 otherwise
+ */
+int ngt_set_section_iterator(ngt_dictionary* dict, const char* marker, section_next_fn next_fn, void* ctx)   {
+    _dictionary_item item;
+    
+    _init_item(&item, marker, ITEM_ITERATOR);
+    item.val.iterator_value.next = next_fn;
+    item.val.iterator_value.data = ctx;
+    
+    return _set_item(dict, &item);
+}
+
 /**
  * Expands the given template according to the dictionary, putting the result in "result" pointer.
  * Sufficient space will be allocated for the result, and it will then be 
@@ -406,32 +679,75 @@ int ngt_add_dictionary(ngt_dictionary* dict, const char* marker, ngt_dictionary*
  * Returns 0 if the template was successfully processed, -1 if there was an error
  */
 int ngt_expand(ngt_template* tpl, char** result)    {
+    return ngt_expand_dictionary(tpl, tpl->dictionary, result);
+}
+
+/**
+ * Expands the given template according to the given dictionary instead of the one set on the
+ * template, putting the result in "result" pointer.  The template is not modified, so any number
+ * of threads may expand the same template at once, each with its own dictionary or a shared one
+ *
+ * Returns 0 if the template was successfully processed, -1 if there was an error
+ */
+int ngt_expand_dictionary(ngt_template* tpl, ngt_dictionary* dict, char** result)   {
+    return _expand_template(tpl, dict, 0, result);
+}
+
+/**
+ * Starts loading the includes the template may need with the given dictionary on background I/O
+ * threads
+ */
+void ngt_prefetch_includes(ngt_template* tpl, ngt_dictionary* dict) {
+    _prefetch_includes(tpl, dict ? dict : tpl->dictionary, 0);
+}
+
+/**
+ * Expands the template with the given dictionary, looking up include filenames in the template's
+ * own include paths or, if it has none, the given ones
+ *
+ * Returns 0 if the template was successfully processed, -1 if there was an error
+ */
+int _expand_template(ngt_template* tpl, ngt_dictionary* dict, _include_paths* include_paths, char** result) {
     int res;
     _parse_context context;
-    char start_marker[2];
-    char end_marker[2];
+    ngt_dictionary* resolved;
     
     memset(&context, 0, sizeof(_parse_context));    
     context.current_section = "";
     
+    context.template = tpl;
+    context.include_paths = tpl->include_paths ? tpl->include_paths : include_paths;
+    context.active_dictionary = dict;
     if (tpl->start_delimiter.length == 0 && tpl->end_delimiter.length == 0) {
-        ngt_set_delimiters(tpl, "{{", "}}");
+        // No delimiters set, use the defaults without touching the (possibly shared) template
+        context.active_start_delimiter.length = 2;
+        strcpy(context.active_start_delimiter.literal, "{{");
+        context.active_end_delimiter.length = 2;
+        strcpy(context.active_end_delimiter.literal, "}}");
+    } else {
+        _copy_delimiter(&context.active_start_delimiter, &tpl->start_delimiter);
+        _copy_delimiter(&context.active_end_delimiter, &tpl->end_delimiter);
     }
-    
-    context.template = tpl;
-    context.active_dictionary = tpl->dictionary;
-    _copy_delimiter(&context.active_start_delimiter, &tpl->start_delimiter);
-    _copy_delimiter(&context.active_end_delimiter, &tpl->end_delimiter);
     context.in_ptr = (char*)tpl->tmpl;
     context.template_line = 1;
     
+    resolved = 0;
+    context.resolved = &resolved;
+    if (tpl->variables_missing) {
+        _resolve_missing_variables(&context);
+    }
+    
     context.out_sb = sb_new_with_size(1024);
-    res = _process(&context) > 0;
+    res = _process(&context) == (char*)-1 ? -1 : 0;
     sb_append_ch(context.out_sb, '\0');
     
     *result = sb_cstring(context.out_sb);
     sb_destroy(context.out_sb, 0);
     
+    if (resolved)   {
+        ngt_dictionary_destroy(resolved);
+    }
+    
     return res;
 }
 
@@ -439,15 +755,32 @@ int ngt_expand(ngt_template* tpl, char** result)    {
  * Pretty-prints the dictionary key value pairs, one per line, with nested dictionaries tabbed
  */
 void ngt_print_dictionary(ngt_dictionary* dict, FILE* out)  {
+    char buf[VALUE_BUFFER_LENGTH];
+    const char* value;
+    size_t length;
     
-    hashtable_iter* it = ht_iter_begin(&dict->dictionary);
+    _item_cursor cursor;
     _dictionary_item* item;
-    while (it)  {
-        item = (_dictionary_item*)ht_value(it);
+    
+    memset(&cursor, 0, sizeof(_item_cursor));
+    while ((item = _next_item(dict, &cursor)) != 0) {
         switch(item->type)  {
         case ITEM_STRING:
             fprintf(out, "%s=%s\n", item->marker, item->val.string_value);
             break;
+        case ITEM_INT:
+        case ITEM_DOUBLE:
+        case ITEM_BOOL:
+        case ITEM_BUFFER:
+            value = _format_value(item, buf, &length);
+            fprintf(out, "%s=%.*s\n", item->marker, (int)length, value);
+            break;
+        case ITEM_LAZY:
+            fprintf(out, "%s=(lazy)\n", item->marker);
+            break;
+        case ITEM_ITERATOR:
+            fprintf(out, "%s=(section iterator)\n", item->marker);
+            break;
         case ITEM_D_LIST:
         case ITEM_INCLUDE:
             // TODO: Recursively print
@@ -458,8 +791,6 @@ void ngt_print_dictionary(ngt_dictionary* dict, FILE* out)  {
             fprintf(out, "%s=(UNKNOWN TYPE)\n", item->marker);
             break;
         }
-        
-        it = ht_iter_next(it);
     }
 }
 
@@ -0,0 +1,212 @@
+/**
+ * String pools for the ngtemplate engine.  A dictionary with a pool keeps one copy of every long
+ * string value in the pool instead of a copy of its own, so a value repeated across thousands of
+ * section rows (a country, a status, a currency) is only stored once.  Values short enough to be
+ * kept inside their item are never pooled, since they cost nothing extra as it is.
+ *
+ * Pooled strings are carved out of large chunks and only given back when the pool is destroyed,
+ * so a pool is meant for a tree of dictionaries that is built and thrown away together.  The pool
+ * has a lock of its own, so dictionaries sharing it may be filled on different threads.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "ngtemplate.h"
+#include "internal.h"
+
+/**
+ * Helper function - hashes the first "length" characters of value
+ */
+static unsigned _pool_hash(const char* value, size_t length)    {
+    unsigned h = 2166136261u;
+    size_t i;
+    
+    for (i = 0; i < length; i++)    {
+        h = (h ^ (unsigned char)value[i]) * 16777619u;
+    }
+    
+    return h;
+}
+
+/**
+ * Helper function - carves "size" bytes out of the pool's chunks, starting a new chunk if the
+ * current one is full.  Strings too big to share a chunk get one of their own
+ */
+static void* _pool_alloc(ngt_string_pool* pool, size_t size)    {
+    _pool_chunk* chunk;
+    size_t capacity;
+    
+    // Entries hold a pointer, so they are kept aligned for one
+    size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    
+    chunk = pool->chunks;
+    if (!chunk || chunk->used + size > chunk->capacity) {
+        capacity = size > POOL_CHUNK_SIZE / 4 ? size : POOL_CHUNK_SIZE;
+        chunk = (_pool_chunk*)malloc(sizeof(_pool_chunk) + capacity);
+        chunk->capacity = capacity;
+        chunk->used = 0;
+        
+        if (pool->chunks && capacity != POOL_CHUNK_SIZE)    {
+            // A chunk of its own is full as soon as it is made, so keep filling the current one
+            chunk->next = pool->chunks->next;
+            pool->chunks->next = chunk;
+        } else {
+            chunk->next = pool->chunks;
+            pool->chunks = chunk;
+        }
+    }
+    
+    chunk->used += size;
+    return (char*)(chunk + 1) + chunk->used - size;
+}
+
+/**
+ * Helper function - doubles the number of buckets of the pool
+ */
+static void _pool_grow(ngt_string_pool* pool)   {
+    _pool_entry** buckets;
+    _pool_entry* entry, *next;
+    unsigned i, capacity;
+    
+    capacity = pool->capacity ? pool->capacity * 2 : POOL_INITIAL_CAPACITY;
+    buckets = (_pool_entry**)malloc(capacity * sizeof(_pool_entry*));
+    memset(buckets, 0, capacity * sizeof(_pool_entry*));
+    
+    for (i = 0; i < pool->capacity; i++)    {
+        for (entry = pool->buckets[i]; entry; entry = next) {
+            next = entry->next;
+            entry->next = buckets[entry->hash & (capacity - 1)];
+            buckets[entry->hash & (capacity - 1)] = entry;
+        }
+    }
+    
+    if (pool->buckets)  {
+        free(pool->buckets);
+    }
+    
+    pool->buckets = buckets;
+    pool->capacity = capacity;
+}
+
+/**
+ * Creates a new, empty string pool
+ */
+ngt_string_pool* ngt_string_pool_new()  {
+    ngt_string_pool* pool;
+    
+    pool = (ngt_string_pool*)malloc(sizeof(ngt_string_pool));
+    memset(pool, 0, sizeof(ngt_string_pool));
+    pthread_mutex_init(&pool->lock, 0);
+    
+    return pool;
+}
+
+/**
+ * Destroys the string pool and every string in it.  No dictionary may use it anymore
+ */
+void ngt_string_pool_destroy(ngt_string_pool* pool) {
+    _pool_chunk* chunk, *next;
+    
+    for (chunk = pool->chunks; chunk; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    
+    if (pool->buckets)  {
+        free(pool->buckets);
+    }
+    
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+/**
+ * Returns the pool's copy of the first "length" characters of value, making one the first time
+ * they are seen.  The copy is zero terminated and lives as long as the pool
+ */
+const char* _string_pool_intern(ngt_string_pool* pool, const char* value, size_t length)   {
+    _pool_entry* entry;
+    unsigned hash;
+    
+    hash = _pool_hash(value, length);
+    
+    pthread_mutex_lock(&pool->lock);
+    
+    for (entry = pool->capacity ? pool->buckets[hash & (pool->capacity - 1)] : 0; entry; entry = entry->next)  {
+        if (entry->hash == hash && entry->length == length && !memcmp(entry->chars, value, length))  {
+            pthread_mutex_unlock(&pool->lock);
+            return entry->chars;
+        }
+    }
+    
+    if (pool->count >= pool->capacity)  {
+        _pool_grow(pool);
+    }
+    
+    // The entry has room for the terminating zero already
+    entry = (_pool_entry*)_pool_alloc(pool, sizeof(_pool_entry) + length);
+    entry->hash = hash;
+    entry->length = length;
+    memcpy(entry->chars, value, length);
+    entry->chars[length] = '\0';
+    
+    entry->next = pool->buckets[hash & (pool->capacity - 1)];
+    pool->buckets[hash & (pool->capacity - 1)] = entry;
+    pool->count++;
+    
+    pthread_mutex_unlock(&pool->lock);
+    return entry->chars;
+}
+
+/**
+ * Helper function - moves the long string values of the dictionary's own items into the pool
+ */
+static void _pool_dictionary_values(ngt_dictionary* dict)    {
+    _item_cursor cursor;
+    _dictionary_item* item;
+    const char* pooled;
+    
+    memset(&cursor, 0, sizeof(_item_cursor));
+    while ((item = _next_item(dict, &cursor)) != 0) {
+        if (item->type == ITEM_STRING && item->val.string_value &&
+                !(item->flags & (ITEM_INLINE_VALUE | ITEM_POOLED_VALUE)))   {
+            pooled = _string_pool_intern(dict->pool, item->val.string_value, strlen(item->val.string_value));
+            if (!(item->flags & ITEM_BLOCK_VALUE))  {
+                free(item->val.string_value);
+            }
+            
+            item->val.string_value = (char*)pooled;
+            item->flags = (item->flags & ~ITEM_BLOCK_VALUE) | ITEM_POOLED_VALUE;
+        }
+    }
+}
+
+/**
+ * Gives the dictionary and the dictionaries of its sections the pool.  Long string values they
+ * already have are moved into the pool, and so is every long string value set from now on, in
+ * them or in dictionaries added to them later.  The pool must outlive the dictionaries.  Shared
+ * section dictionaries keep their pool
+ */
+void ngt_dictionary_set_pool(ngt_dictionary* dict, ngt_string_pool* pool)   {
+    _item_cursor cursor;
+    _dictionary_item* item;
+    list_element* child;
+    
+    dict->pool = pool;
+    if (!dict->frozen)  {
+        // The values of a frozen dictionary are packed already
+        _pool_dictionary_values(dict);
+    }
+    
+    memset(&cursor, 0, sizeof(_item_cursor));
+    while ((item = _next_item(dict, &cursor)) != 0) {
+        if (item->type & ITEM_D_LIST && item->val.d_list_value)  {
+            for (child = list_head(item->val.d_list_value); child; child = list_next(child)) {
+                if (!_dictionary_shared(ROW_DICTIONARY(child)))   {
+                    ngt_dictionary_set_pool(ROW_DICTIONARY(child), pool);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,286 @@
+/**
+ * Background loading of include templates for the ngtemplate engine.  ngt_prefetch_includes()
+ * finds the include markers of a template up front and hands their loads to a small pool of I/O
+ * threads, so the expansion that follows only waits for the includes it actually reaches, and only
+ * if they are not done loading yet.
+ *
+ * Loads go through the same paths an expansion uses and publish their result in the include
+ * params, so whoever gets there first does the work and the other one just picks up the text.
+ * Every loaded body is scanned for includes of its own on the I/O thread, rather than in the
+ * middle of an expansion.  Include files are mapped, so that scan is also what faults their pages
+ * in, and the expansion finds them in memory.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "ngtemplate.h"
+#include "internal.h"
+
+#define PREFETCH_THREADS            4
+#define PREFETCH_INITIAL_CAPACITY   8
+
+/**
+ * Loads waiting for an I/O thread, oldest first.  The lock also protects the pending counts of
+ * batches, dictionaries and include paths
+ */
+static _prefetch_job* s_prefetch_head;
+static _prefetch_job* s_prefetch_tail;
+static pthread_mutex_t s_prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_prefetch_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t s_prefetch_done = PTHREAD_COND_INITIALIZER;
+
+static pthread_once_t s_prefetch_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Helper function - adds the dictionary to the ones the batch points into
+ */
+static void _prefetch_add_dictionary(_prefetch_batch* batch, ngt_dictionary* dict)  {
+    if (batch->dictionary_count == batch->dictionary_capacity)  {
+        batch->dictionary_capacity = batch->dictionary_capacity ? batch->dictionary_capacity * 2 : PREFETCH_INITIAL_CAPACITY;
+        batch->dictionaries = (ngt_dictionary**)realloc(batch->dictionaries, batch->dictionary_capacity * sizeof(ngt_dictionary*));
+    }
+    
+    batch->dictionaries[batch->dictionary_count++] = dict;
+}
+
+/**
+ * Helper function - adds every include item of the dictionary (and of its base, for an overlay) to
+ * the batch, and the ones of its sections as well if recurse is nonzero
+ */
+static void _prefetch_collect(_prefetch_batch* batch, ngt_dictionary* dict, int recurse)    {
+    _item_cursor cursor;
+    _dictionary_item* item;
+    list_element* child;
+    int count;
+    
+    if (!dict)  {
+        return;
+    }
+    
+    count = batch->count;
+    memset(&cursor, 0, sizeof(_item_cursor));
+    while ((item = _next_item(dict, &cursor)) != 0) {
+        if (item->type == ITEM_INCLUDE && item->val.include_value.get_template) {
+            if (batch->count == batch->capacity)    {
+                batch->capacity = batch->capacity ? batch->capacity * 2 : PREFETCH_INITIAL_CAPACITY;
+                batch->items = (_prefetch_item*)realloc(batch->items, batch->capacity * sizeof(_prefetch_item));
+            }
+            
+            batch->items[batch->count].marker = item->marker;
+            batch->items[batch->count].params = &item->val.include_value;
+            batch->items[batch->count].queued = 0;
+            batch->count++;
+        }
+        
+        if (recurse && item->type & ITEM_D_LIST && item->val.d_list_value)   {
+            for (child = list_head(item->val.d_list_value); child; child = list_next(child)) {
+                _prefetch_collect(batch, ROW_DICTIONARY(child), 1);
+            }
+        }
+    }
+    
+    if (batch->count > count && dict != batch->dictionary)  {
+        // The items are ours until the batch is done, so changing the dictionary has to wait
+        _prefetch_add_dictionary(batch, dict);
+    }
+    
+    _prefetch_collect(batch, dict->base, recurse);
+}
+
+/**
+ * Helper function - _scan_markers() callback that queues a load for every include of the batch
+ * going by the given name, unless one has been queued already
+ */
+static void _prefetch_queue_include(int kind, const char* marker, const char* position, const delimiter* start, 
+                                    const delimiter* end, void* data)   {
+    _prefetch_batch* batch = (_prefetch_batch*)data;
+    _prefetch_job* job;
+    int i;
+    
+    pthread_mutex_lock(&s_prefetch_lock);
+    
+    for (i = 0; i < batch->count; i++)  {
+        if (batch->items[i].queued || strcmp(batch->items[i].marker, marker))   {
+            continue;
+        }
+        
+        job = (_prefetch_job*)malloc(sizeof(_prefetch_job));
+        job->batch = batch;
+        job->index = i;
+        _copy_delimiter(&job->start_delimiter, start);
+        _copy_delimiter(&job->end_delimiter, end);
+        job->next = 0;
+        
+        if (s_prefetch_tail)    {
+            s_prefetch_tail->next = job;
+        } else {
+            s_prefetch_head = job;
+        }
+        s_prefetch_tail = job;
+        
+        batch->items[i].queued = 1;
+        batch->pending++;
+        pthread_cond_signal(&s_prefetch_queued);
+    }
+    
+    pthread_mutex_unlock(&s_prefetch_lock);
+}
+
+/**
+ * Helper function - drops one pending reference to the batch, and frees it once nothing uses it
+ * anymore.  Anyone waiting for its dictionaries or the include paths is woken up then
+ */
+static void _prefetch_release(_prefetch_batch* batch)   {
+    int done, i;
+    
+    pthread_mutex_lock(&s_prefetch_lock);
+    
+    done = --batch->pending == 0;
+    if (done)   {
+        for (i = 0; i < batch->dictionary_count; i++)   {
+            NGT_ATOMIC_FETCH_ADD(&batch->dictionaries[i]->prefetching, -1);
+        }
+        batch->include_paths->prefetching--;
+        pthread_cond_broadcast(&s_prefetch_done);
+    }
+    
+    pthread_mutex_unlock(&s_prefetch_lock);
+    
+    if (done)   {
+        if (batch->items)   {
+            free(batch->items);
+        }
+        free(batch->dictionaries);
+        free(batch);
+    }
+}
+
+/**
+ * Helper function - the body of an I/O thread.  Loads includes as they are queued, then looks for
+ * includes inside what it loaded
+ */
+static void* _prefetch_worker(void* arg)    {
+    _prefetch_job* job;
+    _prefetch_item* item;
+    char* template;
+    
+    for (;;)    {
+        pthread_mutex_lock(&s_prefetch_lock);
+        while (!s_prefetch_head)    {
+            pthread_cond_wait(&s_prefetch_queued, &s_prefetch_lock);
+        }
+        
+        job = s_prefetch_head;
+        s_prefetch_head = job->next;
+        if (!s_prefetch_head)   {
+            s_prefetch_tail = 0;
+        }
+        
+        pthread_mutex_unlock(&s_prefetch_lock);
+        
+        item = &job->batch->items[job->index];
+        template = NGT_ATOMIC_LOAD(&item->params->template);
+        if (!template)  {
+            template = _load_include_template(item->params, item->marker, job->batch->include_paths);
+        }
+        
+        if (template)   {
+            _scan_markers(template, &job->start_delimiter, &job->end_delimiter, MODE_MARKER_INCLUDE, _prefetch_queue_include, job->batch);
+        }
+        
+        _prefetch_release(job->batch);
+        free(job);
+    }
+    
+    return 0;
+}
+
+/**
+ * Helper function - starts the I/O threads.  They live as long as the process
+ */
+static void _prefetch_start()   {
+    pthread_attr_t attr;
+    pthread_t thread;
+    int i;
+    
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    
+    for (i = 0; i < PREFETCH_THREADS; i++)  {
+        if (pthread_create(&thread, &attr, _prefetch_worker, 0) != 0)   {
+            fprintf(stderr, "Could not start include prefetch thread\n");
+            break;
+        }
+    }
+    
+    pthread_attr_destroy(&attr);
+}
+
+/**
+ * Starts loading the includes that expanding the template with the given dictionary may need on
+ * the I/O threads.  Include filenames are looked up like _expand_template() does
+ */
+void _prefetch_includes(ngt_template* tpl, ngt_dictionary* dict, _include_paths* include_paths)  {
+    _prefetch_batch* batch;
+    delimiter start, end;
+    int i;
+    
+    if (!tpl->tmpl || !dict)    {
+        return;
+    }
+    
+    pthread_once(&s_prefetch_once, _prefetch_start);
+    
+    batch = (_prefetch_batch*)malloc(sizeof(_prefetch_batch));
+    memset(batch, 0, sizeof(_prefetch_batch));
+    batch->dictionary = dict;
+    batch->include_paths = tpl->include_paths ? tpl->include_paths : include_paths;
+    if (!batch->include_paths)  {
+        batch->include_paths = _default_include_paths();
+    }
+    
+    // Includes are looked up in the section dictionaries, the parent and the global dictionary
+    _prefetch_add_dictionary(batch, dict);
+    _prefetch_collect(batch, dict, 1);
+    _prefetch_collect(batch, dict->parent, 0);
+    if (dict != ngt_get_global_dictionary())    {
+        _prefetch_collect(batch, ngt_get_global_dictionary(), 0);
+    }
+    
+    // We hold on to the batch ourselves while scanning, so it can't finish under our feet
+    pthread_mutex_lock(&s_prefetch_lock);
+    batch->pending = 1;
+    for (i = 0; i < batch->dictionary_count; i++)   {
+        NGT_ATOMIC_FETCH_ADD(&batch->dictionaries[i]->prefetching, 1);
+    }
+    batch->include_paths->prefetching++;
+    pthread_mutex_unlock(&s_prefetch_lock);
+    
+    if (tpl->start_delimiter.length == 0 && tpl->end_delimiter.length == 0) {
+        start.length = 2;
+        strcpy(start.literal, "{{");
+        end.length = 2;
+        strcpy(end.literal, "}}");
+    } else {
+        _copy_delimiter(&start, &tpl->start_delimiter);
+        _copy_delimiter(&end, &tpl->end_delimiter);
+    }
+    
+    if (batch->count)   {
+        _scan_markers(tpl->tmpl, &start, &end, MODE_MARKER_INCLUDE, _prefetch_queue_include, batch);
+    }
+    
+    _prefetch_release(batch);
+}
+
+/**
+ * Blocks until the given count of prefetches in flight drops to zero
+ */
+void _prefetch_wait(int* pending)   {
+    pthread_mutex_lock(&s_prefetch_lock);
+    while (*pending)    {
+        pthread_cond_wait(&s_prefetch_done, &s_prefetch_lock);
+    }
+    pthread_mutex_unlock(&s_prefetch_lock);
+}
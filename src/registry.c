@@ -0,0 +1,1196 @@
+/**
+ * Template registry for the ngtemplate engine.  Maps names to templates that can be republished
+ * while other threads are expanding them.
+ *
+ * Readers never take a lock: they announce the epoch they entered in, look the template up in a
+ * table that writers only ever fill in place or replace wholesale, and expand whatever version was
+ * current.  Writers serialize on the registry lock, swap pointers atomically and hand everything
+ * they unpublished to the retired list, which is freed once every reader has moved past the epoch
+ * it was retired in.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "ngtemplate.h"
+#include "internal.h"
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+#define REGISTRY_INITIAL_CAPACITY   64
+#define PRELOAD_INITIAL_CAPACITY    256
+
+#ifdef CLOCK_MONOTONIC_COARSE
+#define REGISTRY_CLOCK              CLOCK_MONOTONIC_COARSE
+#else
+#define REGISTRY_CLOCK              CLOCK_MONOTONIC
+#endif
+
+/**
+ * Helper function - returns the timestamp used for LRU bookkeeping, in milliseconds
+ */
+static unsigned long _registry_clock()  {
+    struct timespec ts;
+    
+    clock_gettime(REGISTRY_CLOCK, &ts);
+    return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Helper function - records that the entry was just used.  Only writes when the timestamp 
+ * actually changes, so threads hammering the same template don't fight over its cache line
+ */
+static void _registry_touch(_registry_entry* entry) {
+    unsigned long now = _registry_clock();
+    
+    if (NGT_ATOMIC_LOAD_RELAXED(&entry->last_used) != now)  {
+        NGT_ATOMIC_STORE_RELAXED(&entry->last_used, now);
+    }
+}
+
+/**
+ * Helper function - returns roughly how much memory the given template holds.  Templates read from
+ * a file know their length, so only published strings have to be measured
+ */
+static size_t _registry_template_bytes(ngt_template* tpl)   {
+    if (tpl->loaded_file && tpl->tmpl == tpl->loaded_tmpl)  {
+        return sizeof(ngt_template) + _template_file_length(tpl->tmpl) + 1;
+    }
+    
+    return sizeof(ngt_template) + (tpl->tmpl ? strlen(tpl->tmpl) + 1 : 0);
+}
+
+/**
+ * Helper function - allocates an empty lookup table with the given number of slots
+ */
+static _registry_table* _registry_table_new(int capacity)   {
+    _registry_table* table;
+    
+    table = (_registry_table*)malloc(sizeof(_registry_table) + (capacity - 1) * sizeof(_registry_entry*));
+    memset(table, 0, sizeof(_registry_table) + (capacity - 1) * sizeof(_registry_entry*));
+    table->capacity = capacity;
+    
+    return table;
+}
+
+/**
+ * Helper function - destroys a registry entry and the template it holds
+ * Signature conforms to the retired list destroy signature
+ */
+static void _registry_entry_destroy(void* data) {
+    _registry_entry* entry = (_registry_entry*)data;
+    
+    if (entry->template)    {
+        ngt_destroy(entry->template);
+    }
+    
+    if (entry->filename)    {
+        free(entry->filename);
+    }
+    
+    free(entry->name);
+    free(entry);
+}
+
+/**
+ * Helper function - destroys a template that has been replaced by a newer version
+ * Signature conforms to the retired list destroy signature
+ */
+static void _registry_template_destroy(void* data)  {
+    ngt_destroy((ngt_template*)data);
+}
+
+/**
+ * Helper function - returns the calling thread's reader record, creating or recycling one if
+ * this thread has never read from the registry before
+ */
+static _registry_reader* _registry_reader_get(ngt_registry* reg)    {
+    _registry_reader* reader;
+    int unowned;
+    
+    reader = (_registry_reader*)pthread_getspecific(reg->reader_key);
+    if (reader) {
+        return reader;
+    }
+    
+    // Try to take over the record of a thread that has exited
+    for (reader = NGT_ATOMIC_LOAD(&reg->readers); reader; reader = reader->next) {
+        unowned = 0;
+        if (NGT_ATOMIC_CAS(&reader->owned, &unowned, 1))    {
+            pthread_setspecific(reg->reader_key, reader);
+            return reader;
+        }
+    }
+    
+    reader = (_registry_reader*)malloc(sizeof(_registry_reader));
+    memset(reader, 0, sizeof(_registry_reader));
+    reader->owned = 1;
+    
+    reader->next = NGT_ATOMIC_LOAD(&reg->readers);
+    while (!NGT_ATOMIC_CAS(&reg->readers, &reader->next, reader))  {
+        // Somebody else pushed a record first, reader->next has been updated for us
+    }
+    
+    pthread_setspecific(reg->reader_key, reader);
+    return reader;
+}
+
+/**
+ * Helper function - called when a thread exits, so its reader record can be reused
+ */
+static void _registry_reader_release(void* data)    {
+    _registry_reader* reader = (_registry_reader*)data;
+    
+    reader->depth = 0;
+    NGT_ATOMIC_STORE_SC(&reader->epoch, 0);
+    NGT_ATOMIC_STORE_SC(&reader->owned, 0);
+}
+
+/**
+ * Registry helper - enters a read-side critical section for the calling thread.  Anything that was
+ * published when this returns stays valid until the matching _registry_exit()
+ */
+void _registry_enter(ngt_registry* reg) {
+    _registry_reader* reader = _registry_reader_get(reg);
+    
+    if (reader->depth++ == 0)   {
+        NGT_ATOMIC_STORE_SC(&reader->epoch, NGT_ATOMIC_LOAD_SC(&reg->epoch));
+    }
+}
+
+/**
+ * Registry helper - leaves a read-side critical section entered with _registry_enter()
+ */
+void _registry_exit(ngt_registry* reg)  {
+    _registry_reader* reader = (_registry_reader*)pthread_getspecific(reg->reader_key);
+    
+    if (reader && --reader->depth == 0) {
+        NGT_ATOMIC_STORE_SC(&reader->epoch, 0);
+    }
+}
+
+/**
+ * Helper function - frees everything on the retired list that no reader can still see.
+ * Must be called with the registry lock held
+ */
+static void _registry_collect(ngt_registry* reg)    {
+    _registry_reader* reader;
+    _registry_retired** link, *retired;
+    unsigned long oldest, epoch;
+    
+    // Find the oldest epoch any reader is still in
+    oldest = NGT_ATOMIC_LOAD_SC(&reg->epoch);
+    for (reader = NGT_ATOMIC_LOAD(&reg->readers); reader; reader = reader->next)  {
+        epoch = NGT_ATOMIC_LOAD_SC(&reader->epoch);
+        if (epoch && epoch < oldest)    {
+            oldest = epoch;
+        }
+    }
+    
+    link = &reg->retired;
+    while (*link)   {
+        retired = *link;
+        if (retired->epoch < oldest)    {
+            *link = retired->next;
+            retired->destroy(retired->data);
+            free(retired);
+        } else {
+            link = &retired->next;
+        }
+    }
+}
+
+/**
+ * Helper function - hands something that was just unpublished to the retired list.  It will be
+ * destroyed once every reader that could have seen it is gone.  Must be called with the registry
+ * lock held
+ */
+static void _registry_retire(ngt_registry* reg, void* data, void (*destroy)(void* data))    {
+    _registry_retired* retired;
+    
+    retired = (_registry_retired*)malloc(sizeof(_registry_retired));
+    retired->data = data;
+    retired->destroy = destroy;
+    
+    // Readers that enter from now on get a newer epoch, and can't see what we just unpublished
+    retired->epoch = NGT_ATOMIC_FETCH_ADD(&reg->epoch, 1);
+    retired->next = reg->retired;
+    reg->retired = retired;
+    
+    _registry_collect(reg);
+}
+
+/**
+ * Registry helper - finds the entry registered under the given name in the current table.  Must be
+ * called inside a read-side critical section or with the registry lock held
+ *
+ * Returns the entry, or 0 if there is none
+ */
+_registry_entry* _registry_find(ngt_registry* reg, const char* name)    {
+    _registry_table* table;
+    _registry_entry* entry;
+    int hash, i;
+    
+    table = NGT_ATOMIC_LOAD_SC(&reg->table);
+    hash = ht_hashpjw(name);
+    
+    for (i = hash & (table->capacity - 1); ; i = (i + 1) & (table->capacity - 1))  {
+        entry = NGT_ATOMIC_LOAD(&table->slots[i]);
+        if (!entry) {
+            return 0;
+        }
+        
+        if (entry != REGISTRY_TOMBSTONE && entry->hash == hash && !strcmp(entry->name, name))    {
+            return entry;
+        }
+    }
+}
+
+/**
+ * Helper function - puts the entry into the first free slot of the table.  Must be called with the
+ * registry lock held.  The table must have room
+ */
+static void _registry_table_put(_registry_table* table, _registry_entry* entry) {
+    int i;
+    
+    for (i = entry->hash & (table->capacity - 1); ; i = (i + 1) & (table->capacity - 1))   {
+        if (!table->slots[i])   {
+            table->used++;
+            break;
+        } else if (table->slots[i] == REGISTRY_TOMBSTONE)   {
+            break;
+        }
+    }
+    
+    NGT_ATOMIC_STORE(&table->slots[i], entry);
+}
+
+/**
+ * Helper function - adds a new entry to the registry, replacing the table with a bigger one
+ * if need be.  Must be called with the registry lock held
+ */
+static void _registry_insert(ngt_registry* reg, _registry_entry* entry)  {
+    _registry_table* table, *new_table;
+    int i, live;
+    
+    table = reg->table;
+    if ((table->used + 1) * 2 > table->capacity)    {
+        // Too crowded.  Build a fresh table without the tombstones and publish it
+        live = 0;
+        for (i = 0; i < table->capacity; i++)   {
+            if (table->slots[i] && table->slots[i] != REGISTRY_TOMBSTONE)   {
+                live++;
+            }
+        }
+        
+        new_table = _registry_table_new((live + 1) * 4 > table->capacity ? table->capacity * 2 : table->capacity);
+        for (i = 0; i < table->capacity; i++)   {
+            if (table->slots[i] && table->slots[i] != REGISTRY_TOMBSTONE)   {
+                _registry_table_put(new_table, table->slots[i]);
+            }
+        }
+        
+        NGT_ATOMIC_STORE_SC(&reg->table, new_table);
+        _registry_retire(reg, table, free);
+        table = new_table;
+    }
+    
+    _registry_table_put(table, entry);
+}
+
+/**
+ * Helper function - splits a filename into the directory inotify should watch and the name
+ * of the file inside it.  The directory is freshly allocated
+ */
+static char* _registry_split_filename(const char* filename, const char** basename)  {
+    const char* slash;
+    char* dir;
+    
+    slash = strrchr(filename, '/');
+    if (!slash) {
+        *basename = filename;
+        dir = (char*)malloc(2);
+        strcpy(dir, ".");
+        return dir;
+    }
+    
+    *basename = slash + 1;
+    if (slash == filename)  {
+        // A file right in the root directory
+        slash++;
+    }
+    
+    dir = (char*)malloc(slash - filename + 1);
+    memcpy(dir, filename, slash - filename);
+    dir[slash - filename] = '\0';
+    return dir;
+}
+
+/**
+ * Helper function - makes sure the directory holding the given file is being watched.  Must be
+ * called with the registry lock held
+ */
+static void _registry_watch_file(ngt_registry* reg, const char* filename)  {
+#ifdef __linux__
+    _registry_watch* watch;
+    const char* basename;
+    char* dir;
+    int wd;
+    
+    if (!reg->watching) {
+        return;
+    }
+    
+    dir = _registry_split_filename(filename, &basename);
+    for (watch = reg->watches; watch; watch = watch->next)  {
+        if (!strcmp(watch->dir, dir))   {
+            free(dir);
+            return;
+        }
+    }
+    
+    // Watch the directory rather than the file, so editors that replace the file by renaming a
+    // new one over it are noticed too
+    wd = inotify_add_watch(reg->watch_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (wd < 0) {
+        fprintf(stderr, "Could not watch '%s' for changes\n", dir);
+        free(dir);
+        return;
+    }
+    
+    watch = (_registry_watch*)malloc(sizeof(_registry_watch));
+    watch->wd = wd;
+    watch->dir = dir;
+    watch->next = reg->watches;
+    reg->watches = watch;
+#endif
+}
+
+/**
+ * Helper function - unpublishes the least recently used templates until the registry fits in its
+ * memory limit again.  Only templates that were loaded from a file are evicted, since those are
+ * the only ones we can bring back.  Must be called with the registry lock held
+ */
+static void _registry_evict(ngt_registry* reg, _registry_entry* keep)   {
+    _registry_table* table;
+    _registry_entry* entry, *oldest;
+    ngt_template* old_tpl;
+    int i;
+    
+    table = reg->table;
+    while (reg->memory_limit && reg->bytes_used > reg->memory_limit)    {
+        oldest = 0;
+        for (i = 0; i < table->capacity; i++)   {
+            entry = table->slots[i];
+            if (!entry || entry == REGISTRY_TOMBSTONE || entry == keep || !entry->filename || 
+                !entry->template || entry->loading) {
+                continue;
+            }
+            
+            if (!oldest || NGT_ATOMIC_LOAD_RELAXED(&entry->last_used) < NGT_ATOMIC_LOAD_RELAXED(&oldest->last_used))   {
+                oldest = entry;
+            }
+        }
+        
+        if (!oldest)    {
+            // Nothing left that we are allowed to evict
+            return;
+        }
+        
+        // Keep the entry itself around, so we still know which file to load it from
+        old_tpl = NGT_ATOMIC_EXCHANGE(&oldest->template, 0);
+        _registry_retire(reg, old_tpl, _registry_template_destroy);
+        reg->bytes_used -= oldest->bytes;
+        oldest->bytes = 0;
+    }
+}
+
+/**
+ * Helper function - publishes a template under the given name.  Takes ownership of the template
+ * and of the filename, which may be 0.  Must be called with the registry lock held
+ */
+static void _registry_publish(ngt_registry* reg, const char* name, ngt_template* tpl, char* filename)  {
+    _registry_entry* entry;
+    ngt_template* old_tpl;
+    
+    entry = _registry_find(reg, name);
+    if (entry)  {
+        old_tpl = NGT_ATOMIC_EXCHANGE(&entry->template, tpl);
+        if (old_tpl && old_tpl != tpl)  {
+            _registry_retire(reg, old_tpl, _registry_template_destroy);
+        }
+        
+        if (entry->filename)    {
+            free(entry->filename);
+        }
+        entry->filename = filename;
+        reg->bytes_used -= entry->bytes;
+    } else {
+        entry = (_registry_entry*)malloc(sizeof(_registry_entry));
+        memset(entry, 0, sizeof(_registry_entry));
+        entry->name = (char*)malloc(strlen(name) + 1);
+        strcpy(entry->name, name);
+        entry->hash = ht_hashpjw(name);
+        entry->filename = filename;
+        entry->template = tpl;
+        
+        _registry_insert(reg, entry);
+    }
+    
+    entry->bytes = _registry_template_bytes(tpl);
+    NGT_ATOMIC_STORE_RELAXED(&entry->last_used, _registry_clock());
+    reg->bytes_used += entry->bytes;
+    
+    if (filename)   {
+        _registry_watch_file(reg, filename);
+    }
+    
+    _registry_evict(reg, entry);
+}
+
+/**
+ * Helper function - removes the entry registered under the given name.  Must be called with the
+ * registry lock held
+ *
+ * Returns 0 if the entry was removed, -1 if there was no such entry
+ */
+static int _registry_remove(ngt_registry* reg, const char* name)  {
+    _registry_table* table;
+    _registry_entry* entry;
+    int i;
+    
+    table = reg->table;
+    for (i = 0; i < table->capacity; i++)   {
+        entry = table->slots[i];
+        if (entry && entry != REGISTRY_TOMBSTONE && !strcmp(entry->name, name))  {
+            reg->bytes_used -= entry->bytes;
+            
+            // Unpublished first, so no reader that starts after the retire can still find it
+            NGT_ATOMIC_STORE(&table->slots[i], REGISTRY_TOMBSTONE);
+            _registry_retire(reg, entry, _registry_entry_destroy);
+            return 0;
+        }
+    }
+    
+    return -1;
+}
+
+/**
+ * Helper function - creates a template from the given file and runs the init callback on it.  
+ * Call this without the registry lock held, so other writers aren't held up by our I/O
+ *
+ * Returns the template, or 0 if the file could not be loaded
+ */
+static ngt_template* _registry_load_template(ngt_registry* reg, const char* filename)  {
+    ngt_template* tpl;
+    init_template_fn init_fn;
+    int watching;
+    
+    pthread_mutex_lock(&reg->lock);
+    init_fn = reg->init_template;
+    watching = reg->watching;
+    pthread_mutex_unlock(&reg->lock);
+    
+    // Watched files are reloaded when they are written to, which an editor may well do in place.
+    // A mapping would show those writes, or fault if the file shrinks, so watched templates get a
+    // copy of their own
+    tpl = ngt_new();
+    if (_load_template_file(tpl, filename, watching) != 0)  {
+        ngt_destroy(tpl);
+        return 0;
+    }
+    
+    if (init_fn)    {
+        init_fn(tpl);
+    }
+    
+    return tpl;
+}
+
+/**
+ * Helper function - loads a template that was not resident when someone asked for it.  If the name
+ * was evicted we load it from the file it originally came from, otherwise the name is taken to be
+ * the filename.  When several threads miss on the same name at once only one of them loads it, 
+ * the others wait for it to finish
+ *
+ * Returns 0 if the template is now published, -1 otherwise
+ */
+static int _registry_load_missing(ngt_registry* reg, const char* name) {
+    _registry_entry* entry;
+    ngt_template* tpl;
+    char* filename;
+    
+    pthread_mutex_lock(&reg->lock);
+    
+    entry = _registry_find(reg, name);
+    while (entry && entry->loading) {
+        pthread_cond_wait(&reg->loaded, &reg->lock);
+        entry = _registry_find(reg, name);
+    }
+    
+    if (entry && entry->template)   {
+        // Somebody else loaded it while we were waiting
+        pthread_mutex_unlock(&reg->lock);
+        return 0;
+    }
+    
+    if (entry && !entry->filename)  {
+        // Published from code and then removed, we have no idea where to get it
+        pthread_mutex_unlock(&reg->lock);
+        return -1;
+    }
+    
+    filename = (char*)malloc(strlen(entry ? entry->filename : name) + 1);
+    strcpy(filename, entry ? entry->filename : name);
+    
+    if (!entry) {
+        // Placeholder, so other threads missing on this name wait for us instead of loading too
+        entry = (_registry_entry*)malloc(sizeof(_registry_entry));
+        memset(entry, 0, sizeof(_registry_entry));
+        entry->name = (char*)malloc(strlen(name) + 1);
+        strcpy(entry->name, name);
+        entry->hash = ht_hashpjw(name);
+        _registry_insert(reg, entry);
+    }
+    entry->loading = 1;
+    
+    pthread_mutex_unlock(&reg->lock);
+    
+    tpl = _registry_load_template(reg, filename);
+    
+    pthread_mutex_lock(&reg->lock);
+    
+    // The entry may have been removed while we weren't holding the lock, so look it up again
+    entry = _registry_find(reg, name);
+    if (entry)  {
+        entry->loading = 0;
+    }
+    
+    if (tpl)    {
+        _registry_publish(reg, name, tpl, filename);
+    } else {
+        if (entry && !entry->filename)  {
+            // Our placeholder, don't leave it behind
+            _registry_remove(reg, name);
+        }
+        free(filename);
+    }
+    
+    pthread_cond_broadcast(&reg->loaded);
+    pthread_mutex_unlock(&reg->lock);
+    
+    return tpl ? 0 : -1;
+}
+
+/**
+ * Creates a new, empty template registry
+ */
+ngt_registry* ngt_registry_new()    {
+    ngt_registry* reg;
+    
+    ngt_init();
+    
+    reg = (ngt_registry*)malloc(sizeof(ngt_registry));
+    memset(reg, 0, sizeof(ngt_registry));
+    
+    reg->table = _registry_table_new(REGISTRY_INITIAL_CAPACITY);
+    reg->epoch = 1;     // Zero means "not reading" in the reader records
+    reg->watch_fd = -1;
+    reg->include_paths = _include_paths_new();
+    pthread_mutex_init(&reg->lock, 0);
+    pthread_cond_init(&reg->loaded, 0);
+    pthread_key_create(&reg->reader_key, _registry_reader_release);
+    
+    return reg;
+}
+
+/**
+ * Destroys the registry and every template in it.  Stops the file watcher if it is running
+ *
+ * NOTE: No other thread may be using the registry, or any template acquired from it, anymore
+ */
+void ngt_registry_destroy(ngt_registry* reg)    {
+    _registry_reader* reader;
+    _registry_retired* retired;
+    int i;
+    
+    ngt_registry_unwatch(reg);
+    
+    for (i = 0; i < reg->table->capacity; i++)  {
+        if (reg->table->slots[i] && reg->table->slots[i] != REGISTRY_TOMBSTONE) {
+            _registry_entry_destroy(reg->table->slots[i]);
+        }
+    }
+    free(reg->table);
+    
+    while (reg->retired)    {
+        retired = reg->retired;
+        reg->retired = retired->next;
+        retired->destroy(retired->data);
+        free(retired);
+    }
+    
+    while (reg->readers)    {
+        reader = reg->readers;
+        reg->readers = reader->next;
+        free(reader);
+    }
+    
+    _include_paths_destroy(reg->include_paths);
+    pthread_key_delete(reg->reader_key);
+    pthread_cond_destroy(&reg->loaded);
+    pthread_mutex_destroy(&reg->lock);
+    free(reg);
+}
+
+/**
+ * Sets a callback that will be called on every template the registry creates when loading a file,
+ * so you can add modifiers, missing callbacks or delimiters before the template is published
+ */
+void ngt_registry_set_init_cb(ngt_registry* reg, init_template_fn init_fn)  {
+    pthread_mutex_lock(&reg->lock);
+    reg->init_template = init_fn;
+    pthread_mutex_unlock(&reg->lock);
+}
+
+/**
+ * Adds a directory to search for include files in when expanding templates through 
+ * ngt_registry_expand().  Works like ngt_add_include_path(), for every template in the registry 
+ * that doesn't have include paths of its own
+ */
+void ngt_registry_add_include_path(ngt_registry* reg, const char* dir) {
+    _include_paths_add(reg->include_paths, dir);
+}
+
+/**
+ * Publishes a template under the given name, atomically replacing the current version if there
+ * is one.  The registry takes ownership of the template.  Threads that are expanding the old
+ * version will finish with it; the next ngt_registry_acquire() returns the new one
+ *
+ * Returns 0 if the operation succeeded, -1 otherwise
+ */
+int ngt_registry_publish(ngt_registry* reg, const char* name, ngt_template* tpl)   {
+    if (!tpl || !name)  {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&reg->lock);
+    _registry_publish(reg, name, tpl, 0);
+    pthread_mutex_unlock(&reg->lock);
+    
+    return 0;
+}
+
+/**
+ * Loads the given file into a new template and publishes it under the given name.  If the file
+ * cannot be loaded the current version, if any, stays published
+ *
+ * Returns 0 if the operation succeeded, -1 otherwise
+ */
+int ngt_registry_load(ngt_registry* reg, const char* name, const char* filename)   {
+    ngt_template* tpl;
+    char* filename_copy;
+    
+    tpl = _registry_load_template(reg, filename);
+    if (!tpl)   {
+        return -1;
+    }
+    
+    filename_copy = (char*)malloc(strlen(filename) + 1);
+    strcpy(filename_copy, filename);
+    
+    pthread_mutex_lock(&reg->lock);
+    _registry_publish(reg, name, tpl, filename_copy);
+    pthread_mutex_unlock(&reg->lock);
+    
+    return 0;
+}
+
+/**
+ * Helper function - adds every template file below the given directory to the preload job.  Names
+ * are the paths relative to the directory the preload started at.  Hidden files and directories
+ * are skipped, and symbolic links to directories are not followed so we can't loop forever
+ *
+ * Returns 0 if the directory could be read, -1 otherwise
+ */
+static int _registry_preload_walk(_registry_preload* job, const char* dir, const char* prefix)   {
+    DIR* dp;
+    struct dirent* de;
+    struct stat st, target;
+    char* filename, *name;
+    
+    dp = opendir(dir);
+    if (!dp)    {
+        return -1;
+    }
+    
+    while ((de = readdir(dp)) != 0) {
+        if (de->d_name[0] == '.')   {
+            continue;
+        }
+        
+        filename = (char*)malloc(strlen(dir) + strlen(de->d_name) + 2);
+        sprintf(filename, "%s/%s", dir, de->d_name);
+        name = (char*)malloc(strlen(prefix) + strlen(de->d_name) + 2);
+        sprintf(name, "%s%s%s", prefix, *prefix ? "/" : "", de->d_name);
+        
+        if (lstat(filename, &st) != 0)  {
+            fprintf(stderr, "Could not stat '%s'\n", filename);
+            job->failures++;
+        } else if (S_ISDIR(st.st_mode)) {
+            if (_registry_preload_walk(job, filename, name) != 0)   {
+                fprintf(stderr, "Could not read directory '%s'\n", filename);
+                job->failures++;
+            }
+        } else if (S_ISLNK(st.st_mode) && stat(filename, &target) == 0 && S_ISDIR(target.st_mode))    {
+            // A link to a directory, which we don't follow.  Broken links are left for the load
+            // to report
+        } else if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode))  {
+            if (job->count == job->capacity)    {
+                job->capacity *= 2;
+                job->names = (char**)realloc(job->names, job->capacity * sizeof(char*));
+                job->filenames = (char**)realloc(job->filenames, job->capacity * sizeof(char*));
+            }
+            
+            job->names[job->count] = name;
+            job->filenames[job->count] = filename;
+            job->count++;
+            continue;
+        }
+        
+        free(filename);
+        free(name);
+    }
+    
+    closedir(dp);
+    return 0;
+}
+
+/**
+ * Helper function - preload worker thread.  Keeps claiming the next file of the job until there
+ * are none left
+ */
+static void* _registry_preload_worker(void* data)   {
+    _registry_preload* job = (_registry_preload*)data;
+    ngt_template* tpl;
+    int i;
+    
+    while ((i = NGT_ATOMIC_FETCH_ADD(&job->next, 1)) < job->count)  {
+        tpl = _registry_load_template(job->reg, job->filenames[i]);
+        if (!tpl)   {
+            fprintf(stderr, "Could not preload template '%s'\n", job->filenames[i]);
+            NGT_ATOMIC_FETCH_ADD(&job->failures, 1);
+            continue;
+        }
+        
+        pthread_mutex_lock(&job->reg->lock);
+        _registry_publish(job->reg, job->names[i], tpl, job->filenames[i]);
+        pthread_mutex_unlock(&job->reg->lock);
+        
+        // The registry owns the filename now
+        job->filenames[i] = 0;
+    }
+    
+    return 0;
+}
+
+/**
+ * Loads every file below the given directory into the registry, using the given number of threads
+ * (or one per CPU if nthreads is 0 or less).  Each template is published under its path relative 
+ * to the directory, so "templates/mail/footer.tpl" preloaded from "templates" is named 
+ * "mail/footer.tpl".  Files that can't be loaded are reported on stderr and skipped
+ *
+ * Returns the number of files that could not be loaded, or -1 if the directory could not be read
+ */
+int ngt_registry_preload_dir(ngt_registry* reg, const char* path, int nthreads)    {
+    _registry_preload job;
+    pthread_t* threads;
+    int i, started;
+    
+    memset(&job, 0, sizeof(_registry_preload));
+    job.reg = reg;
+    job.capacity = PRELOAD_INITIAL_CAPACITY;
+    job.names = (char**)malloc(job.capacity * sizeof(char*));
+    job.filenames = (char**)malloc(job.capacity * sizeof(char*));
+    
+    if (_registry_preload_walk(&job, path, "") != 0)    {
+        free(job.names);
+        free(job.filenames);
+        return -1;
+    }
+    
+    if (nthreads <= 0)  {
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    
+    if (nthreads > job.count)   {
+        nthreads = job.count;
+    }
+    
+    // The calling thread does its share of the work too, and all of it if no thread could be 
+    // started
+    threads = (pthread_t*)malloc((nthreads > 1 ? nthreads - 1 : 1) * sizeof(pthread_t));
+    for (started = 0; started < nthreads - 1; started++)    {
+        if (pthread_create(&threads[started], 0, _registry_preload_worker, &job) != 0)  {
+            fprintf(stderr, "Could only start %d preload threads\n", started);
+            break;
+        }
+    }
+    
+    _registry_preload_worker(&job);
+    
+    for (i = 0; i < started; i++)   {
+        pthread_join(threads[i], 0);
+    }
+    
+    for (i = 0; i < job.count; i++) {
+        free(job.names[i]);
+        if (job.filenames[i])   {
+            free(job.filenames[i]);
+        }
+    }
+    
+    free(threads);
+    free(job.names);
+    free(job.filenames);
+    
+    return job.failures;
+}
+
+/**
+ * Removes the template published under the given name.  It is freed once no thread can still be
+ * expanding it
+ *
+ * Returns 0 if the operation succeeded, -1 if there was no such template
+ */
+int ngt_registry_remove(ngt_registry* reg, const char* name)   {
+    int res;
+    
+    pthread_mutex_lock(&reg->lock);
+    res = _registry_remove(reg, name);
+    pthread_mutex_unlock(&reg->lock);
+    
+    return res;
+}
+
+/**
+ * Returns the current version of the template published under the given name, or 0 if there is
+ * none.  Never blocks.  The template stays valid until you call ngt_registry_release(), even if a
+ * new version is published in the meantime.  Do NOT modify or destroy it
+ *
+ * NOTE: Every successful acquire must be paired with a release from the same thread
+ */
+ngt_template* ngt_registry_acquire(ngt_registry* reg, const char* name)    {
+    _registry_entry* entry;
+    ngt_template* tpl;
+    
+    _registry_enter(reg);
+    
+    tpl = 0;
+    entry = _registry_find(reg, name);
+    if (entry)  {
+        tpl = NGT_ATOMIC_LOAD_SC(&entry->template);
+    }
+    
+    if (!tpl)   {
+        _registry_exit(reg);
+    } else {
+        _registry_touch(entry);
+    }
+    
+    return tpl;
+}
+
+/**
+ * Like ngt_registry_acquire(), but if no template is resident under the given name it is loaded,
+ * either from the file it was originally loaded from (if it was evicted) or from the file with 
+ * that name.  A file is only loaded once no matter how many threads ask for it at the same time
+ *
+ * NOTE: Every successful get must be paired with a ngt_registry_release() from the same thread
+ */
+ngt_template* ngt_registry_get(ngt_registry* reg, const char* name)    {
+    ngt_template* tpl;
+    
+    tpl = ngt_registry_acquire(reg, name);
+    while (!tpl)    {
+        if (_registry_load_missing(reg, name) != 0) {
+            return 0;
+        }
+        
+        // Under a tight memory limit it may already have been evicted again, so keep trying
+        tpl = ngt_registry_acquire(reg, name);
+    }
+    
+    return tpl;
+}
+
+/**
+ * Sets the amount of memory, in bytes, the templates in the registry may use.  When a template is
+ * loaded or published past this limit, the least recently used templates that were loaded from
+ * files are evicted until the registry fits again.  They are transparently reloaded the next time
+ * they are needed.  The include files cached for the registry's include paths are held to the same
+ * limit.  Zero (the default) means no limit on the templates
+ */
+void ngt_registry_set_memory_limit(ngt_registry* reg, size_t bytes)    {
+    pthread_mutex_lock(&reg->lock);
+    reg->memory_limit = bytes;
+    _registry_evict(reg, 0);
+    pthread_mutex_unlock(&reg->lock);
+    
+    _include_paths_set_limit(reg->include_paths, bytes);
+}
+
+/**
+ * Returns the amount of memory, in bytes, held by the templates resident in the registry and the 
+ * include files cached for it
+ */
+size_t ngt_registry_memory_used(ngt_registry* reg)  {
+    size_t bytes;
+    
+    pthread_mutex_lock(&reg->lock);
+    bytes = reg->bytes_used;
+    pthread_mutex_unlock(&reg->lock);
+    
+    return bytes + _include_paths_bytes(reg->include_paths);
+}
+
+/**
+ * Tells the registry the calling thread is done with a template returned by ngt_registry_acquire()
+ */
+void ngt_registry_release(ngt_registry* reg, ngt_template* tpl)    {
+    if (tpl)    {
+        _registry_exit(reg);
+    }
+}
+
+/**
+ * Expands the current version of the named template with the given dictionary, loading it if it
+ * is not resident.  Include filenames are looked up in the registry's include paths unless the
+ * template has its own.  A convenience wrapper around ngt_registry_get(), ngt_expand_dictionary()
+ * and ngt_registry_release()
+ *
+ * Returns 0 if the template was successfully processed, -1 if there was an error or no template
+ * was published under that name
+ */
+int ngt_registry_expand(ngt_registry* reg, const char* name, ngt_dictionary* dict, char** result)  {
+    ngt_template* tpl;
+    int res;
+    
+    tpl = ngt_registry_get(reg, name);
+    if (!tpl)   {
+        return -1;
+    }
+    
+    res = _expand_template(tpl, dict, reg->include_paths, result);
+    ngt_registry_release(reg, tpl);
+    
+    return res;
+}
+
+/**
+ * Starts loading the includes of the current version of the named template on background I/O
+ * threads
+ */
+int ngt_registry_prefetch_includes(ngt_registry* reg, const char* name, ngt_dictionary* dict)  {
+    ngt_template* tpl;
+    
+    tpl = ngt_registry_get(reg, name);
+    if (!tpl)   {
+        return -1;
+    }
+    
+    _prefetch_includes(tpl, dict ? dict : tpl->dictionary, reg->include_paths);
+    ngt_registry_release(reg, tpl);
+    
+    return 0;
+}
+
+#ifdef __linux__
+/**
+ * Helper function - reloads every template that was loaded from the given file in the given
+ * watched directory
+ */
+static void _registry_reload(ngt_registry* reg, int wd, const char* basename)   {
+    _registry_watch* watch;
+    _registry_table* table;
+    _registry_entry* entry;
+    const char* entry_basename;
+    char* entry_dir;
+    char** names, **filenames;
+    int i, count;
+    
+    pthread_mutex_lock(&reg->lock);
+    
+    for (watch = reg->watches; watch && watch->wd != wd; watch = watch->next)   {
+        // Looking for the directory this event happened in
+    }
+    
+    // Note down what needs reloading, then do the actual loading without the lock held
+    count = 0;
+    table = reg->table;
+    names = (char**)malloc(table->capacity * sizeof(char*));
+    filenames = (char**)malloc(table->capacity * sizeof(char*));
+    for (i = 0; watch && i < table->capacity; i++)  {
+        entry = table->slots[i];
+        if (!entry || entry == REGISTRY_TOMBSTONE || !entry->filename || !entry->template)  {
+            // Evicted templates are loaded fresh from the file when they are needed anyway
+            continue;
+        }
+        
+        entry_dir = _registry_split_filename(entry->filename, &entry_basename);
+        if (!strcmp(entry_basename, basename) && !strcmp(entry_dir, watch->dir))    {
+            names[count] = (char*)malloc(strlen(entry->name) + 1);
+            strcpy(names[count], entry->name);
+            filenames[count] = (char*)malloc(strlen(entry->filename) + 1);
+            strcpy(filenames[count], entry->filename);
+            count++;
+        }
+        free(entry_dir);
+    }
+    
+    pthread_mutex_unlock(&reg->lock);
+    
+    for (i = 0; i < count; i++) {
+        if (ngt_registry_load(reg, names[i], filenames[i]) != 0)    {
+            fprintf(stderr, "Could not reload template '%s' from '%s', keeping the old version\n", names[i], filenames[i]);
+        }
+        
+        free(names[i]);
+        free(filenames[i]);
+    }
+    
+    free(names);
+    free(filenames);
+}
+
+/**
+ * The watcher thread.  Waits for inotify events until it is woken up through the pipe
+ */
+static void* _registry_watcher(void* data)  {
+    ngt_registry* reg = (ngt_registry*)data;
+    struct pollfd fds[2];
+    char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event* event;
+    ssize_t length;
+    char* p;
+    
+    fds[0].fd = reg->watch_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = reg->wake_fd[0];
+    fds[1].events = POLLIN;
+    
+    while (1)   {
+        if (poll(fds, 2, -1) < 0)   {
+            continue;
+        }
+        
+        if (fds[1].revents) {
+            // Time to go
+            break;
+        }
+        
+        length = read(reg->watch_fd, buffer, sizeof(buffer));
+        for (p = buffer; length > 0 && p < buffer + length; p += sizeof(struct inotify_event) + event->len)  {
+            event = (const struct inotify_event*)p;
+            if (event->len) {
+                _registry_reload(reg, event->wd, event->name);
+            }
+        }
+    }
+    
+    return 0;
+}
+#endif
+
+/**
+ * Starts a background thread that reloads templates whenever the file they were loaded from
+ * changes.  Only supported on Linux (inotify)
+ *
+ * Returns 0 if the watcher is running, -1 otherwise
+ */
+int ngt_registry_watch(ngt_registry* reg)   {
+#ifdef __linux__
+    _registry_table* table;
+    int i;
+    
+    pthread_mutex_lock(&reg->lock);
+    
+    if (reg->watching)  {
+        pthread_mutex_unlock(&reg->lock);
+        return 0;
+    }
+    
+    reg->watch_fd = inotify_init1(IN_CLOEXEC);
+    if (reg->watch_fd < 0)  {
+        pthread_mutex_unlock(&reg->lock);
+        return -1;
+    }
+    
+    if (pipe(reg->wake_fd) != 0)    {
+        close(reg->watch_fd);
+        reg->watch_fd = -1;
+        pthread_mutex_unlock(&reg->lock);
+        return -1;
+    }
+    
+    reg->watching = 1;
+    table = reg->table;
+    for (i = 0; i < table->capacity; i++)   {
+        if (table->slots[i] && table->slots[i] != REGISTRY_TOMBSTONE && table->slots[i]->filename)   {
+            _registry_watch_file(reg, table->slots[i]->filename);
+        }
+    }
+    
+    pthread_create(&reg->watcher, 0, _registry_watcher, reg);
+    
+    pthread_mutex_unlock(&reg->lock);
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/**
+ * Stops the background thread started by ngt_registry_watch()
+ */
+void ngt_registry_unwatch(ngt_registry* reg)    {
+#ifdef __linux__
+    _registry_watch* watch;
+    
+    pthread_mutex_lock(&reg->lock);
+    if (!reg->watching) {
+        pthread_mutex_unlock(&reg->lock);
+        return;
+    }
+    reg->watching = 0;
+    pthread_mutex_unlock(&reg->lock);
+    
+    // The watcher may be waiting for the lock to reload something, so it has to be woken up and
+    // joined without holding the lock
+    if (write(reg->wake_fd[1], "x", 1) != 1)    {
+        fprintf(stderr, "Could not wake up the template watcher thread\n");
+    }
+    pthread_join(reg->watcher, 0);
+    
+    pthread_mutex_lock(&reg->lock);
+    close(reg->watch_fd);
+    close(reg->wake_fd[0]);
+    close(reg->wake_fd[1]);
+    reg->watch_fd = -1;
+    
+    while (reg->watches)    {
+        watch = reg->watches;
+        reg->watches = watch->next;
+        free(watch->dir);
+        free(watch);
+    }
+    pthread_mutex_unlock(&reg->lock);
+#endif
+}
@@ -0,0 +1,148 @@
+/**
+ * Dictionary reuse for the ngtemplate engine.  A server that builds a dictionary tree for every
+ * request and throws it away afterwards spends much of its time in malloc() and free() for item
+ * tables that end up the same size every time.  ngt_dictionary_reset() empties a dictionary but
+ * keeps its item table, and ngt_dictionary_release() keeps dictionaries that are done with on a
+ * per-thread list that ngt_dictionary_acquire() hands out again.
+ *
+ * The spare list belongs to the thread, so acquiring and releasing take no locks.  A dictionary
+ * released on another thread than the one that acquired it simply joins that thread's list.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "ngtemplate.h"
+#include "internal.h"
+
+static pthread_key_t s_spare_key;
+static pthread_once_t s_spare_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Helper function - destroys the spare dictionaries of a thread that is exiting
+ */
+static void _spare_destroy(void* data)  {
+    _spare_dictionaries* spares = (_spare_dictionaries*)data;
+    
+    while (spares->count)   {
+        _dictionary_destroy(spares->dictionaries[--spares->count]);
+    }
+    
+    free(spares);
+}
+
+/**
+ * Helper function - creates the key of the per-thread spare lists
+ */
+static void _spare_key_create() {
+    pthread_key_create(&s_spare_key, _spare_destroy);
+}
+
+/**
+ * Helper function - returns the spare list of the calling thread, creating it the first time
+ */
+static _spare_dictionaries* _spare_list()   {
+    _spare_dictionaries* spares;
+    
+    pthread_once(&s_spare_once, _spare_key_create);
+    
+    spares = (_spare_dictionaries*)pthread_getspecific(s_spare_key);
+    if (!spares)    {
+        spares = (_spare_dictionaries*)malloc(sizeof(_spare_dictionaries));
+        spares->count = 0;
+        pthread_setspecific(s_spare_key, spares);
+    }
+    
+    return spares;
+}
+
+/**
+ * Helper function - list destroy callback that releases the dictionaries of section rows instead
+ * of destroying them
+ */
+static void _section_row_recycle(void* data)    {
+    _section_row* row = (_section_row*)data;
+    
+    ngt_dictionary_release(row->dictionary);
+    free(row);
+}
+
+/**
+ * Empties the dictionary of all its values and sections, but keeps the memory it had for the next
+ * values.  A frozen dictionary can be changed again after a reset.  The dictionary keeps its 
+ * schema, base and string pool, and its references
+ */
+void ngt_dictionary_reset(ngt_dictionary* dict) {
+    int i;
+    
+    // The I/O threads may still be loading includes that live in this dictionary
+    _prefetch_wait(&dict->prefetching);
+    
+    if (dict->frozen)   {
+        _frozen_destroy(dict->frozen);
+        dict->frozen = 0;
+    }
+    
+    if (dict->slots)    {
+        for (i = 0; i < dict->schema->count; i++)   {
+            _slot_item_clear(&dict->slots[i]);
+        }
+    }
+    
+    _table_reset(dict);
+}
+
+/**
+ * Returns an empty dictionary, reusing one the calling thread gave back with 
+ * ngt_dictionary_release() if there is any.  Steady request handling then keeps using the same
+ * dictionaries and never allocates their memory again
+ */
+ngt_dictionary* ngt_dictionary_acquire()    {
+    _spare_dictionaries* spares = _spare_list();
+    
+    if (spares->count)  {
+        return spares->dictionaries[--spares->count];
+    }
+    
+    return ngt_dictionary_new();
+}
+
+/**
+ * Drops a reference to the dictionary like ngt_dictionary_destroy(), but once that was the last
+ * one the dictionary and its section dictionaries are reset and kept for the calling thread's next
+ * ngt_dictionary_acquire() instead of being destroyed.  Dictionaries with a schema or a base are
+ * always destroyed
+ */
+void ngt_dictionary_release(ngt_dictionary* dict)   {
+    _spare_dictionaries* spares;
+    _dictionary_item* item;
+    _item_cursor cursor;
+    
+    if (NGT_ATOMIC_FETCH_ADD(&dict->references, -1) > 1)   {
+        // Still added to another section, or held by someone else
+        return;
+    }
+    
+    spares = _spare_list();
+    if (dict->schema || dict->base || spares->count == SPARE_DICTIONARIES_MAX)  {
+        // Nobody asks for those back, so keeping them would only hold on to memory
+        dict->references = 1;
+        _dictionary_destroy(dict);
+        return;
+    }
+    
+    // The section dictionaries are spares as well once the reset lets go of them
+    memset(&cursor, 0, sizeof(_item_cursor));
+    while ((item = _next_item(dict, &cursor)) != 0) {
+        if (item->type & ITEM_D_LIST && item->val.d_list_value)  {
+            item->val.d_list_value->destroy = _section_row_recycle;
+        }
+    }
+    
+    ngt_dictionary_reset(dict);
+    dict->parent = 0;
+    dict->pool = 0;
+    dict->references = 1;
+    
+    spares->dictionaries[spares->count++] = dict;
+}
@@ -0,0 +1,245 @@
+/**
+ * Template schemas for the ngtemplate engine.  ngt_schema_from_template() gives every marker a
+ * template references a fixed slot, and dictionaries bound to the schema keep the values of those
+ * markers in a flat array indexed by slot instead of in their item table.
+ *
+ * The schema also remembers the slot of every marker occurrence by its position in the template
+ * text, which is exactly what the expander has in hand when it gets to a marker.  So expanding
+ * the schema's own template with a schema-bound dictionary finds values with a binary search over
+ * positions and never hashes a marker name.  Markers outside the template, and everything a
+ * schema-bound dictionary holds that is not in the schema, go through the item table as usual.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "ngtemplate.h"
+#include "internal.h"
+
+#define SCHEMA_INITIAL_CAPACITY     16
+
+/**
+ * Helper function - finds the marker among the slots sorted by name
+ *
+ * Returns the index in by_name where the marker is, or where it belongs as -(index + 1)
+ */
+static int _schema_search(const ngt_schema* schema, const char* marker)   {
+    int low, high, mid, cmp;
+    
+    low = 0;
+    high = schema->count - 1;
+    while (low <= high) {
+        mid = (low + high) / 2;
+        cmp = strcmp(schema->markers[schema->by_name[mid]], marker);
+        if (cmp == 0)   {
+            return mid;
+        }
+        
+        if (cmp < 0)    {
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+    
+    return -(low + 1);
+}
+
+/**
+ * Helper function - _scan_markers() callback that gives the marker a slot if it has none yet, and
+ * records the occurrence
+ */
+static void _schema_add_marker(int kind, const char* marker, const char* position, const delimiter* start, const delimiter* end, void* data)   {
+    ngt_schema* schema = (ngt_schema*)data;
+    int index, slot;
+    
+    index = _schema_search(schema, marker);
+    if (index >= 0) {
+        slot = schema->by_name[index];
+    } else {
+        if (schema->count == schema->capacity)  {
+            schema->capacity *= 2;
+            schema->markers = (char**)realloc(schema->markers, schema->capacity * sizeof(char*));
+            schema->by_name = (int*)realloc(schema->by_name, schema->capacity * sizeof(int));
+        }
+        
+        index = -index - 1;
+        slot = schema->count++;
+        schema->markers[slot] = (char*)malloc(strlen(marker) + 1);
+        strcpy(schema->markers[slot], marker);
+        
+        memmove(&schema->by_name[index + 1], &schema->by_name[index], (slot - index) * sizeof(int));
+        schema->by_name[index] = slot;
+    }
+    
+    if (schema->occurrence_count == schema->occurrence_capacity)    {
+        schema->occurrence_capacity *= 2;
+        schema->occurrences = (_schema_occurrence*)realloc(schema->occurrences,
+                                    schema->occurrence_capacity * sizeof(_schema_occurrence));
+    }
+    
+    schema->occurrences[schema->occurrence_count].position = position;
+    schema->occurrences[schema->occurrence_count].slot = slot;
+    schema->occurrence_count++;
+}
+
+/**
+ * Creates the schema of the given template: a slot for every variable, section and include it
+ * references, numbered from 0 in the order they first appear
+ *
+ * Returns the schema, or NULL if the template has no template text
+ */
+ngt_schema* ngt_schema_from_template(ngt_template* tpl)    {
+    ngt_schema* schema;
+    delimiter start, end;
+    
+    if (!tpl->tmpl) {
+        return 0;
+    }
+    
+    schema = (ngt_schema*)malloc(sizeof(ngt_schema));
+    memset(schema, 0, sizeof(ngt_schema));
+    
+    schema->tmpl = tpl->tmpl;
+    schema->capacity = SCHEMA_INITIAL_CAPACITY;
+    schema->markers = (char**)malloc(schema->capacity * sizeof(char*));
+    schema->by_name = (int*)malloc(schema->capacity * sizeof(int));
+    schema->occurrence_capacity = SCHEMA_INITIAL_CAPACITY;
+    schema->occurrences = (_schema_occurrence*)malloc(schema->occurrence_capacity * sizeof(_schema_occurrence));
+    
+    if (tpl->start_delimiter.length == 0 && tpl->end_delimiter.length == 0) {
+        start.length = 2;
+        strcpy(start.literal, "{{");
+        end.length = 2;
+        strcpy(end.literal, "}}");
+    } else {
+        _copy_delimiter(&start, &tpl->start_delimiter);
+        _copy_delimiter(&end, &tpl->end_delimiter);
+    }
+    
+    _scan_markers(tpl->tmpl, &start, &end, MODE_MARKER_VARIABLE | MODE_MARKER_SECTION | MODE_MARKER_INCLUDE,
+                    _schema_add_marker, schema);
+    
+    return schema;
+}
+
+/**
+ * Destroys the schema.  No dictionary may be bound to it anymore
+ */
+void ngt_schema_destroy(ngt_schema* schema) {
+    int i;
+    
+    for (i = 0; i < schema->count; i++) {
+        free(schema->markers[i]);
+    }
+    
+    free(schema->markers);
+    free(schema->by_name);
+    free(schema->occurrences);
+    free(schema);
+}
+
+/**
+ * Returns the slot of the given marker in the schema, or -1 if the template doesn't reference it
+ */
+int ngt_schema_slot(const ngt_schema* schema, const char* marker)  {
+    int index = _schema_search(schema, marker);
+    
+    return index >= 0 ? schema->by_name[index] : -1;
+}
+
+/**
+ * Returns the number of slots in the schema
+ */
+int ngt_schema_slot_count(const ngt_schema* schema) {
+    return schema->count;
+}
+
+/**
+ * Returns the slot read by the marker that ends at the given position in the schema's template,
+ * or -1 if no marker of the template ends there
+ */
+int _schema_slot_at(const ngt_schema* schema, const char* position)  {
+    int low, high, mid;
+    
+    low = 0;
+    high = schema->occurrence_count - 1;
+    while (low <= high) {
+        mid = (low + high) / 2;
+        if (schema->occurrences[mid].position == position)  {
+            return schema->occurrences[mid].slot;
+        }
+        
+        if (schema->occurrences[mid].position < position)   {
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+    
+    return -1;
+}
+
+/**
+ * Returns the slot item of the given marker in the schema-bound dictionary, set or not, or 0 if
+ * the dictionary is not bound to a schema or the marker has no slot
+ */
+_dictionary_item* _slot_item(ngt_dictionary* dict, const char* marker) {
+    int slot;
+    
+    if (!dict->slots)   {
+        return 0;
+    }
+    
+    slot = ngt_schema_slot(dict->schema, marker);
+    return slot >= 0 ? &dict->slots[slot] : 0;
+}
+
+/**
+ * Helper function - destroys what the slot item holds and empties it
+ */
+void _slot_item_clear(_dictionary_item* item)   {
+    if (item->marker)   {
+        _dictionary_item_release(item);
+        memset(item, 0, sizeof(_dictionary_item));
+    }
+}
+
+/**
+ * Creates a new dictionary bound to the schema.  Values of markers that have a slot in the schema
+ * are kept in a flat array, however they are set.  The schema must outlive the dictionary
+ */
+ngt_dictionary* ngt_dictionary_new_from_schema(ngt_schema* schema)    {
+    ngt_dictionary* d = ngt_dictionary_new();
+    
+    d->schema = schema;
+    d->slots = (_dictionary_item*)malloc((schema->count ? schema->count : 1) * sizeof(_dictionary_item));
+    memset(d->slots, 0, (schema->count ? schema->count : 1) * sizeof(_dictionary_item));
+    
+    return d;
+}
+
+/**
+ * Sets a string value in the given slot of a schema-bound dictionary
+ *
+ * Returns 0 if the operation succeeded, -1 otherwise
+ */
+int ngt_set_slot(ngt_dictionary* dict, int slot, const char* value)  {
+    _dictionary_item* item;
+    
+    if (!dict->slots || slot < 0 || slot >= dict->schema->count)    {
+        fprintf(stderr, "No slot %d in the dictionary\n", slot);
+        return -1;
+    }
+    
+    if (!_dictionary_writable(dict))    {
+        return -1;
+    }
+    
+    item = &dict->slots[slot];
+    if (!item->marker)  {
+        item->type = ITEM_STRING;
+        item->marker = dict->schema->markers[slot];
+    }
+    
+    return _item_replace_string(dict, item, value, strlen(value));
+}
@@ -0,0 +1,495 @@
+#include <pthread.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "test_utils.h"
+#include "ngtemplate.h"
+
+#define NUM_READERS     4
+#define NUM_VERSIONS    500
+#define WATCH_TIMEOUT   500     /* In units of 10ms */
+
+/**
+ * Publishes new versions of a template while other threads keep expanding it, then checks that the
+ * file watcher picks up a changed template file.  Also checks that concurrent misses load a file 
+ * only once, that the least recently used templates are evicted under a memory limit, that include
+ * files are found through search paths, that nested includes can be prefetched and that a 
+ * directory tree can be preloaded.  Build with -DNGT_SANITIZE_THREAD=ON to run this under 
+ * ThreadSanitizer
+ */
+
+typedef struct reader_args_tag  {
+    ngt_registry* reg;
+    ngt_dictionary* dict;
+    const char* name;
+    int done;
+    int failures;
+} reader_args;
+
+static char s_versions[NUM_VERSIONS][64];
+static int s_loads;
+static int s_inner_loads;
+
+void* reader_thread(void* data) {
+    reader_args* args = (reader_args*)data;
+    char* result;
+    char expected[64];
+    int version, last_version;
+    
+    last_version = 0;
+    while (!__atomic_load_n(&args->done, __ATOMIC_ACQUIRE)) {
+        if (ngt_registry_expand(args->reg, "page", args->dict, &result) != 0)   {
+            args->failures++;
+            continue;
+        }
+        
+        // Every expansion must see one complete version, and versions never go backwards
+        version = -1;
+        sscanf(result, "Version %d:", &version);
+        sprintf(expected, "Version %d: Hello World", version);
+        if (strcmp(result, expected) || version < last_version)  {
+            args->failures++;
+        }
+        
+        last_version = version;
+        free(result);
+    }
+    
+    return 0;
+}
+
+void* getter_thread(void* data)  {
+    reader_args* args = (reader_args*)data;
+    ngt_template* tpl;
+    
+    tpl = ngt_registry_get(args->reg, args->name);
+    if (!tpl)   {
+        args->failures++;
+        return 0;
+    }
+    
+    ngt_registry_release(args->reg, tpl);
+    return 0;
+}
+
+void count_loads(ngt_template* tpl)   {
+    __atomic_fetch_add(&s_loads, 1, __ATOMIC_RELAXED);
+}
+
+char* load_inner(const char* name)  {
+    char* template = (char*)malloc(6);
+    
+    strcpy(template, "inner");
+    __atomic_fetch_add(&s_inner_loads, 1, __ATOMIC_RELEASE);
+    
+    return template;
+}
+
+void free_inner(const char* name, char* template)   {
+    free(template);
+}
+
+char* load_slowly(const char* name) {
+    char* template = (char*)malloc(5);
+    
+    usleep(50000);
+    strcpy(template, "slow");
+    
+    return template;
+}
+
+void write_file(const char* filename, const char* contents) {
+    FILE* fp = fopen(filename, "w");
+    
+    fputs(contents, fp);
+    fclose(fp);
+}
+
+void get_and_release(ngt_registry* reg, const char* name)   {
+    ngt_template* tpl = ngt_registry_get(reg, name);
+    
+    if (tpl)    {
+        ngt_registry_release(reg, tpl);
+    }
+    
+    // Make sure the next template we touch gets a later timestamp
+    usleep(20000);
+}
+
+ngt_template* make_version(int version) {
+    ngt_template* tpl = ngt_new();
+    
+    sprintf(s_versions[version], "Version %d: Hello {{Name}}", version);
+    tpl->tmpl = s_versions[version];
+    
+    return tpl;
+}
+
+DEFINE_TEST_FUNCTION    {
+    pthread_t threads[NUM_READERS];
+    reader_args args[NUM_READERS];
+    ngt_registry* reg;
+    ngt_dictionary* dict, *include_dict, *outer_dict;
+    ngt_template* tpl;
+    char dirname[] = "/tmp/ngt_registry_XXXXXX";
+    char filename[PATH_MAX], a[PATH_MAX], b[PATH_MAX], c[PATH_MAX], d[PATH_MAX];
+    char* result, *original;
+    size_t one_template;
+    FILE* fp;
+    int i, ch, failures;
+    
+    reg = ngt_registry_new();
+    dict = ngt_dictionary_new();
+    ngt_set_string(dict, "Name", "World");
+    
+    // Hot swap versions of "page" under load
+    ngt_registry_publish(reg, "page", make_version(0));
+    for (i = 0; i < NUM_READERS; i++)   {
+        args[i].reg = reg;
+        args[i].dict = dict;
+        args[i].done = 0;
+        args[i].failures = 0;
+        pthread_create(&threads[i], 0, reader_thread, &args[i]);
+    }
+    
+    for (i = 1; i < NUM_VERSIONS; i++)  {
+        ngt_registry_publish(reg, "page", make_version(i));
+    }
+    
+    failures = 0;
+    for (i = 0; i < NUM_READERS; i++)   {
+        __atomic_store_n(&args[i].done, 1, __ATOMIC_RELEASE);
+        pthread_join(threads[i], 0);
+        failures += args[i].failures;
+    }
+    
+    if (failures)   {
+        fprintf(stderr, "%d expansions saw a torn or stale version\n", failures);
+        return -1;
+    }
+    
+    ngt_registry_expand(reg, "page", dict, &result);
+    fprintf(out, "%s\n", result);
+    free(result);
+    
+    ngt_registry_remove(reg, "page");
+    if (ngt_registry_acquire(reg, "page"))  {
+        fprintf(stderr, "Removed template is still published\n");
+        return -1;
+    }
+    
+    // Live reload of a template file
+    if (!mkdtemp(dirname))  {
+        fprintf(stderr, "Could not create a temporary directory\n");
+        return -1;
+    }
+    
+    sprintf(filename, "%s/file.tpl", dirname);
+    fp = fopen(filename, "w");
+    while ((ch = fgetc(in)) != EOF) {
+        fputc(ch, fp);
+    }
+    fclose(fp);
+    
+    ngt_registry_load(reg, "file", filename);
+    ngt_registry_expand(reg, "file", dict, &original);
+    fprintf(out, "%s", original);
+    
+    if (ngt_registry_watch(reg) == 0)   {
+        fp = fopen(filename, "a");
+        fprintf(fp, "...and now it has been changed, {{Name}}\n");
+        fclose(fp);
+        
+        for (i = 0; i < WATCH_TIMEOUT; i++) {
+            ngt_registry_expand(reg, "file", dict, &result);
+            if (strcmp(result, original))   {
+                break;
+            }
+            
+            free(result);
+            result = 0;
+            usleep(10000);
+        }
+        
+        if (!result)    {
+            fprintf(stderr, "Watcher did not reload the changed template\n");
+            return -1;
+        }
+        
+        fprintf(out, "%s", result);
+        free(result);
+        
+        ngt_registry_unwatch(reg);
+    }
+    
+    unlink(filename);
+    ngt_registry_remove(reg, "file");
+    
+    // Several threads missing on the same file load it only once
+    sprintf(d, "%s/d.tpl", dirname);
+    write_file(d, "Template D, {{Name}}\n");
+    ngt_registry_set_init_cb(reg, count_loads);
+    for (i = 0; i < NUM_READERS; i++)   {
+        args[i].name = d;
+        args[i].failures = 0;
+        pthread_create(&threads[i], 0, getter_thread, &args[i]);
+    }
+    
+    for (i = 0; i < NUM_READERS; i++)   {
+        pthread_join(threads[i], 0);
+        failures += args[i].failures;
+    }
+    
+    if (failures || s_loads != 1)   {
+        fprintf(stderr, "Concurrent misses loaded the template %d times, %d failed\n", s_loads, failures);
+        return -1;
+    }
+    
+    ngt_registry_expand(reg, d, dict, &result);
+    fprintf(out, "%s", result);
+    free(result);
+    
+    ngt_registry_remove(reg, d);
+    unlink(d);
+    
+    // Least recently used templates are evicted under a memory limit
+    sprintf(a, "%s/a.tpl", dirname);
+    sprintf(b, "%s/b.tpl", dirname);
+    sprintf(c, "%s/c.tpl", dirname);
+    write_file(a, "Template A, {{Name}}\n");
+    write_file(b, "Template B, {{Name}}\n");
+    write_file(c, "Template C, {{Name}}\n");
+    
+    get_and_release(reg, a);
+    one_template = ngt_registry_memory_used(reg);
+    ngt_registry_set_memory_limit(reg, one_template * 2);
+    
+    get_and_release(reg, b);
+    get_and_release(reg, a);
+    get_and_release(reg, c);
+    
+    if (ngt_registry_memory_used(reg) > one_template * 2)   {
+        fprintf(stderr, "Registry uses %lu bytes, over its limit\n", (unsigned long)ngt_registry_memory_used(reg));
+        return -1;
+    }
+    
+    // With the files gone, only the templates still resident can be expanded
+    unlink(a);
+    unlink(b);
+    unlink(c);
+    
+    result = 0;
+    fprintf(out, "a is %s\n", ngt_registry_expand(reg, a, dict, &result) == 0 ? "resident" : "evicted");
+    if (result) {
+        free(result);
+        result = 0;
+    }
+    
+    fprintf(out, "b is %s\n", ngt_registry_expand(reg, b, dict, &result) == 0 ? "resident" : "evicted");
+    if (result) {
+        free(result);
+        result = 0;
+    }
+    
+    fprintf(out, "c is %s\n", ngt_registry_expand(reg, c, dict, &result) == 0 ? "resident" : "evicted");
+    if (result) {
+        free(result);
+        result = 0;
+    }
+    
+    // Include files are found through the search paths and cached
+    sprintf(a, "%s/inc", dirname);
+    mkdir(a, 0700);
+    sprintf(b, "%s/inc/header.tpl", dirname);
+    write_file(b, "Included header for {{Name}}");
+    ngt_registry_add_include_path(reg, "/nonexistent");
+    ngt_registry_add_include_path(reg, a);
+    
+    tpl = ngt_new();
+    tpl->tmpl = "[{{>Header}}]\n";
+    ngt_registry_publish(reg, "with_include", tpl);
+    
+    include_dict = ngt_dictionary_new();
+    ngt_set_string(include_dict, "Name", "World");
+    ngt_add_dictionary(include_dict, "Header", ngt_dictionary_new(), NGT_SECTION_VISIBLE);
+    ngt_set_include_filename(include_dict, "Header", "header.tpl");
+    ngt_registry_expand(reg, "with_include", include_dict, &result);
+    fprintf(out, "%s", result);
+    free(result);
+    ngt_dictionary_destroy(include_dict);
+    
+    // Templates can have search paths of their own, which work the same way
+    include_dict = ngt_dictionary_new();
+    ngt_set_string(include_dict, "Name", "a standalone template");
+    ngt_add_dictionary(include_dict, "Header", ngt_dictionary_new(), NGT_SECTION_VISIBLE);
+    ngt_set_include_filename(include_dict, "Header", "header.tpl");
+    
+    tpl = ngt_new();
+    tpl->tmpl = "Standalone [{{>Header}}]\n";
+    ngt_add_include_path(tpl, a);
+    ngt_expand_dictionary(tpl, include_dict, &result);
+    fprintf(out, "%s", result);
+    free(result);
+    ngt_destroy(tpl);
+    ngt_dictionary_destroy(include_dict);
+    
+    // Includes are cached even for templates without search paths, and read again once they change
+    tpl = ngt_new();
+    tpl->tmpl = "No paths [{{>Header}}]\n";
+    for (i = 0; i < 2; i++) {
+        if (i == 1) {
+            write_file(b, "Changed header for {{Name}}");
+            sleep(1);
+        }
+        
+        include_dict = ngt_dictionary_new();
+        ngt_set_string(include_dict, "Name", i ? "a changed file" : "a file");
+        ngt_add_dictionary(include_dict, "Header", ngt_dictionary_new(), NGT_SECTION_VISIBLE);
+        ngt_set_include_filename(include_dict, "Header", b);
+        ngt_expand_dictionary(tpl, include_dict, &result);
+        fprintf(out, "%s", result);
+        free(result);
+        ngt_dictionary_destroy(include_dict);
+    }
+    ngt_destroy(tpl);
+    
+    // Once the file is gone the include is too
+    unlink(b);
+    rmdir(a);
+    
+    include_dict = ngt_dictionary_new();
+    ngt_set_string(include_dict, "Name", "again");
+    ngt_add_dictionary(include_dict, "Header", ngt_dictionary_new(), NGT_SECTION_VISIBLE);
+    ngt_set_include_filename(include_dict, "Header", "header.tpl");
+    ngt_registry_expand(reg, "with_include", include_dict, &result);
+    fprintf(out, "%s", result);
+    free(result);
+    ngt_dictionary_destroy(include_dict);
+    
+    // Prefetching loads includes nested in other includes before the expansion needs them.  The 
+    // outer include changes the delimiters, which the prefetcher has to follow to find the inner one
+    sprintf(a, "%s/outer.tpl", dirname);
+    write_file(a, "{{=<% %>=}}outer <%>Inner%>");
+    
+    include_dict = ngt_dictionary_new();
+    ngt_set_include_filename(include_dict, "Outer", a);
+    outer_dict = ngt_dictionary_new();
+    ngt_add_dictionary(include_dict, "Outer", outer_dict, NGT_SECTION_VISIBLE);
+    ngt_set_include_cb(outer_dict, "Inner", load_inner, free_inner);
+    ngt_add_dictionary(outer_dict, "Inner", ngt_dictionary_new(), NGT_SECTION_VISIBLE);
+    
+    tpl = ngt_new();
+    tpl->tmpl = "Prefetched [{{>Outer}}]\n";
+    ngt_prefetch_includes(tpl, include_dict);
+    for (i = 0; i < WATCH_TIMEOUT && !__atomic_load_n(&s_inner_loads, __ATOMIC_ACQUIRE); i++)    {
+        usleep(10000);
+    }
+    
+    // Everything is loaded now, so the expansion doesn't need the file anymore
+    unlink(a);
+    ngt_expand_dictionary(tpl, include_dict, &result);
+    fprintf(out, "%s", result);
+    fprintf(out, "Inner loaded %d time(s)\n", __atomic_load_n(&s_inner_loads, __ATOMIC_ACQUIRE));
+    free(result);
+    ngt_destroy(tpl);
+    ngt_dictionary_destroy(include_dict);
+    
+    // Freezing moves the items the I/O threads load into, so it has to wait for the prefetch
+    include_dict = ngt_dictionary_new();
+    ngt_set_include_cb(include_dict, "Slow", load_slowly, free_inner);
+    ngt_add_dictionary(include_dict, "Slow", ngt_dictionary_new(), NGT_SECTION_VISIBLE);
+    
+    tpl = ngt_new();
+    tpl->tmpl = "Frozen while prefetching [{{>Slow}}]\n";
+    ngt_prefetch_includes(tpl, include_dict);
+    ngt_dictionary_freeze(include_dict, 1);
+    ngt_expand_dictionary(tpl, include_dict, &result);
+    fprintf(out, "%s", result);
+    free(result);
+    ngt_destroy(tpl);
+    ngt_dictionary_destroy(include_dict);
+    
+    // The same goes for a section whose include is loading while the prefetch started elsewhere
+    include_dict = ngt_dictionary_new();
+    outer_dict = ngt_dictionary_new();
+    ngt_add_dictionary(include_dict, "Row", outer_dict, NGT_SECTION_VISIBLE);
+    ngt_set_include_cb(outer_dict, "Slow", load_slowly, free_inner);
+    ngt_add_dictionary(outer_dict, "Slow", ngt_dictionary_new(), NGT_SECTION_VISIBLE);
+    
+    tpl = ngt_new();
+    tpl->tmpl = "Section frozen while prefetching [{{#Row}}{{>Slow}}{{/Row}}]\n";
+    ngt_prefetch_includes(tpl, include_dict);
+    ngt_dictionary_freeze(outer_dict, 0);
+    ngt_expand_dictionary(tpl, include_dict, &result);
+    fprintf(out, "%s", result);
+    free(result);
+    ngt_destroy(tpl);
+    ngt_dictionary_destroy(include_dict);
+    
+    // Preloading a whole directory tree, with one file that can't be loaded and a link to a 
+    // directory that must not be taken for one
+    ngt_registry_set_memory_limit(reg, 0);
+    sprintf(a, "%s/pre", dirname);
+    sprintf(b, "%s/pre/sub", dirname);
+    mkdir(a, 0700);
+    mkdir(b, 0700);
+    sprintf(a, "%s/pre/one.tpl", dirname);
+    sprintf(b, "%s/pre/sub/two.tpl", dirname);
+    sprintf(c, "%s/pre/broken.tpl", dirname);
+    write_file(a, "Preloaded one, {{Name}}\n");
+    write_file(b, "Preloaded two, {{Name}}\n");
+    symlink("does-not-exist.tpl", c);
+    sprintf(filename, "%s/pre/linked", dirname);
+    symlink("sub", filename);
+    
+    // Mapped templates must be terminated even when the file exactly fills its pages
+    sprintf(filename, "%s/pre/empty.tpl", dirname);
+    write_file(filename, "");
+    sprintf(filename, "%s/pre/page.tpl", dirname);
+    fp = fopen(filename, "w");
+    for (i = 0; i < sysconf(_SC_PAGESIZE); i++) {
+        fputc('x', fp);
+    }
+    fclose(fp);
+    
+    sprintf(d, "%s/pre", dirname);
+    fprintf(out, "%d files failed to preload\n", ngt_registry_preload_dir(reg, d, 3));
+    
+    ngt_registry_expand(reg, "empty.tpl", dict, &result);
+    fprintf(out, "empty.tpl expands to %lu characters\n", (unsigned long)strlen(result));
+    free(result);
+    
+    ngt_registry_expand(reg, "page.tpl", dict, &result);
+    fprintf(out, "page.tpl expands to %s page\n", strlen(result) == sysconf(_SC_PAGESIZE) ? "one" : "not one");
+    free(result);
+    
+    ngt_registry_expand(reg, "one.tpl", dict, &result);
+    fprintf(out, "%s", result);
+    free(result);
+    
+    ngt_registry_expand(reg, "sub/two.tpl", dict, &result);
+    fprintf(out, "%s", result);
+    free(result);
+    
+    unlink(a);
+    unlink(b);
+    unlink(c);
+    unlink(filename);
+    sprintf(filename, "%s/pre/empty.tpl", dirname);
+    unlink(filename);
+    sprintf(filename, "%s/pre/linked", dirname);
+    unlink(filename);
+    sprintf(b, "%s/pre/sub", dirname);
+    rmdir(b);
+    rmdir(d);
+    rmdir(dirname);
+    
+    free(original);
+    ngt_registry_destroy(reg);
+    ngt_dictionary_destroy(dict);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    RUN_TEST;
+}
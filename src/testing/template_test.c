@@ -221,9 +221,59 @@ char* variable_missing_cb(const char* marker)   {
     return res;
 }
 
+static int s_bulk_calls;
+
+void variables_missing_cb(const char** markers, char** values, int count)   {
+    int i;
+    
+    // Only answers for the Bulk markers, the rest is up to variable_missing_cb()
+    s_bulk_calls++;
+    for (i = 0; i < count; i++) {
+        if (!strncmp(markers[i], "Bulk", 4))    {
+            values[i] = (char*)malloc(strlen(markers[i]) + 32);
+            sprintf(values[i], "%s from call %d of %d", markers[i] + 4, s_bulk_calls, count);
+        }
+    }
+}
+
+char* lazy_value_cb(const char* marker, void* ctx) {
+    int* calls = (int*)ctx;
+    char* value;
+    
+    value = (char*)malloc(strlen(marker) + 32);
+    sprintf(value, "%s computed by call %d", marker, ++*calls);
+    
+    return value;
+}
+
+static int s_row_lazy_calls;
+
+ngt_dictionary* next_row_cb(const char* marker, void* ctx)   {
+    int* rows = (int*)ctx;
+    ngt_dictionary* row;
+    
+    if (*rows == 3) {
+        // Start over the next time the section is expanded
+        *rows = 0;
+        return 0;
+    }
+    
+    row = ngt_dictionary_new();
+    ngt_set_int(row, "Number", ++*rows);
+    ngt_set_lazy(row, "LazyRow", lazy_value_cb, &s_row_lazy_calls);
+    
+    return row;
+}
+
 DEFINE_TEST_FUNCTION    {
     char* result;
-    int line;
+    int line, lazy_calls, rows, slot, i;
+    char buffer[] = "Part of a buffer|and not part of the value";
+    const char* owner_names[] = { "first owner", "second owner", "third owner" };
+    const char* batch_markers[] = { "BatchShort", "BatchReplaced", "BatchLong", "A_batch_marker_longer_than_inline" };
+    const char* batch_values[] = { "short", "the first of two long values of the batch", "a value too long to live in its item", 
+                                   "long marker" };
+    const char* batch_replacements[] = { "tiny", "the second long value of the batch" };
     
     if (argc < 2)   {
         fprintf(stderr, "Invoking this test with zero arguments is not supported\n");
@@ -232,29 +282,139 @@ DEFINE_TEST_FUNCTION    {
     
     ngt_template* tpl = ngt_new();
     ngt_dictionary* dict = ngt_dictionary_new();
+    ngt_dictionary* overlay, *shared, *owner, *part;
+    ngt_schema* schema;
+    ngt_string_pool* pool;
     line = 1;
+    lazy_calls = 0;
+    rows = 0;
+    overlay = 0;
+    schema = 0;
+    pool = 0;
     
     ngt_load_from_file(tpl, in);
     read_in_dictionary(dict, tpl->tmpl, &line, 0);
+    
+    // To test ngt_schema_from_template().  The flags of a test are only known once its dictionary 
+    // has been read, so it is read again into a dictionary bound to the schema
+    if (ngt_variable_equals(dict, "Schema", "True"))    {
+        ngt_dictionary_destroy(dict);
+        schema = ngt_schema_from_template(tpl);
+        dict = ngt_dictionary_new_from_schema(schema);
+        line = 1;
+        read_in_dictionary(dict, tpl->tmpl, &line, 0);
+    }
+    
     ngt_set_include_cb(dict, "Callback_Template", get_template_cb, cleanup_template_cb);
+    
+    // To test ngt_dictionary_set_pool().  The values read so far move into the pool, and the ones
+    // set from here on go straight in
+    if (ngt_variable_equals(dict, "Pool", "True"))  {
+        pool = ngt_string_pool_new();
+        ngt_dictionary_set_pool(dict, pool);
+    }
         
     ngt_add_modifier(tpl, "modifier", modifier_cb);
     ngt_set_modifier_missing_cb(tpl, missing_modifier_cb);
     ngt_set_variable_missing_cb(tpl, variable_missing_cb);
+    ngt_set_variables_missing_cb(tpl, variables_missing_cb);
     
     // To test ngt_set_stringf(), ngt_set_int()
     ngt_set_stringf(dict, "FmtString", "(%d, %f, 0x%x, %s, %s some more %d)", 
         42, 3.14159, 0xdeadbeef, "A String", "Another String", -72 );
     ngt_set_int(dict, "IntValue", 12345);   // I have the same combination on my luggage
     
-    ngt_set_section_visibility(dict, "HiddenSection", NGT_SECTION_HIDDEN);
+    // To test typed values
+    ngt_set_int64(dict, "Int64Min", INT64_MIN);
+    ngt_set_int64(dict, "Int64Big", 9007199254740993LL);
+    ngt_set_double(dict, "DoubleWhole", -42.0);
+    ngt_set_double(dict, "DoublePi", 3.14159265358979);
+    ngt_set_double(dict, "DoubleSmall", 0.000125);
+    ngt_set_double(dict, "DoubleHuge", 6.02214076e23);
+    ngt_set_bool(dict, "BoolTrue", 7);
+    ngt_set_bool(dict, "BoolFalse", 0);
+    
+    // To test ngt_set_string_n(), ngt_set_string_ref().  Only the part before the '|' is used
+    ngt_set_string_n(dict, "CopiedPart", buffer, strchr(buffer, '|') - buffer);
+    ngt_set_string_ref(dict, "BorrowedPart", buffer, strchr(buffer, '|') - buffer);
+    
+    // To test ngt_set_lazy()
+    ngt_set_lazy(dict, "LazyOne", lazy_value_cb, &lazy_calls);
+    ngt_set_lazy(dict, "LazyTwo", lazy_value_cb, &lazy_calls);
+    ngt_set_lazy(dict, "LazyThree", lazy_value_cb, &lazy_calls);
     
-    ngt_set_dictionary(tpl, dict);
+    // To test ngt_set_slot()
+    slot = schema ? ngt_schema_slot(schema, "SlotValue") : -1;
+    if (slot >= 0)  {
+        ngt_set_slot(dict, slot, "set by slot");
+    }
+    
+    // To test ngt_set_section_iterator()
+    ngt_set_section_iterator(dict, "Rows", next_row_cb, &rows);
+    
+    // To test ngt_dictionary_ref().  The same card goes under three owners, and looks up what it
+    // doesn't have in whichever owner it is expanded in.  Hiding it under the last owner must not
+    // hide it under the others
+    shared = ngt_dictionary_new();
+    ngt_set_string(shared, "CardTitle", "shared card");
+    for (i = 0; i < 3; i++) {
+        owner = ngt_dictionary_new();
+        ngt_set_string(owner, "OwnerName", owner_names[i]);
+        ngt_add_dictionary(owner, "Card", i ? ngt_dictionary_ref(shared) : shared, NGT_SECTION_VISIBLE);
+        if (i == 2) {
+            ngt_set_section_visibility(owner, "Card", NGT_SECTION_HIDDEN);
+        }
+        ngt_add_dictionary(dict, "Owners", owner, NGT_SECTION_VISIBLE);
+    }
+    
+    // To test ngt_set_strings().  The second batch and the last ngt_set_string() overwrite values
+    // in place
+    if (ngt_variable_equals(dict, "Batch", "True")) {
+        ngt_set_strings(dict, batch_markers, batch_values, 4);
+        ngt_set_strings(dict, batch_markers, batch_replacements, 2);
+        ngt_set_string(dict, "BatchLong", "replaced in place, shorter");
+    }
+    
+    // To test ngt_dictionary_merge().  Values of the merged dictionary replace the ones it has in
+    // common with the test dictionary, and its rows come after the test dictionary's own
+    if (ngt_variable_equals(dict, "Merge", "True")) {
+        part = ngt_dictionary_new();
+        ngt_set_string(part, "MergedValue", "merged in");
+        ngt_set_string(part, "MergedOnly", "only in the merged dictionary");
+        owner = ngt_dictionary_new();
+        ngt_set_string(owner, "MergedRow", "second");
+        ngt_add_dictionary(part, "MergedRows", owner, NGT_SECTION_VISIBLE);
+        ngt_dictionary_merge(dict, part);
+        ngt_dictionary_destroy(part);
+    }
+    
+    ngt_set_section_visibility(dict, "HiddenSection", NGT_SECTION_HIDDEN);
     
     if (argc > 3)   {
         ngt_set_include_filename(dict, "Filename_Template", argv[3]);
     }
     
+    // To test ngt_dictionary_freeze().  Nothing can be set once it is frozen
+    if (ngt_variable_equals(dict, "Freeze", "True"))    {
+        if (ngt_dictionary_freeze(dict, 1) != 0 || ngt_set_string(dict, "NotAllowed", "frozen") == 0)   {
+            fprintf(stderr, "Could not freeze the dictionary, or changed it after\n");
+            return -1;
+        }
+    }
+    
+    // To test ngt_dictionary_overlay()
+    if (ngt_variable_equals(dict, "Overlay", "True"))   {
+        overlay = ngt_dictionary_overlay(dict);
+        ngt_set_string(overlay, "Shadowed", "from the overlay");
+        ngt_set_string(overlay, "OverlayOnly", "from the overlay");
+        ngt_set_section_visibility(overlay, "OverlayHidden", NGT_SECTION_HIDDEN);
+        
+        // The base is not ours to change, so this must not show the section anywhere
+        ngt_set_section_visibility(overlay, "HiddenSection", NGT_SECTION_VISIBLE);
+    }
+    
+    ngt_set_dictionary(tpl, overlay ? overlay : dict);
+    
     if (ngt_variable_equals(dict, "DelimiterTest", "True")) {
         ngt_set_delimiters(tpl, "<%", "%>");
     }
@@ -264,10 +424,28 @@ DEFINE_TEST_FUNCTION    {
     }
     
     fprintf(out, "%s\n", result);
-    
     free(result);
+    
+    if (overlay)    {
+        // The base expands the same as it did before the overlay was made
+        ngt_dictionary_destroy(overlay);
+        ngt_set_dictionary(tpl, dict);
+        if (ngt_expand(tpl, &result) < 0)   {
+            return -1;
+        }
+        
+        fprintf(out, "Without the overlay:\n%s\n", result);
+        free(result);
+    }
+    
     ngt_destroy(tpl);
     ngt_dictionary_destroy(dict);
+    if (schema) {
+        ngt_schema_destroy(schema);
+    }
+    if (pool)   {
+        ngt_string_pool_destroy(pool);
+    }
     return 0;
 }
 
@@ -0,0 +1,219 @@
+#include <pthread.h>
+#include "test_utils.h"
+#include "ngtemplate.h"
+
+#define NUM_THREADS     8
+#define NUM_EXPANSIONS  200
+
+/* The parts of the test dictionary, which are also built on threads of their own and merged */
+#define PART_VALUES     1
+#define PART_FIRST_ROWS 2
+#define PART_LAST_ROW   4
+#define PART_INCLUDES   8
+#define NUM_PARTS       4
+#define ALL_PARTS       ((1 << NUM_PARTS) - 1)
+
+/**
+ * Expands one shared template with one shared dictionary from many threads at once and makes sure
+ * every thread gets exactly the same output as a single-threaded expansion.  Every thread also
+ * builds dictionaries of its own from reused ones, which must not leak old values, and the test
+ * dictionary is built once more in parts on separate threads and merged.  Build with 
+ * -DNGT_SANITIZE_THREAD=ON to run this under ThreadSanitizer
+ */
+
+typedef struct thread_args_tag  {
+    ngt_template* tpl;
+    ngt_dictionary* dict;
+    const char* expected;
+    const char* include_file;
+    int failures;
+} thread_args;
+
+typedef struct part_args_tag    {
+    const char* include_file;
+    int part;
+    ngt_dictionary* dict;
+} part_args;
+
+char* get_template_cb(const char* name) {
+    char* template;
+    if (strcmp(name, "Callback_Template"))  {
+        return 0;
+    }
+    
+    template = (char*)malloc(1024);
+    memset(template, 0, 1024);
+    sprintf(template, "%s", "Callback says Key = {{Key}}\n\tand One = {{One}}\n");
+    
+    return template;
+}
+
+void cleanup_template_cb(const char* name, char* template)  {
+    free(template);
+}
+
+ngt_dictionary* build_dictionary(const char* include_file, ngt_dictionary* (*new_dictionary)(), int parts)   {
+    ngt_dictionary* dict = new_dictionary();
+    ngt_dictionary* child;
+    int i;
+    
+    if (parts & PART_VALUES)    {
+        ngt_set_string(dict, "Foo", "Bar");
+        ngt_set_int(dict, "Count", NUM_THREADS);
+        ngt_set_string(dict, "Html", "<b>Fish & Chips</b>");
+    }
+    
+    for (i = 0; i < 3; i++) {
+        if (!(parts & (i < 2 ? PART_FIRST_ROWS : PART_LAST_ROW)))   {
+            continue;
+        }
+        
+        child = new_dictionary();
+        ngt_set_int(child, "Index", i);
+        ngt_add_dictionary(dict, "Row", child, NGT_SECTION_VISIBLE);
+    }
+    
+    if (!(parts & PART_INCLUDES))   {
+        return dict;
+    }
+    
+    child = new_dictionary();
+    ngt_set_string(child, "Key", "This is a key");
+    ngt_set_string(child, "One", "One");
+    ngt_add_dictionary(dict, "Callback_Template", child, NGT_SECTION_VISIBLE);
+    ngt_set_include_cb(dict, "Callback_Template", get_template_cb, cleanup_template_cb);
+    
+    child = new_dictionary();
+    ngt_set_string(child, "Name", "John");
+    ngt_set_string(child, "Age", "21");
+    ngt_set_string(child, "Quote", "Cheers");
+    ngt_add_dictionary(dict, "Filename_Template", child, NGT_SECTION_VISIBLE);
+    ngt_set_include_filename(dict, "Filename_Template", include_file);
+    
+    return dict;
+}
+
+void* build_part_thread(void* data)    {
+    part_args* args = (part_args*)data;
+    
+    args->dict = build_dictionary(args->include_file, ngt_dictionary_new, args->part);
+    return 0;
+}
+
+void* expand_thread(void* data) {
+    thread_args* args = (thread_args*)data;
+    ngt_dictionary* own;
+    char* result;
+    int i;
+    
+    // Everybody races to initialize the library
+    ngt_init();
+    
+    for (i = 0; i < NUM_EXPANSIONS; i++)    {
+        ngt_expand_dictionary(args->tpl, args->dict, &result);
+        if (strcmp(result, args->expected)) {
+            args->failures++;
+        }
+        
+        free(result);
+        
+        if (i % 4 == 0) {
+            // Like a request of its own, which gets back the dictionaries of the last one
+            own = build_dictionary(args->include_file, ngt_dictionary_acquire, ALL_PARTS);
+            ngt_expand_dictionary(args->tpl, own, &result);
+            if (strcmp(result, args->expected)) {
+                args->failures++;
+            }
+            
+            free(result);
+            ngt_dictionary_release(own);
+        }
+    }
+    
+    return 0;
+}
+
+DEFINE_TEST_FUNCTION    {
+    pthread_t threads[NUM_THREADS];
+    thread_args args[NUM_THREADS];
+    part_args parts[NUM_PARTS];
+    char* expected, *result;
+    int i, failures;
+    
+    if (argc < 4)   {
+        fprintf(stderr, "USAGE: thread_test tstfile bmkfile includefile\n");
+        return -1;
+    }
+    
+    ngt_template* tpl = ngt_new();
+    ngt_dictionary* dict;
+    
+    ngt_load_from_file(tpl, in);
+    
+    // The reference output comes from its own dictionary, so the threads below still race to 
+    // load the includes of the shared one
+    dict = build_dictionary(argv[3], ngt_dictionary_new, ALL_PARTS);
+    ngt_expand_dictionary(tpl, dict, &expected);
+    ngt_dictionary_destroy(dict);
+    
+    // Frozen, so the threads read the frozen layout at the same time as well
+    dict = build_dictionary(argv[3], ngt_dictionary_new, ALL_PARTS);
+    ngt_dictionary_freeze(dict, 1);
+    
+    for (i = 0; i < NUM_THREADS; i++)   {
+        args[i].tpl = tpl;
+        args[i].dict = dict;
+        args[i].expected = expected;
+        args[i].include_file = argv[3];
+        args[i].failures = 0;
+        pthread_create(&threads[i], 0, expand_thread, &args[i]);
+    }
+    
+    failures = 0;
+    for (i = 0; i < NUM_THREADS; i++)   {
+        pthread_join(threads[i], 0);
+        failures += args[i].failures;
+    }
+    
+    if (failures)   {
+        fprintf(stderr, "%d expansions did not match the single-threaded output\n", failures);
+        return -1;
+    }
+    
+    ngt_dictionary_destroy(dict);
+    
+    // Every part on a thread of its own, then merged in order, so the rows end up in order as well
+    for (i = 0; i < NUM_PARTS; i++) {
+        parts[i].include_file = argv[3];
+        parts[i].part = 1 << i;
+        pthread_create(&threads[i], 0, build_part_thread, &parts[i]);
+    }
+    
+    for (i = 0; i < NUM_PARTS; i++) {
+        pthread_join(threads[i], 0);
+    }
+    
+    dict = parts[0].dict;
+    for (i = 1; i < NUM_PARTS; i++) {
+        ngt_dictionary_merge(dict, parts[i].dict);
+        ngt_dictionary_destroy(parts[i].dict);
+    }
+    
+    ngt_expand_dictionary(tpl, dict, &result);
+    if (strcmp(result, expected))   {
+        fprintf(stderr, "The merged dictionary did not match the single-threaded output\n");
+        return -1;
+    }
+    
+    fprintf(out, "%s\n", expected);
+    
+    free(result);
+    free(expected);
+    ngt_destroy(tpl);
+    ngt_dictionary_destroy(dict);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    RUN_TEST;
+}
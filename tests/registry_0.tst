@@ -0,0 +1 @@
+Hello {{Name}}, this template lives in a file
@@ -0,0 +1,14 @@
+{{! Tests that the bulk variables_missing callback gets all missing markers in one call }}
+{{!#
+Known=known
+Section={
+	Inner=inner
+}
+#!}}
+All of these come from a single call:
+	{{BulkOne}}
+	{{BulkTwo}}
+	{{#Section}}{{BulkThree}} next to an {{Inner}} value{{/Section}}
+	{{BulkOne:DynModifier}}
+The rest is resolved as before:
+	{{Known}}, {{DynOne}}, {{DynTwo}}
@@ -0,0 +1,11 @@
+{{! Tests that lazy values are only computed when they are reached, and only once }}
+{{!#
+HiddenSection={
+	Inside=inside
+}
+#!}}
+{{LazyOne}}
+{{LazyOne}}
+{{#HiddenSection}}{{LazyTwo}} is never computed{{/HiddenSection}}
+{{LazyThree}}
+{{LazyOne:DynModifier}}
@@ -0,0 +1,9 @@
+{{! Tests sections whose dictionaries come from an iterator one at a time }}
+{{!#
+Outer=outer value
+#!}}
+Rows: {{#Rows}}{{Number}}{{#Rows_separator}}, {{/Rows_separator}}{{/Rows}}
+Again, with values from the enclosing dictionary:
+{{#Rows}}
+	Row {{Number}} of the {{Outer}} ({{LazyRow}}, {{LazyRow}})
+{{/Rows}}
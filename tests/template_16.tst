@@ -0,0 +1,5 @@
+{{! Tests typed values, which are only formatted when they are expanded }}
+Integers: {{IntValue}}, {{Int64Min}}, {{Int64Big}}
+Doubles: {{DoubleWhole}}, {{DoublePi}}, {{DoubleSmall}}, {{DoubleHuge}}
+Booleans: {{BoolTrue}}, {{BoolFalse}}
+With a modifier: {{DoublePi:DynModifier}}
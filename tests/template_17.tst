@@ -0,0 +1,4 @@
+{{! Tests string values with a stored length, copied or borrowed }}
+Copied: [{{CopiedPart}}]
+Borrowed: [{{BorrowedPart}}]
+Borrowed, with a modifier: [{{BorrowedPart:DynModifier}}]
@@ -0,0 +1,26 @@
+{{! Tests overlay dictionaries: values set in the overlay hide the ones in the base }}
+{{!#
+Overlay=True
+Shadowed=from the base
+BaseOnly=from the base
+BaseSection={
+	Inner=inside a base section
+	Shadowed=from the base section
+}
+PlainBaseSection={
+	Inner=inside another base section
+}
+OverlayHidden={
+	Inner=never shown
+}
+HiddenSection={
+	Inner=hidden in the base
+}
+#!}}
+Shadowed: [{{Shadowed}}]
+Base only: [{{BaseOnly}}]
+Overlay only: [{{OverlayOnly}}]
+{{#BaseSection}}Section: [{{Inner}}], [{{Shadowed}}]{{/BaseSection}}
+{{#PlainBaseSection}}Section without them: [{{Shadowed}}], [{{OverlayOnly}}]{{/PlainBaseSection}}
+{{#OverlayHidden}}Hidden: [{{Inner}}]{{/OverlayHidden}}
+{{#HiddenSection}}Hidden in the base: [{{Inner}}]{{/HiddenSection}}
@@ -0,0 +1,24 @@
+{{! Tests that markers are found all the way up the chain of enclosing sections }}
+{{!#
+Top=from the top
+Middle=from the top, hidden by the middle
+Outer={
+	Middle=from the middle
+	Inner={
+		Name=first
+	}{
+		Name=second
+		Top=overridden by the second row
+	}{
+		Name=third
+	}
+}{
+	Inner={
+		Name=fourth
+	}
+}
+#!}}
+{{#Outer}}
+{{#Inner}}[{{Name}}: {{Top}}, {{Middle}}, {{NotAnywhere}}]
+{{/Inner}}
+{{/Outer}}
@@ -0,0 +1,15 @@
+{{! Tests dictionaries bound to the schema of their template, with values set by slot }}
+{{!#
+Schema=True
+Plain=set by name
+Section={
+	Inner=inside
+}{
+	Inner=inside again
+	SlotValue=hidden by the section
+}
+#!}}
+{{SlotValue}}, {{Plain}}
+{{#Section}}[{{Inner}}: {{SlotValue}}, {{Plain}}]
+{{/Section}}
+{{SlotValue:DynModifier}}
@@ -0,0 +1,36 @@
+{{! Tests markers and values on both sides of the length kept inside dictionary items }}
+{{!#
+Short=22 characters long..
+Longer=23 characters long...
+ThisMarkerIsTwentyTwo1=short
+ThisMarkerIsTwentyThree=a value that is far too long to be kept inside its item
+Replaced=first value, long enough to be on the heap
+Replaced=second
+Grown=short
+Grown=and then a value that no longer fits inside the item
+Key1=1
+Key2=2
+Key3=3
+Key4=4
+Key5=5
+Key6=6
+Key7=7
+Key8=8
+Key9=9
+Key10=10
+Key11=11
+Key12=12
+Key13=13
+Key14=14
+Key15=15
+Key16=16
+Key17=17
+Key18=18
+Key19=19
+Key20=20
+#!}}
+[{{Short}}] [{{Longer}}]
+[{{ThisMarkerIsTwentyTwo1}}] [{{ThisMarkerIsTwentyThree}}]
+[{{Replaced}}] [{{Grown}}]
+{{Key1}} {{Key2}} {{Key3}} {{Key4}} {{Key5}} {{Key6}} {{Key7}} {{Key8}} {{Key9}} {{Key10}}
+{{Key11}} {{Key12}} {{Key13}} {{Key14}} {{Key15}} {{Key16}} {{Key17}} {{Key18}} {{Key19}} {{Key20}}
@@ -0,0 +1,18 @@
+{{! Tests long values repeated across section rows, which share one copy in the string pool }}
+{{!#
+Pool=True
+Status=waiting for the warehouse to confirm
+Row={
+	Country=United Kingdom of Great Britain and Northern Ireland
+	Status=waiting for the warehouse to confirm
+}{
+	Country=United Kingdom of Great Britain and Northern Ireland
+	Status=shipped to the customer on Monday morning
+}{
+	Country=Short Name
+	Status=waiting for the warehouse to confirm
+}
+#!}}
+{{Status}}
+{{#Row}}{{Country}}: {{Status}}
+{{/Row}}
@@ -0,0 +1,3 @@
+{{! Tests one dictionary added under sections of two different parents }}
+{{#Owners}}{{OwnerName}}: {{#Card}}[{{CardTitle}} of {{OwnerName}}]{{/Card}}
+{{/Owners}}
@@ -0,0 +1,8 @@
+{{! Tests values set in batches, and replaced in place }}
+{{!#
+Batch=True
+#!}}
+{{BatchShort}}
+{{BatchReplaced}}
+{{BatchLong}}
+{{A_batch_marker_longer_than_inline}}
@@ -0,0 +1,9 @@
+{{! Tests merging a dictionary built on its own into the test dictionary }}
+{{!#
+Merge=True
+MergedValue=replaced by the merge
+MergedRows={
+	MergedRow=first
+}
+#!}}
+{{MergedValue}}: {{#MergedRows}}[{{MergedRow}}]{{/MergedRows}} {{MergedOnly}}
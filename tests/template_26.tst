@@ -0,0 +1,14 @@
+{{! Tests a file include expanded once for every row of the section around it }}
+{{!#
+People={
+	Name=alice
+}{
+	Name=bob
+}{
+	Name=carol
+}
+Filename_Template={
+	Unused=unused
+}
+#!}}
+{{#People}}{{>Filename_Template}}{{/People}}
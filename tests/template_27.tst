@@ -0,0 +1,16 @@
+{{! Tests expanding a frozen dictionary, which can't be changed anymore }}
+{{!#
+Freeze=True
+Title=frozen
+Row={
+	Name=first
+}{
+	Name=second
+	Nested={
+		Inner=deep inside
+	}
+}
+#!}}
+{{Title}}: {{#Row}}[{{Name}}{{#Nested}} {{Inner}}{{/Nested}}, {{Title}}]{{/Row}}
+Set by the test before freezing: {{IntValue}}, {{LazyOne}}
+Never set: [{{NotAllowed}}]
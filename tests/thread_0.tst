@@ -0,0 +1,11 @@
+This template is expanded by many threads at once
+
+Foo = {{Foo}}, expanded by {{Count}} threads
+Escaped: {{Html:html_escape}}
+
+{{#Row}}Row {{Index}}{{#Row_separator}}, {{/Row_separator}}{{/Row}}
+
+{{>Callback_Template}}
+A person:
+	{{>Filename_Template}}
+Done.